@@ -0,0 +1,61 @@
+/*
+ * accesslog.c - Common Log Format access log
+ *
+ * One line per connection, written with a single fprintf to a line
+ * buffered stream so that lines from different threads never mix.
+ * Clients are logged by numeric address; with resolve set, by the name
+ * the asynchronous reverse lookup service (rdns.c) has found for them,
+ * once it has. Logging is off unless accesslog_init names a file.
+ */
+/* $begin accesslog.c */
+#include "csapp.h"
+#include "accesslog.h"
+#include "rdns.h"
+
+static FILE *logfp;
+static int resolve_names;
+
+/*
+ * accesslog_init - append to the log at path ("-" for stdout)
+ */
+void accesslog_init(char *path, int resolve)
+{
+    if (!strcmp(path, "-"))
+        logfp = stdout;
+    else if (!(logfp = fopen(path, "a")))
+        unix_error("accesslog_init: fopen error");
+    setvbuf(logfp, NULL, _IOLBF, 0);
+
+    if ((resolve_names = resolve))
+        rdns_init();
+}
+
+/*
+ * accesslog_write - log one connection from the client at sa
+ */
+/* $begin accesslog_write */
+void accesslog_write(const struct sockaddr *sa, socklen_t salen, access_t *ac)
+{
+    char host[NI_MAXHOST], date[64], status[8];
+    time_t now;
+    struct tm tm;
+
+    if (!logfp)
+        return;
+
+    if (resolve_names)
+        rdns_name(sa, salen, host, sizeof(host));
+    else if (getnameinfo(sa, salen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(host, "-");
+
+    now = time(NULL);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", localtime_r(&now, &tm));
+    if (ac->status)
+        sprintf(status, "%d", ac->status);
+    else
+        strcpy(status, "-");
+
+    fprintf(logfp, "%s - - [%s] \"%s\" %s %ld\n", host, date, ac->request, status, ac->bytes);
+}
+/* $end accesslog_write */
+/* $end accesslog.c */
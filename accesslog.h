@@ -0,0 +1,21 @@
+/*
+ * accesslog.h - Common Log Format access log
+ */
+/* $begin accesslog.h */
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include "csapp.h"
+
+/* What the log records about one connection */
+typedef struct {
+    char request[MAXLINE];  /* method and URL, "-" if none was read */
+    int status;             /* status sent to the client, 0 if none */
+    long bytes;             /* response bytes sent to the client */
+} access_t;
+
+void accesslog_init(char *path, int resolve);
+void accesslog_write(const struct sockaddr *sa, socklen_t salen, access_t *ac);
+
+#endif /* __ACCESSLOG_H__ */
+/* $end accesslog.h */
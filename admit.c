@@ -0,0 +1,181 @@
+/*
+ * admit.c - adaptive admission control at accept time
+ *
+ * Bounds the number of connections in flight (queued for a worker or
+ * being served) by a limit that follows the queueing delay, in the
+ * spirit of CoDel: what matters is not how long the queue is but
+ * whether a standing delay persists. Each ADMIT_INTERVAL_MS the
+ * smallest delay seen by a connection between accept and pickup by a
+ * worker is compared with ADMIT_TARGET_MS. Above target (or if queued
+ * connections have not been picked up for a whole interval because
+ * every worker is stuck on a slow origin) the limit is cut by a
+ * quarter; below target, and only while it is being used, it grows
+ * back by an eighth.
+ *
+ * Over the limit, connections are either refused quickly with
+ * 503 + Retry-After (ADMIT_SHED) or simply not accepted until load
+ * drops (ADMIT_BACKLOG), so that the listen queue pushes back.
+ */
+/* $begin admit.c */
+#include <limits.h>
+#include "csapp.h"
+#include "admit.h"
+
+#define MS 1000000LL
+
+static int mode;
+static int limit, max_limit;
+static int inflight;         /* admitted, not yet finished */
+static int queued;           /* admitted, not yet picked up by a worker */
+static int peak;             /* most in flight during this interval */
+static long long interval_start, interval_min, last_dequeue;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t below_limit = PTHREAD_COND_INITIALIZER;
+
+static void adjust_locked(long long now);
+
+/*
+ * admit_init - start fully open, at max_limit connections in flight
+ */
+void admit_init(int max, int admit_mode)
+{
+    mode = admit_mode;
+    limit = max_limit = max;
+    inflight = queued = peak = 0;
+    interval_start = last_dequeue = monotonic_ns();
+    interval_min = LLONG_MAX;
+}
+
+/*
+ * admit_enter - called by the acceptor for each new connection
+ * Returns 1 if the connection is admitted, 0 if it must be rejected.
+ * In ADMIT_BACKLOG mode it waits for room instead and always admits.
+ */
+/* $begin admit_enter */
+int admit_enter(void)
+{
+    int admitted;
+
+    pthread_mutex_lock(&lock);
+    adjust_locked(monotonic_ns());
+    if (mode == ADMIT_BACKLOG)
+        while (inflight >= limit)
+            pthread_cond_wait(&below_limit, &lock);
+    if ((admitted = inflight < limit)) {
+        inflight++;
+        queued++;
+        if (inflight > peak)
+            peak = inflight;
+    }
+    pthread_mutex_unlock(&lock);
+    return admitted;
+}
+/* $end admit_enter */
+
+/*
+ * admit_dequeued - a worker picked up a connection accepted at accepted_ns
+ */
+void admit_dequeued(long long accepted_ns)
+{
+    long long now = monotonic_ns();
+
+    pthread_mutex_lock(&lock);
+    queued--;
+    last_dequeue = now;
+    if (now - accepted_ns < interval_min)
+        interval_min = now - accepted_ns;
+    adjust_locked(now);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * admit_exit - a worker finished with an admitted connection
+ */
+void admit_exit(void)
+{
+    pthread_mutex_lock(&lock);
+    inflight--;
+    pthread_cond_broadcast(&below_limit); /* the acceptor, or a drain */
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * admit_drain - wait up to secs for every admitted connection to finish
+ * Returns the number still in flight.
+ */
+int admit_drain(int secs)
+{
+    struct timespec deadline;
+    int left;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs;
+    pthread_mutex_lock(&lock);
+    while (inflight > 0 && 
+           pthread_cond_timedwait(&below_limit, &lock, &deadline) != ETIMEDOUT)
+        ;
+    left = inflight;
+    pthread_mutex_unlock(&lock);
+    return left;
+}
+
+/*
+ * admit_reject - fail a connection fast, e.g. with 503 Service Unavailable
+ */
+/* $begin admit_reject */
+void admit_reject(int fd, char *status, int retry_after)
+{
+    char buf[MAXLINE];
+
+    sprintf(buf, "HTTP/1.0 %s\r\n"
+            "Retry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", 
+            status, retry_after);
+    if (send(fd, buf, strlen(buf), MSG_DONTWAIT) > 0) {
+        /* read off the request so close() does not turn into a reset
+         * that could discard the 503 before the client sees it */
+        shutdown(fd, SHUT_WR);
+        recv(fd, buf, MAXLINE, MSG_DONTWAIT);
+    }
+    close(fd);
+}
+/* $end admit_reject */
+
+/*
+ * adjust_locked - once per interval, move the limit by the delay signal
+ */
+static void adjust_locked(long long now)
+{
+    long long delay = interval_min;
+
+    if (now - interval_start < ADMIT_INTERVAL_MS * MS)
+        return;
+
+    /* connections waiting while no worker has picked one up all interval */
+    if (queued > 0 && now - last_dequeue > delay)
+        delay = now - last_dequeue;
+
+    if (delay != LLONG_MAX && delay > ADMIT_TARGET_MS * MS) {
+        limit -= limit / 4;
+        if (limit < ADMIT_MIN_LIMIT)
+            limit = ADMIT_MIN_LIMIT;
+        printf("PROXY: Queueing delay %lld ms, admission limit now %d\n", delay / MS, limit);
+    } else if (peak >= limit && limit < max_limit) {
+        limit += limit / 8 + 1;
+        if (limit > max_limit)
+            limit = max_limit;
+        pthread_cond_broadcast(&below_limit);
+    }
+    interval_start = now;
+    interval_min = LLONG_MAX;
+    peak = inflight;
+}
+
+/* monotonic_ns - current CLOCK_MONOTONIC time in nanoseconds */
+long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+/* $end admit.c */
@@ -0,0 +1,26 @@
+/*
+ * admit.h - adaptive admission control at accept time
+ */
+/* $begin admit.h */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#define ADMIT_TARGET_MS    20  /* tolerated standing queueing delay */
+#define ADMIT_INTERVAL_MS  100 /* one limit adjustment per interval */
+#define ADMIT_MIN_LIMIT    4   /* never admit fewer than this */
+#define ADMIT_RETRY_AFTER  1   /* seconds, sent with 503 */
+
+/* What to do with a connection that arrives over the limit */
+#define ADMIT_SHED     0 /* answer 503 with Retry-After at once */
+#define ADMIT_BACKLOG  1 /* stop accepting; the kernel's LISTENQ queues it */
+
+void admit_init(int max_limit, int mode);
+int admit_enter(void);
+void admit_dequeued(long long accepted_ns);
+void admit_exit(void);
+void admit_reject(int fd, char *status, int retry_after);
+int admit_drain(int secs);
+long long monotonic_ns(void);
+
+#endif /* __ADMIT_H__ */
+/* $end admit.h */
@@ -0,0 +1,186 @@
+/*
+ * loadgen.c - skewed load through the proxy, and the latency of the light part
+ *
+ * Light clients fetch a small object over and over, each waiting for
+ * one response before it sends the next request, and every request's
+ * latency is recorded. Meanwhile, heavy clients download a large object
+ * and read it at a trickle, so each one ties up a proxy worker for
+ * seconds. That is the mix of lifetimes the work-stealing scheduler
+ * (steal.c, -S) was added for. After the run, the latency percentiles
+ * of the light requests are printed on one line, with how many there
+ * were and how many failed. bench/steal.sh runs it against the proxy
+ * with and without -S. With -H 0 there is no heavy load, and with -q
+ * each light request gets a query of its own, so that none is a cache
+ * hit; bench/sockopt.sh uses both.
+ *
+ * usage: loadgen -x proxyhost:port -u light_url [-U heavy_url] [-q]
+ *            [-l light_clients] [-H heavy_clients] [-r heavy_bytes_per_sec] [-d secs]
+ */
+/* $begin loadgen.c */
+#include <stdatomic.h>
+#include "csapp.h"
+
+#define LOADGEN_MAX_SAMPLES 500000    /* per light client */
+
+typedef struct {
+    long long *lat_us;       /* latency of each request, in us */
+    long n;
+    long failed;
+} light_t;
+
+static char *proxy_host, *proxy_port, *light_url, *heavy_url;
+static long heavy_rate = 65536;
+static int unique;           /* -q: no light request is a cache hit */
+static atomic_int stop;
+static atomic_long requests;
+
+static void *light_client(void *vargp);
+static void *heavy_client(void *vargp);
+static long fetch(char *url, long rate);
+static long long now_us(void);
+static int cmp_ll(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    int opt, i, nlight = 8, nheavy = 12, secs = 10;
+    long total = 0, failed = 0, k = 0;
+    long long *all;
+    pthread_t *tids;
+    light_t *light;
+    char *colon;
+
+    while ((opt = getopt(argc, argv, "x:u:U:l:H:r:d:q")) != -1) {
+        switch (opt) {
+        case 'x': proxy_host = optarg; break;
+        case 'u': light_url = optarg; break;
+        case 'U': heavy_url = optarg; break;
+        case 'l': nlight = atoi(optarg); break;
+        case 'H': nheavy = atoi(optarg); break;
+        case 'r': heavy_rate = atol(optarg); break;
+        case 'd': secs = atoi(optarg); break;
+        case 'q': unique = 1; break;
+        }
+    }
+    if (!proxy_host || !(colon = strchr(proxy_host, ':')) || !light_url || (nheavy && !heavy_url)) {
+        fprintf(stderr, "usage: %s -x proxyhost:port -u light_url [-U heavy_url] [-q] "
+            "[-l light] [-H heavy] [-r heavy_bytes_per_sec] [-d secs]\n", argv[0]);
+        exit(1);
+    }
+    *colon = '\0';
+    proxy_port = colon + 1;
+    Signal(SIGPIPE, SIG_IGN);
+
+    tids = Malloc((nlight + nheavy) * sizeof(pthread_t));
+    light = Calloc(nlight, sizeof(light_t));
+    for (i = 0; i < nheavy; i++)
+        Pthread_create(&tids[nlight + i], NULL, heavy_client, NULL);
+    if (nheavy)
+        sleep(1); /* let the heavy downloads take their workers */
+    for (i = 0; i < nlight; i++)
+        Pthread_create(&tids[i], NULL, light_client, &light[i]);
+    sleep(secs);
+    atomic_store(&stop, 1);
+    for (i = 0; i < nlight + nheavy; i++)
+        Pthread_join(tids[i], NULL);
+
+    for (i = 0; i < nlight; i++) {
+        total += light[i].n;
+        failed += light[i].failed;
+    }
+    if (!total) {
+        printf("no light request completed (%ld failed)\n", failed);
+        return 1;
+    }
+    all = Malloc(total * sizeof(long long));
+    for (i = 0; i < nlight; i++) {
+        memcpy(all + k, light[i].lat_us, light[i].n * sizeof(long long));
+        k += light[i].n;
+    }
+    qsort(all, total, sizeof(long long), cmp_ll);
+    printf("%8ld reqs %6.0f/s  p50 %7lld  p90 %7lld  p99 %7lld  p99.9 %7lld  max %8lld us  %ld failed\n",
+        total, (double)total / secs, all[total / 2], all[total * 9 / 10], all[total * 99 / 100],
+        all[total * 999 / 1000], all[total - 1], failed);
+    return 0;
+}
+
+/* light_client - fetch light_url back to back, timing each */
+static void *light_client(void *vargp)
+{
+    light_t *l = vargp;
+    char url[MAXLINE];
+    long long t;
+
+    l->lat_us = Malloc(LOADGEN_MAX_SAMPLES * sizeof(long long));
+    while (!atomic_load(&stop) && l->n < LOADGEN_MAX_SAMPLES) {
+        if (unique)
+            snprintf(url, sizeof(url), "%s%c%ld", light_url, strchr(light_url, '?') ? '&' : '?',
+                atomic_fetch_add(&requests, 1));
+        else
+            snprintf(url, sizeof(url), "%s", light_url);
+        t = now_us();
+        if (fetch(url, 0) > 0)
+            l->lat_us[l->n++] = now_us() - t;
+        else
+            l->failed++;
+    }
+    return NULL;
+}
+
+/* heavy_client - download heavy_url at heavy_rate, again and again */
+static void *heavy_client(void *vargp)
+{
+    while (!atomic_load(&stop))
+        fetch(heavy_url, heavy_rate);
+    return NULL;
+}
+
+/*
+ * fetch - GET url through the proxy and read the response to its end,
+ * at no more than rate bytes per second if rate is not 0
+ * Returns the bytes read, or -1 if the request failed or was refused.
+ */
+/* $begin fetch */
+static long fetch(char *url, long rate)
+{
+    char buf[MAXBUF + 1];
+    long got = 0, n;
+    long long start = now_us(), ahead;
+    int fd, status = 0;
+
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+        return -1;
+    snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", url);
+    if (rio_writen(fd, buf, strlen(buf)) < 0) {
+        close(fd);
+        return -1;
+    }
+    while (!atomic_load(&stop) || !rate) {
+        if ((n = read(fd, buf, rate && rate < sizeof(buf) ? rate : sizeof(buf) - 1)) <= 0)
+            break;
+        buf[n] = '\0';
+        if (!got)
+            sscanf(buf, "HTTP/%*d.%*d %d", &status);
+        got += n;
+        if (rate && (ahead = got * 1000000 / rate - (now_us() - start)) > 0)
+            usleep(ahead);
+    }
+    close(fd);
+    return status == 200 ? got : -1;
+}
+/* $end fetch */
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(long long *)a, y = *(long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+/* $end loadgen.c */
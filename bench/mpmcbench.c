@@ -0,0 +1,153 @@
+/*
+ * mpmcbench.c - microbenchmark of the connection handoff: sbuf vs mpmc
+ *
+ * One producer (the accept loop's part) inserts n connections, numbered
+ * 1..n, into a queue of the proxy's size, and c consumer threads (the
+ * workers) take them out until each gets a conn with fd -1. Every
+ * consumer sums and counts what it took; the totals must come to n
+ * items and n(n+1)/2, or the queue lost or duplicated one. The same run
+ * goes through the semaphore sbuf (sbuf.c, all from one client, so the
+ * round robin costs what it does for a single flow) and the lock-free
+ * mpmc (mpmc.c, as with -Q), and prints ns per item for each.
+ *
+ * usage: mpmcbench [-n items] [-c consumers] [-s slots] [-r rounds]
+ */
+/* $begin mpmcbench.c */
+#include <stdatomic.h>
+#include "csapp.h"
+#include "sbuf.h"
+#include "mpmc.h"
+
+#define BENCH_ITEMS     2000000
+#define BENCH_CONSUMERS 16      /* NTHREADS in proxy.c */
+#define BENCH_SLOTS     64      /* SBUFSIZE in proxy.c */
+#define BENCH_ROUNDS    3       /* the best round is reported */
+
+typedef struct {
+    const char *name;
+    void (*init)(void *q, int n);
+    void (*insert)(void *q, conn_t *item);
+    void (*remove)(void *q, conn_t *item);
+    void (*deinit)(void *q);
+} queue_ops_t;
+
+static sbuf_t sq;
+static mpmc_t mq;
+static void *queue;
+static const queue_ops_t *ops;
+static atomic_llong sum, count;
+
+static void *consumer(void *vargp);
+static double run(const queue_ops_t *o, void *q, long n, int c, int slots);
+
+/* the two queues behind one interface */
+static void s_init(void *q, int n) { sbuf_init(q, n); }
+static void s_insert(void *q, conn_t *item) { sbuf_insert(q, item); }
+static void s_remove(void *q, conn_t *item) { sbuf_remove(q, item); }
+static void s_deinit(void *q) { sbuf_deinit(q); }
+static void m_init(void *q, int n) { mpmc_init(q, n); }
+static void m_insert(void *q, conn_t *item) { mpmc_insert(q, item); }
+static void m_remove(void *q, conn_t *item) { mpmc_remove(q, item); }
+static void m_deinit(void *q) { Free(((mpmc_t *)q)->cells); }
+
+static const queue_ops_t queues[] = {
+    { "sbuf", s_init, s_insert, s_remove, s_deinit },
+    { "mpmc", m_init, m_insert, m_remove, m_deinit },
+};
+
+int main(int argc, char **argv)
+{
+    long n = BENCH_ITEMS;
+    int opt, i, r, c = BENCH_CONSUMERS, slots = BENCH_SLOTS, rounds = BENCH_ROUNDS;
+    double ns, best;
+
+    while ((opt = getopt(argc, argv, "n:c:s:r:")) != -1) {
+        switch (opt) {
+        case 'n': n = atol(optarg); break;
+        case 'c': c = atoi(optarg); break;
+        case 's': slots = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n items] [-c consumers] [-s slots] [-r rounds]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    printf("1 producer, %d consumers, %d slots, %ld items, %ld CPUs\n",
+        c, slots, n, sysconf(_SC_NPROCESSORS_ONLN));
+    for (i = 0; i < 2; i++) {
+        best = 0;
+        for (r = 0; r < rounds; r++)
+            if ((ns = run(&queues[i], i ? (void *)&mq : (void *)&sq, n, c, slots)) < 0)
+                exit(1);
+            else if (!best || ns < best)
+                best = ns;
+        printf("%-6s %8.1f ns/item  %10.0f items/s\n", queues[i].name, best, 1e9 / best);
+    }
+    return 0;
+}
+
+/*
+ * run - move n items through a fresh queue o to c consumers
+ * Returns ns per item, or -1 if the checksum does not match.
+ */
+/* $begin run */
+static double run(const queue_ops_t *o, void *q, long n, int c, int slots)
+{
+    static int client;          /* every conn from one client */
+    pthread_t *tids = Malloc(c * sizeof(pthread_t));
+    conn_t conn;
+    struct timespec t0, t1;
+    long i;
+
+    ops = o;
+    queue = q;
+    ops->init(q, slots);
+    atomic_store(&sum, 0);
+    atomic_store(&count, 0);
+    for (i = 0; i < c; i++)
+        Pthread_create(&tids[i], NULL, consumer, NULL);
+
+    memset(&conn, 0, sizeof(conn));
+    conn.client = (client_t *)&client;
+    conn.cost = CLIENT_MIN_COST;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 1; i <= n; i++) {
+        conn.fd = i;
+        ops->insert(q, &conn);
+    }
+    conn.fd = -1;               /* one stop for each consumer */
+    for (i = 0; i < c; i++)
+        ops->insert(q, &conn);
+    for (i = 0; i < c; i++)
+        Pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ops->deinit(q);
+    Free(tids);
+
+    if (atomic_load(&count) != n || atomic_load(&sum) != (long long)n * (n + 1) / 2) {
+        fprintf(stderr, "%s: checksum mismatch: %lld items, sum %lld\n",
+            o->name, atomic_load(&count), atomic_load(&sum));
+        return -1;
+    }
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n;
+}
+/* $end run */
+
+static void *consumer(void *vargp)
+{
+    conn_t conn;
+    long long s = 0, k = 0;
+
+    while (1) {
+        ops->remove(queue, &conn);
+        if (conn.fd < 0)
+            break;
+        s += conn.fd;
+        k++;
+    }
+    atomic_fetch_add(&sum, s);
+    atomic_fetch_add(&count, k);
+    return NULL;
+}
+/* $end mpmcbench.c */
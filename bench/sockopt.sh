@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# sockopt.sh - the effect of each socket option (-o, sockopt.c) on loopback
+#
+# Starts tiny on a directory holding a small page and a 1 MB file, then
+# runs the proxy once per profile: every option off, then each one
+# turned on by itself, then the default profile. For each it measures,
+# with loadgen and no background load:
+#   hit    latency of the small page, served from the proxy's cache
+#   miss   latency of a small CGI answer, fetched from tiny every time
+#   bulk   requests/s and MB/s of the 1 MB file, too large to cache
+#
+# usage: bench/sockopt.sh [secs] [clients]
+#
+SECS=${1:-5}
+CLIENTS=${2:-4}
+OFF="nodelay=0,cork=0,defer=0,fastopen=0,sndbuf=0,rcvbuf=0"
+PROFILES="${OFF}
+${OFF},nodelay
+${OFF},nodelay,cork
+${OFF},defer=1
+${OFF},fastopen=64
+${OFF},sndbuf=262144,rcvbuf=262144
+default"
+
+HOME_DIR=`pwd`
+DOCS=`mktemp -d`
+trap 'kill ${tiny_pid} ${proxy_pid} 2> /dev/null; rm -rf ${DOCS}' EXIT
+
+cp tiny/home.html ${DOCS}/small.html
+cp -r tiny/cgi-bin ${DOCS}/
+head -c 1048576 /dev/zero > ${DOCS}/big.bin
+
+tiny_port=`./free-port.sh`
+(cd ${DOCS} && exec ${HOME_DIR}/tiny/tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+sleep 1
+origin=http://localhost:${tiny_port}
+
+echo "${CLIENTS} clients, ${SECS} s per test, `nproc` CPUs"
+echo "${PROFILES}" | while read profile; do
+    proxy_port=`./free-port.sh`
+    if [ "${profile}" == "default" ]; then
+        ./proxy ${proxy_port} > /dev/null 2>&1 &
+    else
+        ./proxy ${proxy_port} -o ${profile} > /dev/null 2>&1 &
+    fi
+    proxy_pid=$!
+    sleep 1
+    curl --silent --proxy localhost:${proxy_port} --output /dev/null ${origin}/small.html
+    echo "${profile#${OFF}}" | sed 's/^,//; s/^$/all off/'
+    run="./bench/loadgen -x localhost:${proxy_port} -H 0 -d ${SECS} -l ${CLIENTS}"
+    printf "  hit  "; ${run} -u ${origin}/small.html
+    printf "  miss "; ${run} -q -u "${origin}/cgi-bin/adder?1&2"
+    printf "  bulk "; ${run} -u ${origin}/big.bin | awk '{ print; printf "       %.0f MB/s\n", $3 }'
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# steal.sh - tail latency under skewed load: the shared sbuf queue
+#     against the work-stealing workers (-S)
+#
+# Starts tiny on a directory holding a small page and a large file, then
+# for each proxy configuration starts the proxy, warms its cache with the
+# page, and runs loadgen: light clients fetch the cached page back to
+# back while heavy clients trickle the large file down, each holding a
+# worker for the length of its download. One line of light-request
+# latencies is printed per configuration.
+#
+# usage: bench/steal.sh [secs] [light] [heavy] [heavy_bytes_per_sec]
+#
+SECS=${1:-10}
+LIGHT=${2:-8}
+HEAVY=${3:-12}
+RATE=${4:-262144}
+BIG_MB=32
+WORKERS=16               # NTHREADS in proxy.c, so both have as many
+# every heavy download takes a worker: none is held back by the per-origin cap
+
+HOME_DIR=`pwd`
+DOCS=`mktemp -d`
+trap 'kill ${tiny_pid} ${proxy_pid} 2> /dev/null; rm -rf ${DOCS}' EXIT
+
+cp tiny/home.html ${DOCS}/small.html
+head -c $((BIG_MB * 1048576)) /dev/zero > ${DOCS}/big.bin
+
+tiny_port=`./free-port.sh`
+(cd ${DOCS} && exec ${HOME_DIR}/tiny/tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+sleep 1
+
+echo "${LIGHT} light, ${HEAVY} heavy clients at ${RATE} B/s, ${SECS} s, `nproc` CPUs"
+for config in "" "-S ${WORKERS}"; do
+    proxy_port=`./free-port.sh`
+    ./proxy ${proxy_port} -m ${WORKERS} ${config} > /dev/null 2>&1 &
+    proxy_pid=$!
+    sleep 1
+    curl --silent --proxy localhost:${proxy_port} --output /dev/null \
+        http://localhost:${tiny_port}/small.html
+    printf "%-8s" "${config:-sbuf}"
+    ./bench/loadgen -x localhost:${proxy_port} -d ${SECS} -l ${LIGHT} -H ${HEAVY} -r ${RATE} \
+        -u http://localhost:${tiny_port}/small.html -U http://localhost:${tiny_port}/big.bin
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
@@ -0,0 +1,76 @@
+/*
+ * bufpool.c - shared pool of relay buffers in a few size classes
+ *
+ * A connection only holds a relay buffer while it is moving a response
+ * and gives it back afterwards, so idle connections cost no buffer
+ * memory at all. Freed buffers are kept on a per-class stack (at most
+ * BUFPOOL_KEEP each) so the next response reuses memory that is likely
+ * still in cache instead of going back to malloc.
+ */
+/* $begin bufpool.c */
+#include "csapp.h"
+#include "bufpool.h"
+
+typedef struct free_buf {
+    struct free_buf *next;
+} free_buf_t;
+
+static free_buf_t *stacks[BUFPOOL_CLASSES];
+static int counts[BUFPOOL_CLASSES];
+static pthread_mutex_t locks[BUFPOOL_CLASSES] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+static int class_of(size_t size);
+
+/*
+ * bufpool_get - a buffer of size bytes, which must be a class size
+ */
+void *bufpool_get(size_t size)
+{
+    int c = class_of(size);
+    free_buf_t *b;
+
+    pthread_mutex_lock(&locks[c]);
+    if ((b = stacks[c]) != NULL) {
+        stacks[c] = b->next;
+        counts[c]--;
+    }
+    pthread_mutex_unlock(&locks[c]);
+    return b ? (void *)b : Malloc(size);
+}
+
+/*
+ * bufpool_put - return a buffer obtained from bufpool_get(size)
+ */
+void bufpool_put(void *buf, size_t size)
+{
+    int c = class_of(size);
+    free_buf_t *b = buf;
+
+    pthread_mutex_lock(&locks[c]);
+    if (counts[c] < BUFPOOL_KEEP) {
+        b->next = stacks[c];
+        stacks[c] = b;
+        counts[c]++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&locks[c]);
+    if (b)
+        Free(b);
+}
+
+/* class_of - index of the smallest class holding size bytes */
+static int class_of(size_t size)
+{
+    int c = 0;
+    size_t s = BUFPOOL_MIN;
+
+    while (s < size && c < BUFPOOL_CLASSES - 1) {
+        s *= 4;
+        c++;
+    }
+    return c;
+}
+/* $end bufpool.c */
@@ -0,0 +1,19 @@
+/*
+ * bufpool.h - shared pool of relay buffers in a few size classes
+ */
+/* $begin bufpool.h */
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+#define BUFPOOL_MIN     4096     /* smallest class; each class is 4x the last */
+#define BUFPOOL_MAX     262144   /* largest class */
+#define BUFPOOL_CLASSES 4        /* 4K, 16K, 64K, 256K */
+#define BUFPOOL_KEEP    16       /* idle buffers kept per class */
+
+void *bufpool_get(size_t size);
+void bufpool_put(void *buf, size_t size);
+
+#endif /* __BUFPOOL_H__ */
+/* $end bufpool.h */
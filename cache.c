@@ -0,0 +1,633 @@
+/*
+ * cache.c - in-memory web object cache, shared by the proxy's processes
+ *
+ * Objects are stored whole (status line, headers and body, exactly as
+ * received from the origin), MAX_CACHE_SIZE bytes of them at most; the
+ * least recently used object is evicted first.
+ *
+ * Every block carries its freshness lifetime and the two RFC 5861
+ * extensions: stale-while-revalidate lets an expired object be served
+ * immediately while a background refresh runs, stale-if-error lets it
+ * be served when the origin cannot be reached.
+ *
+ * The cache lives in one shared mapping made by cache_init, so that
+ * the worker processes forked with -P (prefork.c) all see every object.
+ * It holds no pointers, only offsets from the start of the region.
+ * Blocks (key and response) are carved from an arena kept as an
+ * implicit free list with boundary tags (CS:APP 9.9), and found
+ * through an open-addressing index split into CACHE_SEGMENTS segments
+ * with a lock each, so that lookups of different keys do not contend.
+ * A region lock covers the arena and eviction. It is taken before a
+ * segment lock, never while holding one. A block being filled in is
+ * reachable from no segment and skipped by eviction, so the object is
+ * copied into it with no lock held; one given up is freed under the
+ * region lock alone.
+ *
+ * The locks are robust process-shared mutexes. Whoever next takes a
+ * lock whose owner died mid-update is told so and repairs what may be
+ * half done: a segment is emptied, the whole cache is reset. Blocks
+ * left unreachable, or that a dead process was filling or giving up,
+ * are reclaimed when eviction comes to them.
+ */
+/* $begin cache.c */
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cache.h"
+#include "cachekey.h"
+
+/* Arena blocks, as in the CS:APP allocator: a size|allocated word
+ * before and after each payload, payloads 8-byte aligned */
+#define WSIZE 4
+#define DSIZE 8
+#define PACK(size, alloc)  ((size) | (alloc))
+#define GET(p)             (*(unsigned int *)(p))
+#define PUT(p, val)        (*(unsigned int *)(p) = (val))
+#define GET_SIZE(p)        (GET(p) & ~0x7)
+#define GET_ALLOC(p)       (GET(p) & 0x1)
+#define HDRP(bp)           ((char *)(bp) - WSIZE)
+#define FTRP(bp)           ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+#define NEXT_BLKP(bp)      ((char *)(bp) + GET_SIZE((char *)(bp) - WSIZE))
+#define PREV_BLKP(bp)      ((char *)(bp) - GET_SIZE((char *)(bp) - DSIZE))
+
+/* Block states */
+#define BLOCK_FILLING  1  /* being filled in, not yet indexed */
+#define BLOCK_LIVE     2  /* indexed */
+#define BLOCK_RETIRED  3  /* taken out of the index, to be freed */
+
+/* An object, at the start of an allocated arena payload */
+typedef struct {
+    uint64_t hash;             /* of the key */
+    int state;
+    pid_t owner;               /* process filling or retiring the block */
+    int keylen;                /* including the NUL */
+    int size;                  /* of the object, after the key */
+    time_t expires;            /* end of freshness lifetime */
+    int swr, sie;              /* stale windows beyond expires, seconds */
+    pid_t refresher;           /* process running a background refresh, or 0 */
+    unsigned long last_used;   /* LRU timestamp */
+    char data[];               /* key, then the response as received */
+} cache_block_t;
+
+typedef struct {
+    uint64_t hash;
+    unsigned int off;          /* of the block, 0 if the slot is empty */
+} cache_slot_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_slot_t slots[CACHE_SEG_SLOTS];
+} cache_seg_t;
+
+typedef struct {
+    pthread_mutex_t lock;      /* the arena, cache_size and generation */
+    unsigned int generation;   /* bumped by every reset */
+    int cache_size;            /* object bytes held */
+    atomic_ulong lru_clock;
+    cache_seg_t segs[CACHE_SEGMENTS];
+    char arena[CACHE_ARENA] __attribute__((aligned(DSIZE)));
+} cache_region_t;
+
+static cache_region_t *region;
+static int def_swr, def_sie;
+
+#define BLOCK(off)    ((cache_block_t *)((char *)region + (off)))
+#define OFFSET(b)     ((unsigned int)((char *)(b) - (char *)region))
+
+static void init_lock(pthread_mutex_t *m);
+static void region_lock(void);
+static void region_reset(void);
+static void seg_lock(cache_seg_t *s);
+static int seg_find(cache_seg_t *s, uint64_t hash, char *key);
+static int seg_find_block(cache_seg_t *s, cache_block_t *b);
+static int seg_free_slot(cache_seg_t *s, uint64_t hash);
+static cache_block_t *seg_remove_lru(cache_seg_t *s);
+static void seg_remove(cache_seg_t *s, int i);
+static cache_block_t *block_alloc(int keylen, int size);
+static void block_free(cache_block_t *b);
+static int evict_lru(void);
+static void arena_init(void);
+static void *arena_alloc(size_t n);
+static void arena_free(void *bp);
+static int process_alive(pid_t pid);
+static uint64_t hash_key(char *key);
+static int directive_value(char *p, char *name, int *val);
+static char *memstr(char *hay, int n, char *needle);
+
+#define SEG(hash)   (&region->segs[(hash) % CACHE_SEGMENTS])
+#define HOME(hash)  ((int)(((hash) / CACHE_SEGMENTS) % CACHE_SEG_SLOTS))
+
+/*
+ * cache_init - map an empty cache with the given stale defaults; call
+ * before forking to share it
+ */
+/* $begin cache_init */
+void cache_init(int default_swr, int default_sie)
+{
+    int i;
+
+    def_swr = default_swr;
+    def_sie = default_sie;
+    region = Mmap(NULL, sizeof(cache_region_t), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    init_lock(&region->lock);
+    for (i = 0; i < CACHE_SEGMENTS; i++)
+        init_lock(&region->segs[i].lock); /* slots are zeroed: empty */
+    atomic_init(&region->lru_clock, 0);
+    region->cache_size = 0;
+    region->generation = 0;
+    arena_init();
+}
+/* $end cache_init */
+
+/*
+ * cache_parse_policy - derive the freshness policy of a response from
+ * its status line and Cache-Control header; a Vary marker (cachekey.c)
+ * has that of the response it stands for, whose headers follow its
+ * first line
+ */
+/* $begin cache_parse_policy */
+void cache_parse_policy(char *obj, int size, cache_policy_t *policy)
+{
+    char *p, *end, *eol, status_line[64];
+    int status = 0, val;
+
+    policy->cacheable = 0;
+    policy->max_age = DEFAULT_MAX_AGE;
+    policy->swr = def_swr;
+    policy->sie = def_sie;
+
+    if (!strncmp(obj, VARY_MARKER, strlen(VARY_MARKER)) && (p = memstr(obj, size, "\r\n"))) {
+        size -= p + 2 - obj;
+        obj = p + 2;
+    }
+
+    /* only complete, successful responses are worth keeping */
+    if (!(end = memstr(obj, size, "\r\n\r\n")))
+        return;
+    eol = memstr(obj, end + 2 - obj, "\r\n");
+    snprintf(status_line, sizeof(status_line), "%.*s", (int)(eol - obj), obj);
+    if (sscanf(status_line, "HTTP/%*d.%*d %d", &status) != 1 || status != 200)
+        return;
+    policy->cacheable = 1;
+
+    for (p = eol + 2; p < end; p = eol + 2) {
+        eol = memstr(p, end + 2 - p, "\r\n");
+        if (strncasecmp(p, "Cache-Control:", 14))
+            continue;
+        for (p += 14; p < eol; p++) {
+            if (!strncasecmp(p, "no-store", 8) || !strncasecmp(p, "no-cache", 8) ||
+                !strncasecmp(p, "private", 7))
+                policy->cacheable = 0;
+            else if (directive_value(p, "s-maxage=", &val))
+                policy->max_age = val;
+            else if (directive_value(p, "max-age=", &val))
+                policy->max_age = val;
+            else if (directive_value(p, "stale-while-revalidate=", &val))
+                policy->swr = val;
+            else if (directive_value(p, "stale-if-error=", &val))
+                policy->sie = val;
+            /* skip to the next directive */
+            while (p < eol && *p != ',')
+                p++;
+        }
+    }
+}
+/* $end cache_parse_policy */
+
+/*
+ * cache_lookup - copy the object cached under key into objbuf
+ * Returns CACHE_MISS if there is nothing usable, otherwise the state
+ * of the copy; stale copies past their stale-if-error window are misses.
+ */
+/* $begin cache_lookup */
+int cache_lookup(char *key, char *objbuf, int *size)
+{
+    uint64_t hash = hash_key(key);
+    cache_seg_t *s = SEG(hash);
+    cache_block_t *b;
+    time_t now = time(NULL);
+    int i, state = CACHE_MISS;
+
+    seg_lock(s);
+    if ((i = seg_find(s, hash, key)) >= 0) {
+        b = BLOCK(s->slots[i].off);
+        if (now < b->expires)
+            state = CACHE_FRESH;
+        else if (now < b->expires + b->swr)
+            state = CACHE_REVALIDATE;
+        else if (now < b->expires + b->sie)
+            state = CACHE_STALE;
+
+        if (state != CACHE_MISS) {
+            memcpy(objbuf, b->data + b->keylen, b->size);
+            *size = b->size;
+            b->last_used = atomic_fetch_add(&region->lru_clock, 1) + 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return state;
+}
+/* $end cache_lookup */
+
+/*
+ * cache_insert - store a copy of obj under key, replacing any older
+ * copy and evicting least recently used objects to make room
+ */
+/* $begin cache_insert */
+void cache_insert(char *key, char *obj, int size, cache_policy_t *policy)
+{
+    uint64_t hash = hash_key(key);
+    cache_seg_t *s = SEG(hash);
+    cache_block_t *b, *old = NULL, *dropped = NULL;
+    unsigned int generation;
+    int i, keylen = strlen(key) + 1;
+
+    if (!policy->cacheable || size > MAX_OBJECT_SIZE)
+        return;
+
+    /* take a new block; neither lookups nor eviction look at it until
+     * it is published, so the object is copied in after the region lock
+     * is dropped, and a long copy holds up no one */
+    region_lock();
+    if ((b = block_alloc(keylen, size)) == NULL) {
+        pthread_mutex_unlock(&region->lock);
+        return;
+    }
+    b->hash = hash;
+    b->keylen = keylen;
+    b->size = size;
+    memcpy(b->data, key, keylen);
+    b->expires = time(NULL) + policy->max_age;
+    b->swr = policy->swr;
+    b->sie = policy->sie;
+    b->refresher = 0;
+    b->last_used = atomic_fetch_add(&region->lru_clock, 1) + 1;
+    generation = region->generation;
+    pthread_mutex_unlock(&region->lock);
+    memcpy(b->data + keylen, obj, size);
+
+    /* publish it in place of the old copy, if any */
+    seg_lock(s);
+    if (region->generation != generation) { /* reset meanwhile: b is gone */
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    if ((i = seg_find(s, hash, key)) >= 0) {
+        old = BLOCK(s->slots[i].off);
+        b->refresher = old->refresher;
+    } else {
+        if ((i = seg_free_slot(s, hash)) < 0) { /* segment full */
+            dropped = seg_remove_lru(s);
+            i = seg_free_slot(s, hash);
+        }
+        s->slots[i].hash = hash;
+    }
+    s->slots[i].off = OFFSET(b);
+    b->state = BLOCK_LIVE;
+    if (old) {
+        old->state = BLOCK_RETIRED;
+        old->owner = getpid();
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (old || dropped) {
+        region_lock();
+        if (region->generation == generation) {
+            if (old)
+                block_free(old);
+            if (dropped)
+                block_free(dropped);
+        }
+        pthread_mutex_unlock(&region->lock);
+    }
+}
+/* $end cache_insert */
+
+/*
+ * cache_claim_refresh - mark key as being refreshed in the background
+ * Returns 1 if the caller now owns the refresh, 0 if one is already
+ * running (or the object has since been evicted). A refresh claimed by
+ * a process that has died since is taken over.
+ */
+/* $begin cache_claim_refresh */
+int cache_claim_refresh(char *key)
+{
+    uint64_t hash = hash_key(key);
+    cache_seg_t *s = SEG(hash);
+    cache_block_t *b;
+    int i, claimed = 0;
+
+    seg_lock(s);
+    if ((i = seg_find(s, hash, key)) >= 0) {
+        b = BLOCK(s->slots[i].off);
+        if (!b->refresher || !process_alive(b->refresher)) {
+            b->refresher = getpid();
+            claimed = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return claimed;
+}
+/* $end cache_claim_refresh */
+
+/*
+ * cache_release_refresh - background refresh of key has finished
+ */
+void cache_release_refresh(char *key)
+{
+    uint64_t hash = hash_key(key);
+    cache_seg_t *s = SEG(hash);
+    int i;
+
+    seg_lock(s);
+    if ((i = seg_find(s, hash, key)) >= 0)
+        BLOCK(s->slots[i].off)->refresher = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/* locks */
+
+static void init_lock(pthread_mutex_t *m)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* region_lock - lock the arena; if its last owner died, start over */
+static void region_lock(void)
+{
+    if (pthread_mutex_lock(&region->lock) == EOWNERDEAD) {
+        fprintf(stderr, "cache: a process died updating the cache, resetting it\n");
+        region_reset();
+        pthread_mutex_consistent(&region->lock);
+    }
+}
+
+/* region_reset - empty the index and the arena; region lock held */
+static void region_reset(void)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SEGMENTS; i++) {
+        seg_lock(&region->segs[i]);
+        memset(region->segs[i].slots, 0, sizeof(region->segs[i].slots));
+    }
+    arena_init();
+    region->cache_size = 0;
+    region->generation++;
+    for (i = 0; i < CACHE_SEGMENTS; i++)
+        pthread_mutex_unlock(&region->segs[i].lock);
+}
+
+/* seg_lock - lock a segment; if its last owner died, forget its entries */
+static void seg_lock(cache_seg_t *s)
+{
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD) {
+        memset(s->slots, 0, sizeof(s->slots));
+        pthread_mutex_consistent(&s->lock);
+    }
+}
+
+
+/* index segments: linear probing from HOME(hash), segment lock held */
+
+static int seg_find(cache_seg_t *s, uint64_t hash, char *key)
+{
+    int n, i = HOME(hash);
+
+    for (n = 0; n < CACHE_SEG_SLOTS && s->slots[i].off; n++, i = (i + 1) % CACHE_SEG_SLOTS)
+        if (s->slots[i].hash == hash && !strcmp(BLOCK(s->slots[i].off)->data, key))
+            return i;
+    return -1;
+}
+
+static int seg_find_block(cache_seg_t *s, cache_block_t *b)
+{
+    int n, i = HOME(b->hash);
+
+    for (n = 0; n < CACHE_SEG_SLOTS && s->slots[i].off; n++, i = (i + 1) % CACHE_SEG_SLOTS)
+        if (s->slots[i].off == OFFSET(b))
+            return i;
+    return -1;
+}
+
+static int seg_free_slot(cache_seg_t *s, uint64_t hash)
+{
+    int n, i = HOME(hash);
+
+    for (n = 0; n < CACHE_SEG_SLOTS; n++, i = (i + 1) % CACHE_SEG_SLOTS)
+        if (!s->slots[i].off)
+            return i;
+    return -1;
+}
+
+/* seg_remove_lru - unindex the least recently used block of a full
+ * segment and return it, retired, for the caller to free */
+static cache_block_t *seg_remove_lru(cache_seg_t *s)
+{
+    cache_block_t *b, *victim = NULL;
+    int i, vi = 0;
+
+    for (i = 0; i < CACHE_SEG_SLOTS; i++) {
+        b = BLOCK(s->slots[i].off);
+        if (!victim || b->last_used < victim->last_used) {
+            victim = b;
+            vi = i;
+        }
+    }
+    seg_remove(s, vi);
+    victim->state = BLOCK_RETIRED;
+    victim->owner = getpid();
+    return victim;
+}
+
+/*
+ * seg_remove - empty slot i, moving later entries of its probe run back
+ * A full segment has no empty slot to end the run, so the scan also
+ * stops when it has come round to where it started.
+ */
+static void seg_remove(cache_seg_t *s, int i)
+{
+    int j = i, start = i, home;
+
+    while (1) {
+        j = (j + 1) % CACHE_SEG_SLOTS;
+        if (j == start || !s->slots[j].off)
+            break;
+        home = HOME(s->slots[j].hash);
+        /* move j into the hole unless its home lies cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            s->slots[i] = s->slots[j];
+            i = j;
+        }
+    }
+    s->slots[i].off = 0;
+}
+
+
+/* blocks: region lock held */
+
+/* block_alloc - a block for keylen + size bytes, evicting to make room */
+static cache_block_t *block_alloc(int keylen, int size)
+{
+    cache_block_t *b;
+
+    while (region->cache_size + size > MAX_CACHE_SIZE)
+        if (!evict_lru())
+            return NULL;
+    while ((b = arena_alloc(sizeof(cache_block_t) + keylen + size)) == NULL)
+        if (!evict_lru())
+            return NULL;
+    b->state = BLOCK_FILLING;
+    b->owner = getpid();
+    b->size = size;
+    region->cache_size += size;
+    return b;
+}
+
+static void block_free(cache_block_t *b)
+{
+    region->cache_size -= b->size;
+    arena_free(b);
+}
+
+/*
+ * evict_lru - free the least recently used indexed block, or a block
+ * that a dead process left behind
+ * Returns 0 if there was nothing to free.
+ */
+/* $begin evict_lru */
+static int evict_lru(void)
+{
+    cache_block_t *b, *victim = NULL;
+    cache_seg_t *s;
+    char *bp;
+    int i;
+
+    for (bp = region->arena + 2 * DSIZE; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if (!GET_ALLOC(HDRP(bp)))
+            continue;
+        b = (cache_block_t *)bp;
+        if (b->state != BLOCK_LIVE) {
+            if (!process_alive(b->owner)) {
+                block_free(b);
+                return 1;
+            }
+        } else if (!victim || b->last_used < victim->last_used)
+            victim = b;
+    }
+    if (!victim)
+        return 0;
+
+    s = SEG(victim->hash);
+    seg_lock(s);
+    if (victim->state != BLOCK_LIVE) { /* replaced meanwhile; its inserter frees it */
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+    if ((i = seg_find_block(s, victim)) >= 0) /* else an orphan of a reset segment */
+        seg_remove(s, i);
+    pthread_mutex_unlock(&s->lock);
+    block_free(victim);
+    return 1;
+}
+/* $end evict_lru */
+
+
+/* the arena: an implicit free list, first fit */
+
+static void arena_init(void)
+{
+    char *bp = region->arena + 2 * DSIZE;
+
+    PUT(region->arena + WSIZE, PACK(DSIZE, 1));      /* prologue header */
+    PUT(region->arena + DSIZE, PACK(DSIZE, 1));      /* prologue footer */
+    PUT(HDRP(bp), PACK(CACHE_ARENA - 2 * DSIZE, 0)); /* one free block */
+    PUT(FTRP(bp), PACK(CACHE_ARENA - 2 * DSIZE, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));            /* epilogue header */
+}
+
+static void *arena_alloc(size_t n)
+{
+    size_t asize = DSIZE * ((n + DSIZE + (DSIZE - 1)) / DSIZE), csize;
+    char *bp;
+
+    for (bp = region->arena + 2 * DSIZE; (csize = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+        if (GET_ALLOC(HDRP(bp)) || csize < asize)
+            continue;
+        if (csize - asize >= 2 * DSIZE) { /* split */
+            PUT(HDRP(bp), PACK(asize, 1));
+            PUT(FTRP(bp), PACK(asize, 1));
+            PUT(HDRP(NEXT_BLKP(bp)), PACK(csize - asize, 0));
+            PUT(FTRP(NEXT_BLKP(bp)), PACK(csize - asize, 0));
+        } else {
+            PUT(HDRP(bp), PACK(csize, 1));
+            PUT(FTRP(bp), PACK(csize, 1));
+        }
+        return bp;
+    }
+    return NULL;
+}
+
+static void arena_free(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    int prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
+    int next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+    if (!next_alloc)
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    if (!prev_alloc) {
+        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        bp = PREV_BLKP(bp);
+    }
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+}
+
+
+/* process_alive - whether pid still runs; ours always does */
+static int process_alive(pid_t pid)
+{
+    return pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* hash_key - 64-bit FNV-1a */
+static uint64_t hash_key(char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 1099511628211ULL;
+    return h;
+}
+
+/* directive_value - parse "name<seconds>" at p, skipping leading blanks */
+static int directive_value(char *p, char *name, int *val)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (strncasecmp(p, name, strlen(name)))
+        return 0;
+    *val = atoi(p + strlen(name));
+    return 1;
+}
+/* memstr - find needle in the first n bytes of hay, which may hold NULs */
+static char *memstr(char *hay, int n, char *needle)
+{
+    int len = strlen(needle);
+    char *p;
+
+    for (p = hay; p + len <= hay + n; p++)
+        if (*p == *needle && !memcmp(p, needle, len))
+            return p;
+    return NULL;
+}
+/* $end cache.c */
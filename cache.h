@@ -0,0 +1,46 @@
+/*
+ * cache.h - in-memory web object cache, shared by the proxy's processes
+ */
+/* $begin cache.h */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Layout of the shared region */
+#define CACHE_ARENA     (2 * MAX_CACHE_SIZE) /* objects, keys and fragmentation */
+#define CACHE_SEGMENTS  64   /* index segments, each under its own lock */
+#define CACHE_SEG_SLOTS 64   /* open-addressing slots per segment */
+
+/* Freshness defaults, applied when the origin does not send its own */
+#define DEFAULT_MAX_AGE 60  /* seconds an object is fresh without max-age */
+#define DEFAULT_SWR     30  /* stale-while-revalidate window, seconds */
+#define DEFAULT_SIE     300 /* stale-if-error window, seconds */
+
+/* Result of a cache lookup */
+#define CACHE_MISS       0 /* not cached */
+#define CACHE_FRESH      1 /* serve as-is */
+#define CACHE_REVALIDATE 2 /* expired, but within stale-while-revalidate */
+#define CACHE_STALE      3 /* expired; serve only if the origin fails */
+
+/* Freshness policy of a response, parsed from its Cache-Control header */
+typedef struct {
+    int cacheable;   /* 200 response without no-store/private/no-cache */
+    int max_age;     /* seconds the object stays fresh */
+    int swr;         /* stale-while-revalidate, seconds */
+    int sie;         /* stale-if-error, seconds */
+} cache_policy_t;
+
+void cache_init(int default_swr, int default_sie);
+void cache_parse_policy(char *obj, int size, cache_policy_t *policy);
+int cache_lookup(char *key, char *objbuf, int *size);
+void cache_insert(char *key, char *obj, int size, cache_policy_t *policy);
+int cache_claim_refresh(char *key);
+void cache_release_refresh(char *key);
+
+#endif /* __CACHE_H__ */
+/* $end cache.h */
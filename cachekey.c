@@ -0,0 +1,310 @@
+/*
+ * cachekey.c - canonical URLs, hashed cache keys and Vary
+ *
+ * The cache is keyed by the URL in a canonical form, so that requests
+ * that can only mean the same resource share one entry: the host is
+ * lowercased, the port always given, percent-escapes of unreserved
+ * characters decoded and all others written with uppercase hex digits
+ * (RFC 3986 6.2.2), dot segments removed, the query parameters put in
+ * order and any fragment dropped. The URL sent to the origin is left as
+ * the client wrote it. What is stored is not the URL itself but its
+ * 128-bit MurmurHash3 in CACHEKEY_LEN hex digits, which keeps index
+ * entries and peer requests short whatever the length of the URL.
+ *
+ * A response with Vary is only good for requests that agree with the
+ * one it answered on the headers named. Such a response is cached
+ * under a key of its own, made from the URL's and the values of those
+ * headers, and the URL's key holds a marker listing their names, from
+ * which a later request finds the key of its variant. Accept-Encoding
+ * is left out: the proxy sends the origin one of two fixed values,
+ * according to whether the client takes gzip, and already keeps the
+ * gzip and identity copies of a URL under separate keys.
+ */
+/* $begin cachekey.c */
+#include <stdint.h>
+#include "cachekey.h"
+
+static void normalize_escapes(char *s, char *end, char *out);
+static void remove_dots(char *in, char *out);
+static void sort_query(char *query, char *out);
+static int cmp_str(const void *a, const void *b);
+static int hexval(int c);
+static char *memstr(char *hay, int n, char *needle);
+static void murmur3_128(char *s, int len, uint64_t *h1, uint64_t *h2);
+static uint64_t fmix64(uint64_t k);
+
+/*
+ * cachekey_url - write the canonical form of http://host:port/path to
+ * url (MAXLINE bytes), whole: no part of it may be cut, or two URLs
+ * would share a key
+ * Returns its length, or -1 if it does not fit, and then the URL is
+ * not to be cached. readparse_request bounds the URI to MAXLINE / 2,
+ * and canonical forms are no longer but for the port, so it always does.
+ */
+/* $begin cachekey_url */
+int cachekey_url(char *host, char *port, char *path, char *url)
+{
+    char lhost[MAXLINE], buf[MAXLINE], canon[MAXLINE], query[MAXLINE], *q, *end;
+    int i, n;
+
+    if (strlen(host) >= MAXLINE)
+        return -1;
+    for (i = 0; host[i]; i++)
+        lhost[i] = tolower((unsigned char)host[i]);
+    lhost[i] = '\0';
+
+    end = path + strcspn(path, "#"); /* the fragment is the client's business */
+    q = memchr(path, '?', end - path);
+    normalize_escapes(path, q ? q : end, buf);
+    remove_dots(buf[0] == '/' ? buf : "/", canon);
+    strcpy(query, "");
+    if (q) {
+        normalize_escapes(q + 1, end, buf);
+        sort_query(buf, query);
+    }
+    n = snprintf(url, MAXLINE, "http://%s:%s%s%s%s",
+        lhost, port, canon, query[0] ? "?" : "", query);
+    return n < MAXLINE ? n : -1;
+}
+/* $end cachekey_url */
+
+/*
+ * cachekey_hash - the cache key of s: its MurmurHash3_x64_128 in hex,
+ * CACHEKEY_LEN digits and a NUL
+ */
+void cachekey_hash(char *s, char *key)
+{
+    uint64_t h1, h2;
+
+    murmur3_128(s, strlen(s), &h1, &h2);
+    sprintf(key, "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+}
+
+/*
+ * cachekey_vary - collect the request headers named by the Vary
+ * headers of response obj into names: lowercased, in order, without
+ * duplicates or Accept-Encoding, separated by commas
+ * Returns how many there are, or -1 for Vary: *, which no two
+ * requests can be known to agree on.
+ */
+/* $begin cachekey_vary */
+int cachekey_vary(char *obj, int size, char *names)
+{
+    char *list[CACHEKEY_PARAMS], buf[MAXLINE], pool[MAXLINE], *p, *eol, *hdrend, *tok, *save;
+    int i, n = 0, pooled = 0, used = 0;
+
+    names[0] = '\0';
+    if (!(hdrend = memstr(obj, size, "\r\n\r\n")))
+        return 0;
+    for (p = memstr(obj, size, "\r\n") + 2; p < hdrend + 2; p = eol + 2) {
+        eol = memstr(p, hdrend + 2 - p, "\r\n");
+        if (strncasecmp(p, "Vary:", 5))
+            continue;
+        snprintf(buf, MAXLINE, "%.*s", (int)(eol - p - 5), p + 5);
+        for (tok = strtok_r(buf, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+            if (!strcmp(tok, "*"))
+                return -1;
+            for (i = 0; tok[i]; i++)
+                tok[i] = tolower((unsigned char)tok[i]);
+            if (!strcmp(tok, "accept-encoding"))
+                continue;
+            for (i = 0; i < n && strcmp(list[i], tok); i++)
+                ;
+            if (i == n && n < CACHEKEY_PARAMS && pooled + strlen(tok) < MAXLINE) {
+                list[n++] = strcpy(pool + pooled, tok);
+                pooled += strlen(tok) + 1;
+            }
+        }
+    }
+
+    qsort(list, n, sizeof(char *), cmp_str);
+    for (i = 0; i < n && used + strlen(list[i]) + 2 < MAXLINE; i++)
+        used += sprintf(names + used, i ? ",%s" : "%s", list[i]);
+    return i;
+}
+/* $end cachekey_vary */
+
+/*
+ * cachekey_marker - build in marker (MAXBUF bytes) what to cache at the
+ * URL's key in place of response obj, which varies on names: a line
+ * naming them, then the status line and headers of obj, from which
+ * the marker takes its freshness
+ * Returns the size of the marker, or -1 if it does not fit.
+ */
+int cachekey_marker(char *obj, int size, char *names, char *marker)
+{
+    char *hdrend = memstr(obj, size, "\r\n\r\n");
+    int n = snprintf(marker, MAXBUF, "%s%s\r\n", VARY_MARKER, names);
+
+    if (!hdrend || n + (hdrend + 4 - obj) > MAXBUF)
+        return -1;
+    memcpy(marker + n, obj, hdrend + 4 - obj);
+    return n + (hdrend + 4 - obj);
+}
+
+/*
+ * cachekey_varies - if obj is a marker, copy the header names it lists
+ * to names and return 1, else return 0
+ */
+int cachekey_varies(char *obj, int size, char *names)
+{
+    int len = strlen(VARY_MARKER);
+    char *eol;
+
+    if (size < len || memcmp(obj, VARY_MARKER, len) || !(eol = memstr(obj, size, "\r\n")))
+        return 0;
+    snprintf(names, MAXLINE, "%.*s", (int)(eol - obj - len), obj + len);
+    return 1;
+}
+
+/*
+ * normalize_escapes - copy s up to end to out, decoding escaped
+ * unreserved characters and uppercasing the hex digits of the rest
+ */
+static void normalize_escapes(char *s, char *end, char *out)
+{
+    int hi, lo, c;
+
+    for ( ; s < end; s++) {
+        if (*s == '%' && s + 2 < end && (hi = hexval(s[1])) >= 0 && (lo = hexval(s[2])) >= 0) {
+            c = hi * 16 + lo;
+            if (isalnum(c) || (c && strchr("-._~", c)))
+                *out++ = c;
+            else
+                out += sprintf(out, "%%%02X", c);
+            s += 2;
+        } else
+            *out++ = *s;
+    }
+    *out = '\0';
+}
+
+/*
+ * remove_dots - copy path in (which begins with a slash) to out with
+ * its . and .. segments resolved (RFC 3986 5.2.4)
+ */
+/* $begin remove_dots */
+static void remove_dots(char *in, char *out)
+{
+    char *o = out;
+
+    while (*in) {
+        if (!strncmp(in, "/./", 3))
+            in += 2;
+        else if (!strcmp(in, "/."))
+            in = "/";
+        else if (!strncmp(in, "/../", 4) || !strcmp(in, "/..")) {
+            in = in[3] ? in + 3 : "/";
+            while (o > out && *--o != '/') /* drop the last segment */
+                ;
+        } else {
+            do
+                *o++ = *in++;
+            while (*in && *in != '/');
+        }
+    }
+    *o = '\0';
+}
+/* $end remove_dots */
+
+/*
+ * sort_query - copy the parameters of query to out in order, dropping
+ * empty ones; a query of more than CACHEKEY_PARAMS is left as it is
+ */
+static void sort_query(char *query, char *out)
+{
+    char *params[CACHEKEY_PARAMS], *p, *save;
+    int i, n = 0;
+
+    for (p = query; (p = strchr(p, '&')) != NULL; p++)
+        if (++n == CACHEKEY_PARAMS) {
+            strcpy(out, query);
+            return;
+        }
+    n = 0;
+    for (p = strtok_r(query, "&", &save); p; p = strtok_r(NULL, "&", &save))
+        params[n++] = p;
+    qsort(params, n, sizeof(char *), cmp_str);
+    out[0] = '\0';
+    for (i = 0; i < n; i++) {
+        if (i)
+            strcat(out, "&");
+        strcat(out, params[i]);
+    }
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* memstr - find needle in the first n bytes of hay, which may hold NULs */
+static char *memstr(char *hay, int n, char *needle)
+{
+    int len = strlen(needle);
+    char *p;
+
+    for (p = hay; p + len <= hay + n; p++)
+        if (*p == *needle && !memcmp(p, needle, len))
+            return p;
+    return NULL;
+}
+
+/* murmur3_128 - MurmurHash3_x64_128 of len bytes at s, seed 0 */
+/* $begin murmur3_128 */
+static void murmur3_128(char *s, int len, uint64_t *h1, uint64_t *h2)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *tail = (unsigned char *)s + len / 16 * 16;
+    uint64_t k1, k2, a = 0, b = 0;
+    int i;
+
+    for (i = 0; i < len / 16; i++) {
+        memcpy(&k1, s + i * 16, 8);
+        memcpy(&k2, s + i * 16 + 8, 8);
+        k1 *= c1; k1 = (k1 << 31) | (k1 >> 33); k1 *= c2; a ^= k1;
+        a = (a << 27) | (a >> 37); a += b; a = a * 5 + 0x52dce729;
+        k2 *= c2; k2 = (k2 << 33) | (k2 >> 31); k2 *= c1; b ^= k2;
+        b = (b << 31) | (b >> 33); b += a; b = b * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    for (i = (len & 15) - 1; i >= 8; i--)
+        k2 = (k2 << 8) | tail[i];
+    for (i = (len & 15) < 8 ? (len & 15) - 1 : 7; i >= 0; i--)
+        k1 = (k1 << 8) | tail[i];
+    if (len & 15) {
+        k2 *= c2; k2 = (k2 << 33) | (k2 >> 31); k2 *= c1; b ^= k2;
+        k1 *= c1; k1 = (k1 << 31) | (k1 >> 33); k1 *= c2; a ^= k1;
+    }
+
+    a ^= len; b ^= len;
+    a += b; b += a;
+    a = fmix64(a); b = fmix64(b);
+    a += b; b += a;
+    *h1 = a;
+    *h2 = b;
+}
+/* $end murmur3_128 */
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+/* $end cachekey.c */
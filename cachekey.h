@@ -0,0 +1,21 @@
+/*
+ * cachekey.h - canonical URLs, hashed cache keys and Vary
+ */
+/* $begin cachekey.h */
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include "csapp.h"
+
+#define CACHEKEY_LEN    32  /* hex digits in a key: a 128-bit hash */
+#define CACHEKEY_PARAMS 256 /* most query parameters put in order */
+#define VARY_MARKER     "VARY " /* begins what is cached at a varying URL's key */
+
+int cachekey_url(char *host, char *port, char *path, char *url);
+void cachekey_hash(char *s, char *key);
+int cachekey_vary(char *obj, int size, char *names);
+int cachekey_marker(char *obj, int size, char *names, char *marker);
+int cachekey_varies(char *obj, int size, char *names);
+
+#endif /* __CACHEKEY_H__ */
+/* $end cachekey.h */
@@ -0,0 +1,188 @@
+/*
+ * client.c - per-client token buckets and fair-queuing cost
+ *
+ * Every client IP address gets a record with two token buckets, one
+ * counting requests and one counting response bytes. Buckets are not
+ * refilled by a timer: each access first credits the tokens earned
+ * since the last one (rate * elapsed, capped at CLIENT_BURST_SECS of
+ * rate), so checking a client costs one hash lookup and a little
+ * arithmetic under a striped lock.
+ *
+ * A request takes one request token up front. Its size is only known
+ * once it has been served, so the bytes are charged afterwards and may
+ * drive the byte bucket into debt; the client is then refused until
+ * the debt has been paid off. Refused clients are told how many
+ * seconds that will take.
+ *
+ * The record also keeps a running average of response size, which the
+ * connection queue (sbuf.c) uses as the cost of the client's next
+ * request when it schedules clients by deficit round robin.
+ */
+/* $begin client.c */
+#include "csapp.h"
+#include "client.h"
+#include "admit.h"
+
+struct client {
+    int family;
+    unsigned char addr[16];   /* IPv4 or IPv6 address */
+    unsigned chain;           /* index into buckets */
+    int refs;                 /* connections holding the record */
+    double req_tokens;
+    double byte_tokens;       /* negative: in debt */
+    long long stamp;          /* monotonic ns of the last refill */
+    long avg_bytes;           /* running average response size */
+    struct client *next;
+};
+
+static client_t *buckets[CLIENT_BUCKETS];
+static pthread_mutex_t locks[CLIENT_STRIPES];
+static int req_rate;
+static long byte_rate;
+
+static unsigned hash_addr(int family, unsigned char *addr, int len);
+static void refill(client_t *c, long long now);
+
+void client_init(int reqs, long bytes)
+{
+    int i;
+
+    req_rate = reqs;
+    byte_rate = bytes;
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < CLIENT_STRIPES; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+/*
+ * client_acquire - find or create the record for the address in sa
+ * The caller holds a reference until client_release.
+ */
+/* $begin client_acquire */
+client_t *client_acquire(const struct sockaddr *sa)
+{
+    unsigned char addr[16];
+    int len;
+    unsigned h;
+    long long now = monotonic_ns();
+    client_t *c, **pp;
+
+    memset(addr, 0, sizeof(addr));
+    if (sa->sa_family == AF_INET6) {
+        len = 16;
+        memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, len);
+    } else {
+        len = 4;
+        memcpy(addr, &((struct sockaddr_in *)sa)->sin_addr, len);
+    }
+    h = hash_addr(sa->sa_family, addr, len) % CLIENT_BUCKETS;
+
+    pthread_mutex_lock(&locks[h % CLIENT_STRIPES]);
+    for (pp = &buckets[h]; (c = *pp) != NULL; ) {
+        if (c->family == sa->sa_family && !memcmp(c->addr, addr, sizeof(addr)))
+            break;
+        if (!c->refs && now - c->stamp > CLIENT_IDLE_SECS * 1000000000LL) {
+            *pp = c->next; /* reclaim on the way */
+            Free(c);
+            continue;
+        }
+        pp = &c->next;
+    }
+    if (!c) {
+        c = Calloc(1, sizeof(client_t));
+        c->family = sa->sa_family;
+        c->chain = h;
+        memcpy(c->addr, addr, sizeof(addr));
+        c->req_tokens = (double)req_rate * CLIENT_BURST_SECS;
+        c->byte_tokens = (double)byte_rate * CLIENT_BURST_SECS;
+        c->stamp = now;
+        c->next = buckets[h];
+        buckets[h] = c;
+    }
+    c->refs++;
+    pthread_mutex_unlock(&locks[h % CLIENT_STRIPES]);
+    return c;
+}
+/* $end client_acquire */
+
+/*
+ * client_admit - take a request token from c
+ * Returns 0 if the request may proceed, with the fair-queuing cost of
+ * the request in *cost; otherwise the number of seconds until it could.
+ */
+/* $begin client_admit */
+int client_admit(client_t *c, int *cost)
+{
+    pthread_mutex_t *lock = &locks[c->chain % CLIENT_STRIPES];
+    double wait = 0;
+
+    pthread_mutex_lock(lock);
+    refill(c, monotonic_ns());
+    if (req_rate && c->req_tokens < 1)
+        wait = (1 - c->req_tokens) / req_rate;
+    if (byte_rate && c->byte_tokens < 0 && -c->byte_tokens / byte_rate > wait)
+        wait = -c->byte_tokens / byte_rate;
+    if (wait == 0)
+        c->req_tokens -= 1;
+    *cost = c->avg_bytes < CLIENT_MIN_COST ? CLIENT_MIN_COST :
+        c->avg_bytes > CLIENT_MAX_COST ? CLIENT_MAX_COST : c->avg_bytes;
+    pthread_mutex_unlock(lock);
+
+    return wait == 0 ? 0 : (int)wait + 1;
+}
+/* $end client_admit */
+
+/*
+ * client_charge - account for bytes sent to c in answer to one request
+ */
+void client_charge(client_t *c, long bytes)
+{
+    pthread_mutex_t *lock = &locks[c->chain % CLIENT_STRIPES];
+
+    pthread_mutex_lock(lock);
+    refill(c, monotonic_ns());
+    if (byte_rate)
+        c->byte_tokens -= bytes;
+    c->avg_bytes += (bytes - c->avg_bytes) / 8;
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * client_release - drop a reference taken by client_acquire
+ */
+void client_release(client_t *c)
+{
+    pthread_mutex_t *lock = &locks[c->chain % CLIENT_STRIPES];
+
+    pthread_mutex_lock(lock);
+    c->refs--;
+    pthread_mutex_unlock(lock);
+}
+
+/* helpers */
+
+/* hash_addr - FNV-1a over the address bytes */
+static unsigned hash_addr(int family, unsigned char *addr, int len)
+{
+    unsigned h = 2166136261u ^ family;
+    int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ addr[i]) * 16777619u;
+    return h;
+}
+
+/* refill - credit the tokens earned since the last access; caller holds the lock */
+static void refill(client_t *c, long long now)
+{
+    double secs = (now - c->stamp) / 1e9;
+
+    c->stamp = now;
+    c->req_tokens += secs * req_rate;
+    if (c->req_tokens > (double)req_rate * CLIENT_BURST_SECS)
+        c->req_tokens = (double)req_rate * CLIENT_BURST_SECS;
+    c->byte_tokens += secs * byte_rate;
+    if (c->byte_tokens > (double)byte_rate * CLIENT_BURST_SECS)
+        c->byte_tokens = (double)byte_rate * CLIENT_BURST_SECS;
+}
+/* $end client.c */
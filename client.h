@@ -0,0 +1,28 @@
+/*
+ * client.h - per-client token buckets and fair-queuing cost
+ */
+/* $begin client.h */
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#include <sys/socket.h>
+
+#define CLIENT_BUCKETS    1024   /* hash chains over client addresses */
+#define CLIENT_STRIPES    64     /* locks; chain i is guarded by lock i % CLIENT_STRIPES */
+#define CLIENT_REQ_RATE   0      /* default requests/sec per client, 0 = unlimited */
+#define CLIENT_BYTE_RATE  0      /* default bytes/sec per client, 0 = unlimited */
+#define CLIENT_BURST_SECS 2      /* bucket depth, in seconds' worth of rate */
+#define CLIENT_IDLE_SECS  60     /* records idle this long are reclaimed */
+#define CLIENT_MIN_COST   1024   /* fair-queuing cost of a request, bytes */
+#define CLIENT_MAX_COST   262144
+
+typedef struct client client_t;
+
+void client_init(int req_rate, long byte_rate);
+client_t *client_acquire(const struct sockaddr *sa);
+int client_admit(client_t *c, int *cost);
+void client_charge(client_t *c, long bytes);
+void client_release(client_t *c);
+
+#endif /* __CLIENT_H__ */
+/* $end client.h */
@@ -0,0 +1,392 @@
+/*
+ * coro.c - coroutines on epoll event loops
+ *
+ * With -C the proxy serves each connection on a coroutine instead of a
+ * worker thread, so that the straight-line request path (doit and all
+ * it calls) needs no OS thread while it waits. A fixed number of loop
+ * threads each run an epoll loop; a coroutine stays on the loop it was
+ * spawned on and runs on a stack of its own, switched to with
+ * swapcontext. Sockets are non-blocking, and where the rio wrappers
+ * would have blocked they call coro_poll, which registers the
+ * descriptors with the loop, switches back to it and returns, poll-like,
+ * once one of them is ready or the timeout has passed. Outside a
+ * coroutine coro_poll is plain poll, so the same code still runs on
+ * ordinary threads.
+ *
+ * Registrations last for one wait only, and an event that arrives for a
+ * coroutine no longer waiting on it at most wakes it early: coro_poll
+ * checks with poll before returning. Deadlines are kept in a binary heap
+ * per loop. Work that can only block, such as getaddrinfo, is run by
+ * coro_offload on a helper thread while the coroutine is parked.
+ *
+ * Stacks are mapped with a guard page below them and committed only as
+ * they are touched; each loop keeps up to CORO_POOL of them for reuse.
+ */
+/* $begin coro.c */
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "coro.h"
+#include "admit.h"
+
+#define WAIT_POLL    1       /* parked in coro_poll */
+#define WAIT_OFFLOAD 2       /* parked in coro_offload */
+
+typedef struct loop loop_t;
+
+struct coro {
+    ucontext_t ctx;
+    char *stack;             /* NULL until first run */
+    loop_t *loop;
+    void (*fn)(void *);      /* the coroutine body */
+    void *arg;
+    void (*off_fn)(void *);  /* work being offloaded */
+    void *off_arg;
+    int waiting;             /* WAIT_POLL, WAIT_OFFLOAD or 0 */
+    int done;
+    long long deadline;      /* of the current coro_poll */
+    int heap_index;          /* in the loop's timer heap, -1 if not */
+    coro_t *next;            /* on an inbox or the dead list */
+};
+
+struct loop {
+    int epfd;
+    int wakefd;              /* eventfd: the inbox has coroutines */
+    ucontext_t main;         /* the loop's own context */
+    coro_t *current;
+    pthread_mutex_t lock;    /* guards inbox */
+    coro_t *inbox;           /* new, or done offloading; newest first */
+    coro_t **heap;           /* waiting coroutines by deadline */
+    int nheap, heapsize;
+    char *pool[CORO_POOL];   /* stacks for reuse */
+    int npool;
+    coro_t *dead;            /* freed once the events in hand are handled */
+};
+
+int coro_enabled = 0;
+
+static loop_t *loops;
+static int nloops;
+static unsigned int next_loop;
+static size_t pagesize;
+static __thread loop_t *self_loop;
+
+static void *loop_thread(void *vargp);
+static void resume(loop_t *l, coro_t *c);
+static void trampoline(void);
+static void *offload_thread(void *vargp);
+static void post(loop_t *l, coro_t *c);
+static char *stack_get(loop_t *l);
+static void stack_put(loop_t *l, char *stack);
+static void heap_push(loop_t *l, coro_t *c);
+static void heap_remove(loop_t *l, coro_t *c);
+static void heap_sift(loop_t *l, int i);
+
+/*
+ * coro_init - start n loop threads
+ */
+void coro_init(int n)
+{
+    struct epoll_event ev;
+    pthread_t tid;
+    int i;
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    nloops = n;
+    loops = Calloc(n, sizeof(loop_t));
+    for (i = 0; i < n; i++) {
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (loops[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            unix_error("coro_init error");
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; /* no coroutine: the inbox */
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev);
+        pthread_mutex_init(&loops[i].lock, NULL);
+        loops[i].heapsize = 1024;
+        loops[i].heap = Malloc(loops[i].heapsize * sizeof(coro_t *));
+        Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    }
+    coro_enabled = 1;
+}
+
+/*
+ * coro_spawn - run fn(arg) on a new coroutine, on the next loop in turn
+ */
+void coro_spawn(void (*fn)(void *), void *arg)
+{
+    coro_t *c = Calloc(1, sizeof(coro_t));
+
+    c->fn = fn;
+    c->arg = arg;
+    c->heap_index = -1;
+    c->loop = &loops[__sync_fetch_and_add(&next_loop, 1) % nloops];
+    post(c->loop, c);
+}
+
+/* coro_self - the running coroutine, NULL on an ordinary thread */
+coro_t *coro_self(void)
+{
+    return self_loop ? self_loop->current : NULL;
+}
+
+/*
+ * coro_poll - poll(2) that parks the calling coroutine rather than its
+ * thread; the descriptors must not be waited on by anyone else
+ */
+/* $begin coro_poll */
+int coro_poll(struct pollfd *fds, int n, int timeout_ms)
+{
+    coro_t *c = coro_self();
+    loop_t *l;
+    struct epoll_event ev;
+    int i, r;
+
+    if (!c || timeout_ms == 0)
+        return poll(fds, n, timeout_ms);
+
+    l = c->loop;
+    c->deadline = timeout_ms > 0 ? monotonic_ns() + timeout_ms * 1000000LL : 0;
+    do {
+        /* adding a descriptor that is ready already reports it at once */
+        for (i = 0; i < n; i++) {
+            if (fds[i].fd < 0)
+                continue;
+            ev.events = EPOLLONESHOT | EPOLLRDHUP |
+                (fds[i].events & POLLIN ? EPOLLIN : 0) |
+                (fds[i].events & POLLOUT ? EPOLLOUT : 0);
+            ev.data.ptr = c;
+            epoll_ctl(l->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev);
+        }
+        if (c->deadline)
+            heap_push(l, c);
+        c->waiting = WAIT_POLL;
+        swapcontext(&c->ctx, &l->main);
+        if (c->heap_index >= 0)
+            heap_remove(l, c);
+        for (i = 0; i < n; i++)
+            if (fds[i].fd >= 0)
+                epoll_ctl(l->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+
+        if ((r = poll(fds, n, 0)) != 0)
+            return r;
+    } while (!c->deadline || monotonic_ns() < c->deadline);
+    return 0;
+}
+/* $end coro_poll */
+
+/*
+ * coro_offload - run fn(arg) on a helper thread while the calling
+ * coroutine is parked; on an ordinary thread, just call it
+ */
+void coro_offload(void (*fn)(void *), void *arg)
+{
+    coro_t *c = coro_self();
+    pthread_t tid;
+
+    if (c) {
+        c->off_fn = fn;
+        c->off_arg = arg;
+        c->waiting = WAIT_OFFLOAD;
+        if (pthread_create(&tid, NULL, offload_thread, c) == 0) {
+            swapcontext(&c->ctx, &c->loop->main); /* until post */
+            return;
+        }
+        c->waiting = 0;
+    }
+    fn(arg);
+}
+
+static void *offload_thread(void *vargp)
+{
+    coro_t *c = vargp;
+
+    Pthread_detach(pthread_self());
+    c->off_fn(c->off_arg);
+    post(c->loop, c);
+    return NULL;
+}
+
+/*
+ * loop_thread - run coroutines as their descriptors, deadlines and
+ * inbox entries come due
+ */
+/* $begin loop_thread */
+static void *loop_thread(void *vargp)
+{
+    loop_t *l = vargp;
+    struct epoll_event events[CORO_EVENTS];
+    coro_t *c, *list, *next;
+    long long now, wait;
+    uint64_t v;
+    int i, n, timeout;
+
+    Pthread_detach(pthread_self());
+    self_loop = l;
+    while (1) {
+        timeout = -1;
+        if (l->nheap) {
+            wait = l->heap[0]->deadline - monotonic_ns();
+            timeout = wait <= 0 ? 0 : (int)((wait + 999999) / 1000000);
+        }
+        n = epoll_wait(l->epfd, events, CORO_EVENTS, timeout);
+
+        for (i = 0; i < n; i++) {
+            if ((c = events[i].data.ptr) != NULL) {
+                if (c->waiting == WAIT_POLL)
+                    resume(l, c);
+                continue;
+            }
+            if (read(l->wakefd, &v, sizeof(v)) < 0)
+                ; /* drained by an earlier event this round */
+            pthread_mutex_lock(&l->lock);
+            list = l->inbox;
+            l->inbox = NULL;
+            pthread_mutex_unlock(&l->lock);
+            for (c = NULL; list; list = next) { /* oldest first */
+                next = list->next;
+                list->next = c;
+                c = list;
+            }
+            for ( ; c; c = next) {
+                next = c->next;
+                resume(l, c);
+            }
+        }
+
+        now = monotonic_ns();
+        while (l->nheap && l->heap[0]->deadline <= now) {
+            c = l->heap[0];
+            heap_remove(l, c);
+            if (c->waiting == WAIT_POLL)
+                resume(l, c);
+        }
+
+        while ((c = l->dead) != NULL) {
+            l->dead = c->next;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+/* $end loop_thread */
+
+/*
+ * resume - switch to c until it waits or returns
+ */
+static void resume(loop_t *l, coro_t *c)
+{
+    if (!c->stack) {
+        c->stack = stack_get(l);
+        getcontext(&c->ctx);
+        c->ctx.uc_stack.ss_sp = c->stack;
+        c->ctx.uc_stack.ss_size = CORO_STACK;
+        c->ctx.uc_link = &l->main; /* where returning from trampoline goes */
+        makecontext(&c->ctx, trampoline, 0);
+    }
+    c->waiting = 0;
+    l->current = c;
+    swapcontext(&l->main, &c->ctx);
+    l->current = NULL;
+    if (c->done) {
+        stack_put(l, c->stack);
+        c->next = l->dead;
+        l->dead = c;
+    }
+}
+
+static void trampoline(void)
+{
+    coro_t *c = self_loop->current;
+
+    c->fn(c->arg);
+    c->done = 1;
+}
+
+/* post - queue c to be resumed by loop l */
+static void post(loop_t *l, coro_t *c)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&l->lock);
+    c->next = l->inbox;
+    l->inbox = c;
+    pthread_mutex_unlock(&l->lock);
+    if (write(l->wakefd, &one, sizeof(one)) < 0)
+        ; /* the counter is saturated: the loop will wake anyway */
+}
+
+/* stack_get - a stack from the pool, or a new one with a guard page */
+static char *stack_get(loop_t *l)
+{
+    char *base;
+
+    if (l->npool > 0)
+        return l->pool[--l->npool];
+    base = mmap(NULL, CORO_STACK + pagesize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        unix_error("stack_get: mmap error");
+    if (mprotect(base, pagesize, PROT_NONE) < 0) /* an overflow must fault, not corrupt */
+        unix_error("stack_get: mprotect error");
+    return base + pagesize;
+}
+
+static void stack_put(loop_t *l, char *stack)
+{
+    if (l->npool < CORO_POOL)
+        l->pool[l->npool++] = stack;
+    else
+        munmap(stack - pagesize, CORO_STACK + pagesize);
+}
+
+/* timer heap helpers */
+
+static void heap_push(loop_t *l, coro_t *c)
+{
+    if (l->nheap == l->heapsize) {
+        l->heapsize *= 2;
+        l->heap = Realloc(l->heap, l->heapsize * sizeof(coro_t *));
+    }
+    c->heap_index = l->nheap;
+    l->heap[l->nheap++] = c;
+    heap_sift(l, c->heap_index);
+}
+
+static void heap_remove(loop_t *l, coro_t *c)
+{
+    int i = c->heap_index;
+
+    c->heap_index = -1;
+    if (i == --l->nheap)
+        return;
+    l->heap[i] = l->heap[l->nheap];
+    l->heap[i]->heap_index = i;
+    heap_sift(l, i);
+}
+
+/* heap_sift - move entry i up or down to where its deadline belongs */
+static void heap_sift(loop_t *l, int i)
+{
+    coro_t **h = l->heap, *t;
+    int child;
+
+    while (i > 0 && h[(i - 1) / 2]->deadline > h[i]->deadline) {
+        t = h[i]; h[i] = h[(i - 1) / 2]; h[(i - 1) / 2] = t;
+        h[i]->heap_index = i;
+        i = (i - 1) / 2;
+        h[i]->heap_index = i;
+    }
+    while ((child = 2 * i + 1) < l->nheap) {
+        if (child + 1 < l->nheap && h[child + 1]->deadline < h[child]->deadline)
+            child++;
+        if (h[i]->deadline <= h[child]->deadline)
+            break;
+        t = h[i]; h[i] = h[child]; h[child] = t;
+        h[i]->heap_index = i;
+        i = child;
+        h[i]->heap_index = i;
+    }
+}
+/* $end coro.c */
@@ -0,0 +1,26 @@
+/*
+ * coro.h - coroutines on epoll event loops
+ */
+/* $begin coro.h */
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include <poll.h>
+
+#define CORO_STACK   (64 * 1024) /* doit's buffers are on the heap; deepest path ~44 KB */
+#define CORO_POOL    256     /* stacks kept for reuse per loop */
+#define CORO_EVENTS  256     /* epoll events taken per wait */
+#define CORO_MAX     100000  /* connections in flight in coroutine mode */
+
+typedef struct coro coro_t;
+
+extern int coro_enabled;
+
+void coro_init(int nloops);
+void coro_spawn(void (*fn)(void *), void *arg);
+coro_t *coro_self(void);
+int coro_poll(struct pollfd *fds, int n, int timeout_ms);
+void coro_offload(void (*fn)(void *), void *arg);
+
+#endif /* __CORO_H__ */
+/* $end coro.h */
@@ -23,6 +23,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include "bufpool.h"
 
 /************************** 
  * Error-handling functions
@@ -809,9 +810,10 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
+    if (!rp->rio_buf)           /* EDIT: the buffer is taken on first use */
+	rp->rio_buf = bufpool_get(RIO_BUFSIZE);
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
 	if (rp->rio_cnt < 0) {
         if (errno == ECONNRESET) { /* EDIT: treat prematurely closed socket as EOF */
             return 0;
@@ -838,16 +840,32 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ * EDIT: no buffer is held until the first read; rio_releaseb gives it back.
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_buf = rp->rio_bufptr = NULL;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_releaseb - Return the internal buffer to the pool (bufpool.c)
+ * Unread bytes in it are dropped: call it once the connection is idle
+ * (rio_cnt is 0) or done with. A later read takes a buffer again.
+ */
+/* $begin rio_releaseb */
+void rio_releaseb(rio_t *rp) 
+{
+    if (rp->rio_buf)
+	bufpool_put(rp->rio_buf, RIO_BUFSIZE);
+    rp->rio_cnt = 0;  
+    rp->rio_buf = rp->rio_bufptr = NULL;
+}
+/* $end rio_releaseb */
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -0,0 +1,109 @@
+/*
+ * fuzz.c - feed the proxy's request parsing from files, for fuzzing
+ *
+ * Builds proxy.c with its main renamed, so that what a client sends
+ * can be run through readparse_request and read_requesthdrs straight
+ * from a file, and on through the cache key, the Vary lookup of the
+ * headers and parse_range, as doit would. Each file named is one
+ * input; with none, stdin is, which is how AFL runs a target. Built
+ * with -DLIBFUZZER (and clang -fsanitize=fuzzer) it is a libFuzzer
+ * target instead.
+ *
+ * The proxy must never exit on bad input: an exit from within the
+ * parsing aborts, so that the fuzzer keeps the input as a crash.
+ * "make fuzz" builds it with AddressSanitizer and UBSan and runs it
+ * over fuzz/, a corpus of well-formed and malformed requests.
+ */
+/* $begin fuzz.c */
+#define main proxy_main
+#include "proxy.c"
+#undef main
+
+static int parsing;     /* an exit now is a bug */
+
+static void feed(int fd);
+static void no_exit(void);
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    static int ready;
+    FILE *fp = tmpfile();
+
+    if (!ready++) {
+        atexit(no_exit);
+        if (!freopen("/dev/null", "w", stdout)) /* the proxy's debugging output */
+            abort();
+    }
+    fwrite(data, 1, size, fp);
+    fflush(fp);
+    lseek(fileno(fp), 0, SEEK_SET);
+    feed(fileno(fp));
+    fclose(fp);
+    return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+    int i, fd;
+
+    atexit(no_exit);
+    if (!freopen("/dev/null", "w", stdout)) /* the proxy's debugging output */
+        return 1;
+    if (argc < 2)
+        feed(STDIN_FILENO);
+    for (i = 1; i < argc; i++) {
+        if ((fd = open(argv[i], O_RDONLY)) < 0) {
+            fprintf(stderr, "fuzz: %s: %s\n", argv[i], strerror(errno));
+            continue;
+        }
+        feed(fd);
+        close(fd);
+    }
+    fprintf(stderr, "fuzz: %d input(s) parsed\n", argc < 2 ? 1 : argc - 1);
+    return 0;
+}
+#endif
+
+/*
+ * feed - parse the request on fd as doit would, up to where the origin
+ * would be connected to
+ */
+/* $begin feed */
+static void feed(int fd)
+{
+    char targethost[MAXLINE], path[MAXLINE], request_toserver[MAXLINE], server_port[8],
+        request_method[64], url[MAXLINE], key[MAXLINE], names[MAXLINE];
+    int first, last;
+    rio_t rio;
+    reqhdrs_t hdrs;
+
+    parsing = 1;
+    if (readparse_request(fd, targethost, path, server_port, request_method,
+        request_toserver, &rio) != 0 || !strcmp(request_method, "PRI") ||
+        read_requesthdrs(&rio, &hdrs) < 0 || !strcmp(request_method, "CONNECT")) {
+        rio_releaseb(&rio);
+        parsing = 0;
+        return;
+    }
+    rio_releaseb(&rio);
+    if (!strcmp(hdrs.host, ""))
+        strcpy(hdrs.host, targethost);
+    if (cachekey_url(targethost, server_port, path, url) >= 0) {
+        cachekey_hash(url, key);
+        strcpy(names, "cookie,x-a,host,range");
+        vary_key(key, key, names, &hdrs);
+    }
+    parse_range(hdrs.range, 1000, &first, &last);
+    parsing = 0;
+}
+/* $end feed */
+
+static void no_exit(void)
+{
+    if (parsing) {
+        fprintf(stderr, "fuzz: the proxy exited on bad input\n");
+        abort();
+    }
+}
+/* $end fuzz.c */
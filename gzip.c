@@ -0,0 +1,209 @@
+/*
+ * gzip.c - on-the-fly gzip compression of responses
+ *
+ * Many origins (tiny among them) never compress, while the clients
+ * that matter most sit behind slow links. When a client accepts gzip
+ * and a 200 response is text/html, text/plain or JSON, carries no
+ * Content-Encoding of its own, is not marked no-transform and is not
+ * known to be shorter than GZIP_MIN_SIZE, the proxy compresses the
+ * body as it streams it through, at gzip_level (-z).
+ *
+ * The rewritten response loses its Content-Length (the compressed
+ * length is not known until the end, and the proxy closes the
+ * connection after each response), gains Content-Encoding and Vary,
+ * and has a strong ETag weakened, as the bytes no longer match it.
+ * The caller caches the compressed response under its own key, so
+ * the CPU cost of compressing an object is paid once per fetch.
+ */
+/* $begin gzip.c */
+#include "csapp.h"
+#include "gzip.h"
+
+#define GZIP_OUT_MIN 16384   /* initial output buffer; grows as needed */
+
+int gzip_level = GZIP_LEVEL;
+
+static char *header_value(char *line, char *name);
+
+/*
+ * gzip_accepted - does an Accept-Encoding value admit gzip?
+ * "gzip", "x-gzip" or "*" count unless given q=0.
+ */
+/* $begin gzip_accepted */
+int gzip_accepted(char *accept_encoding)
+{
+    char *p = accept_encoding, *end, *q;
+    int len;
+
+    if (gzip_level <= 0)
+        return 0;
+    while (*p) {
+        while (*p && strchr(" \t,", *p))
+            p++;
+        for (end = p; *end && !strchr(",; \t\r\n", *end); end++)
+            ;
+        len = end - p;
+        if ((len == 4 && !strncasecmp(p, "gzip", 4)) ||
+            (len == 6 && !strncasecmp(p, "x-gzip", 6)) || (len == 1 && *p == '*')) {
+            if (!(q = strstr(end, "q=")) || (strchr(end, ',') && q > strchr(end, ',')))
+                return 1;
+            return atof(q + 2) > 0;
+        }
+        while (*end && *end != ',')
+            end++;
+        p = end;
+    }
+    return 0;
+}
+/* $end gzip_accepted */
+
+/*
+ * gzip_eligible - should the response whose status line and headers
+ * (NUL-terminated, len bytes, ending in a blank line) are in hdrs be
+ * compressed?
+ */
+/* $begin gzip_eligible */
+int gzip_eligible(char *hdrs, int len, int status)
+{
+    char *p, *eol, *v;
+    int type_ok = 0;
+
+    if (status != 200 || !(p = strstr(hdrs, "\r\n")))
+        return 0;
+    for (p += 2; p < hdrs + len && (eol = strstr(p, "\r\n")) != NULL && eol > p; p = eol + 2) {
+        if ((v = header_value(p, "Content-Type:")) != NULL)
+            type_ok = !strncasecmp(v, "text/html", 9) || !strncasecmp(v, "text/plain", 10) ||
+                !strncasecmp(v, "application/json", 16);
+        else if ((v = header_value(p, "Content-Encoding:")) != NULL) {
+            if (strncasecmp(v, "identity", 8))
+                return 0; /* already encoded by the origin */
+        } else if ((v = header_value(p, "Content-Length:")) != NULL) {
+            if (atol(v) < GZIP_MIN_SIZE)
+                return 0; /* not worth the trouble */
+        } else if ((v = header_value(p, "Cache-Control:")) != NULL) {
+            for ( ; v < eol; v++)
+                if (!strncasecmp(v, "no-transform", 12))
+                    return 0;
+        }
+    }
+    return type_ok;
+}
+/* $end gzip_eligible */
+
+/*
+ * gzip_encoded - does the response whose headers are in hdrs, as for
+ * gzip_eligible, carry a Content-Encoding other than identity?
+ */
+int gzip_encoded(char *hdrs, int len)
+{
+    char *p, *eol, *v;
+
+    if (!(p = strstr(hdrs, "\r\n")))
+        return 0;
+    for (p += 2; p < hdrs + len && (eol = strstr(p, "\r\n")) != NULL && eol > p; p = eol + 2)
+        if ((v = header_value(p, "Content-Encoding:")) != NULL && strncasecmp(v, "identity", 8))
+            return 1;
+    return 0;
+}
+
+/*
+ * gzip_headers - rewrite the headers of a response to be compressed
+ * into out; returns the new length, or -1 if they do not fit.
+ */
+/* $begin gzip_headers */
+int gzip_headers(char *hdrs, int len, char *out, int outsize)
+{
+    char *p, *eol, *v;
+    int n, used;
+
+    eol = strstr(hdrs, "\r\n");
+    used = eol + 2 - hdrs;
+    if (used >= outsize)
+        return -1;
+    memcpy(out, hdrs, used); /* status line */
+
+    for (p = eol + 2; p < hdrs + len && (eol = strstr(p, "\r\n")) != NULL && eol > p; p = eol + 2) {
+        if (header_value(p, "Content-Length:"))
+            continue;
+        if ((v = header_value(p, "ETag:")) != NULL && *v == '"') /* now a different body */
+            n = snprintf(out + used, outsize - used, "ETag: W/%.*s\r\n", (int)(eol - v), v);
+        else
+            n = snprintf(out + used, outsize - used, "%.*s\r\n", (int)(eol - p), p);
+        if (n >= outsize - used)
+            return -1;
+        used += n;
+    }
+    n = snprintf(out + used, outsize - used,
+        "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n");
+    if (n >= outsize - used)
+        return -1;
+    return used + n;
+}
+/* $end gzip_headers */
+
+/*
+ * gzip_begin - start compressing a body; 0 on success, -1 if zlib fails
+ */
+int gzip_begin(gzip_t *gz)
+{
+    memset(&gz->zs, 0, sizeof(gz->zs));
+    if (deflateInit2(&gz->zs, gzip_level, Z_DEFLATED, 15 + 16 /* gzip wrapper */,
+            8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    gz->outsize = GZIP_OUT_MIN;
+    gz->out = Malloc(gz->outsize);
+    return 0;
+}
+
+/*
+ * gzip_step - compress n more bytes of body, or with finish set, end
+ * the stream; the output, possibly none yet, is left in gz->out.
+ * Returns the number of bytes in gz->out, or -1 on a zlib error.
+ */
+/* $begin gzip_step */
+ssize_t gzip_step(gzip_t *gz, char *in, size_t n, int finish)
+{
+    int rc;
+
+    gz->zs.next_in = (Bytef *)in;
+    gz->zs.avail_in = n;
+    gz->zs.next_out = (Bytef *)gz->out;
+    gz->zs.avail_out = gz->outsize;
+    while (1) {
+        rc = deflate(&gz->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+        if (finish ? rc == Z_STREAM_END : gz->zs.avail_in == 0 && gz->zs.avail_out > 0)
+            break;
+        if (gz->zs.avail_out == 0) { /* out of room: double the buffer */
+            gz->out = Realloc(gz->out, gz->outsize * 2);
+            gz->zs.next_out = (Bytef *)gz->out + gz->outsize;
+            gz->zs.avail_out = gz->outsize;
+            gz->outsize *= 2;
+        }
+    }
+    return gz->outsize - gz->zs.avail_out;
+}
+/* $end gzip_step */
+
+/*
+ * gzip_end - release what gzip_begin set up
+ */
+void gzip_end(gzip_t *gz)
+{
+    deflateEnd(&gz->zs);
+    Free(gz->out);
+}
+
+/* header_value - the value of header name if line is one, else NULL */
+static char *header_value(char *line, char *name)
+{
+    int len = strlen(name);
+
+    if (strncasecmp(line, name, len))
+        return NULL;
+    for (line += len; *line == ' ' || *line == '\t'; line++)
+        ;
+    return line;
+}
+/* $end gzip.c */
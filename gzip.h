@@ -0,0 +1,31 @@
+/*
+ * gzip.h - on-the-fly gzip compression of responses
+ */
+/* $begin gzip.h */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <zlib.h>
+
+#define GZIP_LEVEL    6      /* default zlib level, 1 (fast) .. 9 (small); 0 = off */
+#define GZIP_MIN_SIZE 1024   /* bodies known to be shorter are sent as they are */
+
+/* One response being compressed */
+typedef struct {
+    z_stream zs;
+    char *out;               /* compressed bytes produced by the last gzip_step */
+    size_t outsize;          /* allocated size of out */
+} gzip_t;
+
+extern int gzip_level;
+
+int gzip_accepted(char *accept_encoding);
+int gzip_eligible(char *hdrs, int len, int status);
+int gzip_encoded(char *hdrs, int len);
+int gzip_headers(char *hdrs, int len, char *out, int outsize);
+int gzip_begin(gzip_t *gz);
+ssize_t gzip_step(gzip_t *gz, char *in, size_t n, int finish);
+void gzip_end(gzip_t *gz);
+
+#endif /* __GZIP_H__ */
+/* $end gzip.h */
@@ -0,0 +1,1126 @@
+/*
+ * h2.c - HTTP/2 cleartext (h2c) frontend
+ *
+ * A client that opens with the HTTP/2 preface, or upgrades a plain GET
+ * with "Upgrade: h2c", is served here for the rest of its connection.
+ * The session speaks frames on the client socket and turns each stream
+ * back into an HTTP/1 exchange: the request is written, head first, to
+ * one end of a socketpair, and a thread of its own runs the caller's
+ * fetch on the other end, so the cache, the origin pool and everything
+ * else doit does apply to streams unchanged. The response read back is
+ * split into HEADERS and DATA frames. At most H2_MAX_FETCHES streams of
+ * a connection are fetched at once and the rest wait their turn, so a
+ * client opening a hundred streams does not trip the origin limits.
+ *
+ * Flow control is what keeps this bounded. A stream buffers at most one
+ * window of request body, and grants the client more only once doit has
+ * taken it; response bytes are read from the socketpair only while both
+ * the stream and the connection window have room, so a slow client
+ * stalls its own fetch threads and not the session.
+ */
+/* $begin h2.c */
+#include <poll.h>
+#include "csapp.h"
+#include "h2.h"
+#include "hpack.h"
+#include "handoff.h"
+#include "admit.h"
+#include "io_wrappers.h"
+#include "coro.h"
+
+/* frame types, RFC 7540 6 */
+#define FRAME_DATA          0x0
+#define FRAME_HEADERS       0x1
+#define FRAME_PRIORITY      0x2
+#define FRAME_RST_STREAM    0x3
+#define FRAME_SETTINGS      0x4
+#define FRAME_PUSH_PROMISE  0x5
+#define FRAME_PING          0x6
+#define FRAME_GOAWAY        0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION  0x9
+
+#define FLAG_END_STREAM     0x1
+#define FLAG_ACK            0x1
+#define FLAG_END_HEADERS    0x4
+#define FLAG_PADDED         0x8
+#define FLAG_PRIORITY       0x20
+
+/* error codes, RFC 7540 7 */
+#define ERR_NO_ERROR        0x0
+#define ERR_PROTOCOL        0x1
+#define ERR_INTERNAL        0x2
+#define ERR_FLOW_CONTROL    0x3
+#define ERR_STREAM_CLOSED   0x5
+#define ERR_FRAME_SIZE      0x6
+#define ERR_REFUSED_STREAM  0x7
+#define ERR_COMPRESSION     0x9
+
+#define SETTINGS_HEADER_TABLE_SIZE      0x1
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+
+#define MAX_WINDOW   0x7fffffffL
+#define BLOCK_MAX    (4 * H2_FRAME_SIZE) /* largest header block we take */
+
+#define BODY_NONE    0       /* request has no body */
+#define BODY_RAW     1       /* DATA is passed on as it is */
+#define BODY_CHUNKED 2       /* DATA is passed on chunk-encoded */
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+int h2_enabled = 0;
+
+typedef struct {
+    int id;                  /* 0: the slot is free */
+    int fd;                  /* our end of the socketpair to the fetch thread */
+    int peer;                /* its end, until a fetch thread is started on it */
+    int body;                /* BODY_NONE, BODY_RAW or BODY_CHUNKED */
+    int remote_closed;       /* the client has ended its side */
+    char *in;                /* request bytes not yet written to fd */
+    int inlen, insize;
+    long recv_window;        /* body bytes the client may still send */
+    long send_window;        /* response bytes we may still send */
+    int headers_sent;
+    int headlen;
+    char head[MAXBUF];       /* response head until complete, then body not yet sent */
+} stream_t;
+
+typedef struct {
+    int fd;
+    int dead;                /* the connection is finished */
+    unsigned char in[2 * (9 + H2_FRAME_SIZE)]; /* frames read, possibly partial */
+    int inlen;
+    const char *preface;     /* preface bytes still expected */
+    hpack_t hpack;
+    unsigned char block[BLOCK_MAX]; /* header block being assembled */
+    unsigned char out[9 + H2_FRAME_SIZE]; /* frame being written; only the session writes */
+    int blocklen, block_id, block_flags;
+    stream_t streams[H2_MAX_STREAMS];
+    int nstreams;
+    int fetching;            /* streams with a fetch thread started */
+    int last_id;             /* highest stream the client has opened */
+    int goaway;              /* no new streams are taken */
+    long send_window;        /* connection window for our DATA */
+    long initial_window;     /* the client's SETTINGS_INITIAL_WINDOW_SIZE */
+    long long idle_ns;       /* when the last stream closed */
+    h2_fetch_t fetch;
+    void *arg;
+    pthread_mutex_t lock;    /* guards running */
+    pthread_cond_t done;
+    int running;             /* fetch threads not yet returned */
+} session_t;
+
+/* A request being rebuilt from a header block */
+typedef struct {
+    char method[64], scheme[16], authority[MAXLINE], path[MAXLINE];
+    char fields[MAXBUF];
+    int fieldslen;
+    char cookie[MAXLINE];
+    int cookielen;
+    int has_length;
+    int bad;
+} request_t;
+
+typedef struct {
+    session_t *ss;
+    int fd;
+} fetch_arg_t;
+
+static void run_session(session_t *ss);
+static void read_input(session_t *ss);
+static void handle_frame(session_t *ss, int type, int flags, int id,
+    unsigned char *p, int len);
+static void handle_data(session_t *ss, int flags, int id, unsigned char *p, int len);
+static void end_headers(session_t *ss);
+static int apply_settings(session_t *ss, unsigned char *p, int len);
+static void collect(char *name, int nl, char *value, int vl, void *arg);
+static void open_stream(session_t *ss, int id, char *req, int len, int body, int closed);
+static void start_fetches(session_t *ss);
+static void *fetch_thread(void *vargp);
+static void push_request(session_t *ss, stream_t *s);
+static void pull_response(session_t *ss, stream_t *s);
+static int send_headers(session_t *ss, stream_t *s, int headlen);
+static void send_pending(session_t *ss, stream_t *s);
+static void append(stream_t *s, char *buf, int n);
+static void end_body(stream_t *s);
+static stream_t *find_stream(session_t *ss, int id);
+static void close_stream(session_t *ss, stream_t *s);
+static void reset_stream(session_t *ss, stream_t *s, int id, int code);
+static void send_frame(session_t *ss, int type, int flags, int id, void *p, int len);
+static void send_window_update(session_t *ss, int id, long inc);
+static void goaway(session_t *ss, int code);
+static int decode_base64url(char *in, unsigned char *out, int outsize);
+
+static unsigned long get32(unsigned char *p)
+{
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/*
+ * h2_serve - serve a client connection as HTTP/2 until it is done
+ * rio holds what has been read of the connection so far. Either the
+ * client opened with the preface and rio is just past its first line,
+ * or upgrade_request is the absolute-form HTTP/1 request it upgraded,
+ * which becomes stream 1, and upgrade_settings its HTTP2-Settings.
+ * Returns once every fetch thread has finished; fd is left open.
+ */
+/* $begin h2_serve */
+void h2_serve(int fd, rio_t *rio, char *upgrade_request, char *upgrade_settings,
+    h2_fetch_t fetch, void *arg)
+{
+    session_t *ss;
+    unsigned char settings[3 * 6];
+    int n;
+    static char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+    ss = Calloc(1, sizeof(session_t));
+    ss->fd = fd;
+    ss->fetch = fetch;
+    ss->arg = arg;
+    ss->send_window = H2_WINDOW;
+    ss->initial_window = H2_WINDOW;
+    ss->idle_ns = monotonic_ns();
+    hpack_init(&ss->hpack, HPACK_TABLE_SIZE);
+    pthread_mutex_init(&ss->lock, NULL);
+    pthread_cond_init(&ss->done, NULL);
+
+    /* bytes the HTTP/1 reader had already buffered are ours */
+    memcpy(ss->in, rio->rio_bufptr, rio->rio_cnt);
+    ss->inlen = rio->rio_cnt;
+    rio_releaseb(rio); /* what was read ahead lives in ss->in now */
+
+    if (upgrade_request) {
+        if (rio_writen_w(fd, switching, strlen(switching)) < 0)
+            ss->dead = 1;
+        ss->preface = preface;
+    } else
+        ss->preface = preface + 16; /* the "PRI * HTTP/2.0\r\n" line is read */
+
+    /* our SETTINGS come first on the connection */
+    settings[0] = 0; settings[1] = SETTINGS_HEADER_TABLE_SIZE;
+    put32(settings + 2, HPACK_TABLE_SIZE);
+    settings[6] = 0; settings[7] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 8, H2_MAX_STREAMS);
+    settings[12] = 0; settings[13] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(settings + 14, H2_WINDOW);
+    if (!ss->dead)
+        send_frame(ss, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    if (upgrade_request && !ss->dead) {
+        /* the 101 acknowledges these; no SETTINGS ACK is sent; no header
+         * block has begun, so they are decoded where one would be */
+        n = upgrade_settings ? decode_base64url(upgrade_settings, ss->block, H2_FRAME_SIZE) : 0;
+        if (n < 0 || apply_settings(ss, ss->block, n) < 0)
+            goaway(ss, ERR_PROTOCOL);
+        else {
+            ss->last_id = 1;
+            open_stream(ss, 1, upgrade_request, strlen(upgrade_request), BODY_NONE, 1);
+        }
+    }
+
+    if (!ss->dead)
+        run_session(ss);
+
+    for (n = 0; n < H2_MAX_STREAMS; n++)
+        if (ss->streams[n].id)
+            close_stream(ss, &ss->streams[n]);
+    pthread_mutex_lock(&ss->lock);
+    while (ss->running > 0) {
+        if (coro_self()) { /* the loop thread has other coroutines to run */
+            pthread_mutex_unlock(&ss->lock);
+            coro_poll(NULL, 0, 50);
+            pthread_mutex_lock(&ss->lock);
+        } else
+            pthread_cond_wait(&ss->done, &ss->lock);
+    }
+    pthread_mutex_unlock(&ss->lock);
+    pthread_mutex_destroy(&ss->lock);
+    pthread_cond_destroy(&ss->done);
+    hpack_free(&ss->hpack);
+    Free(ss);
+}
+/* $end h2_serve */
+
+/*
+ * run_session - move frames and stream bytes until the connection ends
+ */
+/* $begin run_session */
+static void run_session(session_t *ss)
+{
+    struct pollfd fds[1 + H2_MAX_STREAMS];
+    stream_t *owner[1 + H2_MAX_STREAMS];
+    stream_t *s;
+    int i, n;
+
+    if (ss->inlen > 0)
+        read_input(ss); /* with nothing new read */
+
+    while (!ss->dead) {
+        if (handoff_draining && !ss->goaway)
+            goaway(ss, ERR_NO_ERROR); /* streams in flight still finish */
+        if (ss->goaway && ss->nstreams == 0)
+            break;
+        start_fetches(ss);
+        if (ss->nstreams == 0 &&
+            monotonic_ns() - ss->idle_ns > H2_IDLE_SECS * 1000000000LL) {
+            goaway(ss, ERR_NO_ERROR);
+            break;
+        }
+
+        fds[0].fd = ss->fd;
+        fds[0].events = POLLIN;
+        n = 1;
+        for (i = 0; i < H2_MAX_STREAMS; i++) {
+            s = &ss->streams[i];
+            if (!s->id)
+                continue;
+            if (s->headlen > 0 && s->headers_sent)
+                send_pending(ss, s); /* as far as the windows now allow */
+            fds[n].fd = s->fd;
+            fds[n].events = 0;
+            if (s->inlen > 0)
+                fds[n].events |= POLLOUT;
+            if (!s->headers_sent ||
+                (s->headlen == 0 && s->send_window > 0 && ss->send_window > 0))
+                fds[n].events |= POLLIN;
+            if (!fds[n].events)
+                fds[n].fd = -1; /* or its POLLHUP spins until a WINDOW_UPDATE */
+            owner[n++] = s;
+        }
+
+        if (coro_poll(fds, n, 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 1; i < n && !ss->dead; i++) {
+            s = owner[i];
+            if (!s->id) /* reset while handling an earlier one */
+                continue;
+            if (fds[i].revents & (POLLOUT | POLLERR))
+                push_request(ss, s);
+            if (s->id && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                pull_response(ss, s);
+        }
+        if (!ss->dead && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            i = read(ss->fd, ss->in + ss->inlen, sizeof(ss->in) - ss->inlen);
+            if (i <= 0) {
+                if (i < 0 && (errno == EINTR || errno == EAGAIN))
+                    continue;
+                break; /* the client is gone */
+            }
+            ss->inlen += i;
+            read_input(ss);
+        }
+    }
+}
+/* $end run_session */
+
+/*
+ * read_input - handle every complete frame in the input buffer
+ */
+static void read_input(session_t *ss)
+{
+    unsigned char *p;
+    int off = 0, m, len;
+
+    if (*ss->preface) {
+        m = strlen(ss->preface);
+        if (m > ss->inlen)
+            m = ss->inlen;
+        if (memcmp(ss->in, ss->preface, m)) {
+            ss->dead = 1; /* not HTTP/2 at all: no GOAWAY */
+            return;
+        }
+        ss->preface += m;
+        off = m;
+    }
+
+    while (!*ss->preface && ss->inlen - off >= 9 && !ss->dead) {
+        p = ss->in + off;
+        len = p[0] << 16 | p[1] << 8 | p[2];
+        if (len > H2_FRAME_SIZE) {
+            goaway(ss, ERR_FRAME_SIZE);
+            return;
+        }
+        if (ss->inlen - off < 9 + len)
+            break;
+        handle_frame(ss, p[3], p[4], get32(p + 5) & MAX_WINDOW, p + 9, len);
+        off += 9 + len;
+    }
+    memmove(ss->in, ss->in + off, ss->inlen - off);
+    ss->inlen -= off;
+}
+
+/*
+ * handle_frame - act on one frame from the client
+ */
+/* $begin handle_frame */
+static void handle_frame(session_t *ss, int type, int flags, int id,
+    unsigned char *p, int len)
+{
+    stream_t *s;
+    unsigned long inc;
+    int pad = 0;
+
+    /* a header block may not be interleaved with anything */
+    if (ss->block_id && type != FRAME_CONTINUATION) {
+        goaway(ss, ERR_PROTOCOL);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        handle_data(ss, flags, id, p, len);
+        break;
+
+    case FRAME_HEADERS:
+        if (id == 0 || !(id & 1)) {
+            goaway(ss, ERR_PROTOCOL);
+            return;
+        }
+        if (flags & FLAG_PADDED) {
+            if (len < 1 || (pad = p[0]) > len - 1) {
+                goaway(ss, ERR_PROTOCOL);
+                return;
+            }
+            p++;
+            len -= 1 + pad;
+        }
+        if (flags & FLAG_PRIORITY) { /* priorities are not acted on */
+            if (len < 5) {
+                goaway(ss, ERR_FRAME_SIZE);
+                return;
+            }
+            p += 5;
+            len -= 5;
+        }
+        memcpy(ss->block, p, len);
+        ss->blocklen = len;
+        ss->block_id = id;
+        ss->block_flags = flags;
+        if (flags & FLAG_END_HEADERS)
+            end_headers(ss);
+        break;
+
+    case FRAME_CONTINUATION:
+        if (!ss->block_id || id != ss->block_id) {
+            goaway(ss, ERR_PROTOCOL);
+            return;
+        }
+        if (ss->blocklen + len > BLOCK_MAX) {
+            goaway(ss, ERR_INTERNAL); /* we cannot keep HPACK state in step */
+            return;
+        }
+        memcpy(ss->block + ss->blocklen, p, len);
+        ss->blocklen += len;
+        if (flags & FLAG_END_HEADERS)
+            end_headers(ss);
+        break;
+
+    case FRAME_PRIORITY:
+        if (id == 0)
+            goaway(ss, ERR_PROTOCOL);
+        else if (len != 5)
+            goaway(ss, ERR_FRAME_SIZE);
+        break;
+
+    case FRAME_RST_STREAM:
+        if (id == 0 || id > ss->last_id)
+            goaway(ss, ERR_PROTOCOL);
+        else if (len != 4)
+            goaway(ss, ERR_FRAME_SIZE);
+        else if ((s = find_stream(ss, id)) != NULL)
+            close_stream(ss, s);
+        break;
+
+    case FRAME_SETTINGS:
+        if (id != 0)
+            goaway(ss, ERR_PROTOCOL);
+        else if (flags & FLAG_ACK) {
+            if (len != 0)
+                goaway(ss, ERR_FRAME_SIZE);
+        } else if (len % 6)
+            goaway(ss, ERR_FRAME_SIZE);
+        else if (apply_settings(ss, p, len) == 0)
+            send_frame(ss, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+
+    case FRAME_PUSH_PROMISE: /* clients may not push */
+        goaway(ss, ERR_PROTOCOL);
+        break;
+
+    case FRAME_PING:
+        if (id != 0)
+            goaway(ss, ERR_PROTOCOL);
+        else if (len != 8)
+            goaway(ss, ERR_FRAME_SIZE);
+        else if (!(flags & FLAG_ACK))
+            send_frame(ss, FRAME_PING, FLAG_ACK, 0, p, 8);
+        break;
+
+    case FRAME_GOAWAY: /* finish what is open, then close */
+        ss->goaway = 1;
+        break;
+
+    case FRAME_WINDOW_UPDATE:
+        if (len != 4) {
+            goaway(ss, ERR_FRAME_SIZE);
+            return;
+        }
+        inc = get32(p) & MAX_WINDOW;
+        if (id == 0) {
+            if (inc == 0)
+                goaway(ss, ERR_PROTOCOL);
+            else if ((ss->send_window += inc) > MAX_WINDOW)
+                goaway(ss, ERR_FLOW_CONTROL);
+        } else if ((s = find_stream(ss, id)) != NULL) {
+            if (inc == 0)
+                reset_stream(ss, s, id, ERR_PROTOCOL);
+            else if ((s->send_window += inc) > MAX_WINDOW)
+                reset_stream(ss, s, id, ERR_FLOW_CONTROL);
+        }
+        break;
+
+    default: /* unknown frame types are ignored */
+        break;
+    }
+}
+/* $end handle_frame */
+
+/*
+ * handle_data - queue request body bytes for a stream
+ */
+static void handle_data(session_t *ss, int flags, int id, unsigned char *p, int len)
+{
+    stream_t *s;
+    char chunk[16];
+    int n, pad = 0;
+
+    if (id == 0) {
+        goaway(ss, ERR_PROTOCOL);
+        return;
+    }
+    /* the connection window is given back at once; a stream's only as doit reads */
+    if (len > 0)
+        send_window_update(ss, 0, len);
+    if (!(s = find_stream(ss, id))) {
+        if (id > ss->last_id)
+            goaway(ss, ERR_PROTOCOL); /* idle stream */
+        return; /* closed or reset: ignored */
+    }
+    if (s->remote_closed || s->body == BODY_NONE) {
+        reset_stream(ss, s, id, ERR_STREAM_CLOSED);
+        return;
+    }
+    if ((s->recv_window -= len) < 0) {
+        reset_stream(ss, s, id, ERR_FLOW_CONTROL);
+        return;
+    }
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || (pad = p[0]) > len - 1) {
+            goaway(ss, ERR_PROTOCOL);
+            return;
+        }
+        p++;
+        len -= 1 + pad;
+    }
+
+    if (len > 0) {
+        if (s->body == BODY_CHUNKED) {
+            n = sprintf(chunk, "%x\r\n", len);
+            append(s, chunk, n);
+            append(s, (char *)p, len);
+            append(s, "\r\n", 2);
+        } else
+            append(s, (char *)p, len);
+    }
+    if (flags & FLAG_END_STREAM)
+        end_body(s);
+}
+
+/*
+ * end_headers - a header block is complete: open its stream
+ */
+/* $begin end_headers */
+static void end_headers(session_t *ss)
+{
+    request_t *r;
+    stream_t *s;
+    char *req;
+    int id = ss->block_id, flags = ss->block_flags, n, body;
+
+    ss->block_id = 0;
+    r = Calloc(1, sizeof(request_t));
+    /* decoded even when refused, or the HPACK tables fall out of step */
+    if (hpack_decode(&ss->hpack, ss->block, ss->blocklen, collect, r) < 0) {
+        goaway(ss, ERR_COMPRESSION);
+        goto out;
+    }
+
+    if ((s = find_stream(ss, id)) != NULL) { /* trailers: dropped */
+        if (s->remote_closed || !(flags & FLAG_END_STREAM))
+            reset_stream(ss, s, id, ERR_PROTOCOL);
+        else
+            end_body(s);
+        goto out;
+    }
+    if (id <= ss->last_id) {
+        goaway(ss, ERR_PROTOCOL); /* a closed stream may not be reopened */
+        goto out;
+    }
+    ss->last_id = id;
+    if (ss->goaway || ss->nstreams == H2_MAX_STREAMS) {
+        reset_stream(ss, NULL, id, ERR_REFUSED_STREAM);
+        goto out;
+    }
+    if (r->bad || !r->method[0] || !r->authority[0] ||
+        (strcmp(r->method, "CONNECT") && (!r->scheme[0] || !r->path[0]))) {
+        reset_stream(ss, NULL, id, ERR_PROTOCOL);
+        goto out;
+    }
+
+    /* the HTTP/1 request doit will read, built where the block was */
+    req = (char *)ss->block;
+    if (!strcmp(r->method, "CONNECT"))
+        n = snprintf(req, BLOCK_MAX, "CONNECT %s HTTP/1.1\r\n", r->authority);
+    else
+        n = snprintf(req, BLOCK_MAX, "%s %s://%s%s HTTP/1.1\r\n",
+            r->method, r->scheme, r->authority, r->path);
+    n += snprintf(req + n, BLOCK_MAX - n, "Host: %s\r\n%.*s",
+        r->authority, r->fieldslen, r->fields);
+    if (r->cookielen)
+        n += snprintf(req + n, BLOCK_MAX - n, "Cookie: %s\r\n", r->cookie);
+    if (flags & FLAG_END_STREAM)
+        body = BODY_NONE;
+    else if (r->has_length || !strcmp(r->method, "CONNECT"))
+        body = BODY_RAW;
+    else {
+        body = BODY_CHUNKED;
+        n += snprintf(req + n, BLOCK_MAX - n, "Transfer-Encoding: chunked\r\n");
+    }
+    n += snprintf(req + n, BLOCK_MAX - n, "\r\n");
+    open_stream(ss, id, req, n, body, flags & FLAG_END_STREAM);
+ out:
+    Free(r);
+}
+/* $end end_headers */
+
+/* is - the field name of length nl is s */
+static int is(char *name, int nl, char *s)
+{
+    return nl == (int)strlen(s) && !memcmp(name, s, nl);
+}
+
+/*
+ * collect - add one decoded field to the request being rebuilt
+ */
+static void collect(char *name, int nl, char *value, int vl, void *arg)
+{
+    request_t *r = arg;
+    char *dst = NULL, *f;
+    int size = 0, i;
+
+    if (nl > 0 && name[0] == ':') {
+        if (r->fieldslen)
+            r->bad = 1; /* pseudo-headers come first */
+        if (is(name, nl, ":method"))
+            dst = r->method, size = sizeof(r->method);
+        else if (is(name, nl, ":scheme"))
+            dst = r->scheme, size = sizeof(r->scheme);
+        else if (is(name, nl, ":authority"))
+            dst = r->authority, size = sizeof(r->authority);
+        else if (is(name, nl, ":path"))
+            dst = r->path, size = sizeof(r->path);
+        if (!dst || vl >= size || memchr(value, ' ', vl))
+            r->bad = 1;
+        else {
+            memcpy(dst, value, vl);
+            dst[vl] = '\0';
+        }
+        return;
+    }
+
+    if (is(name, nl, "cookie")) { /* split crumbs are joined again, RFC 7540 8.1.2.5 */
+        if (r->cookielen + vl + 3 > (int)sizeof(r->cookie))
+            r->bad = 1;
+        else
+            r->cookielen += sprintf(r->cookie + r->cookielen, "%s%.*s",
+                r->cookielen ? "; " : "", vl, value);
+        return;
+    }
+    if (is(name, nl, "connection") || is(name, nl, "keep-alive") ||
+        is(name, nl, "proxy-connection") || is(name, nl, "transfer-encoding") ||
+        is(name, nl, "upgrade")) {
+        r->bad = 1; /* connection-specific fields are malformed here */
+        return;
+    }
+    if (is(name, nl, "host")) {
+        if (!r->authority[0] && vl < (int)sizeof(r->authority)) {
+            memcpy(r->authority, value, vl);
+            r->authority[vl] = '\0';
+        }
+        return;
+    }
+    if (is(name, nl, "te") || is(name, nl, "expect"))
+        return;
+    if (is(name, nl, "content-length"))
+        r->has_length = 1;
+
+    if (r->fieldslen + nl + vl + 4 >= (int)sizeof(r->fields) ||
+        memchr(value, '\r', vl) || memchr(value, '\n', vl)) {
+        r->bad = 1;
+        return;
+    }
+    /* names go back to their usual case, which read_requesthdrs partly expects */
+    f = r->fields + r->fieldslen;
+    for (i = 0; i < nl; i++)
+        f[i] = (i == 0 || name[i - 1] == '-') ? toupper((unsigned char)name[i]) : name[i];
+    r->fieldslen += nl + sprintf(f + nl, ": %.*s\r\n", vl, value);
+}
+
+/*
+ * open_stream - queue a request as a new stream; its fetch thread is
+ * started by start_fetches
+ */
+/* $begin open_stream */
+static void open_stream(session_t *ss, int id, char *req, int len, int body, int closed)
+{
+    stream_t *s = NULL;
+    int sp[2], i;
+
+    for (i = 0; i < H2_MAX_STREAMS && !s; i++)
+        if (!ss->streams[i].id)
+            s = &ss->streams[i];
+    if (!s || socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0) {
+        reset_stream(ss, NULL, id, ERR_REFUSED_STREAM);
+        return;
+    }
+    fcntl(sp[0], F_SETFL, fcntl(sp[0], F_GETFL) | O_NONBLOCK);
+
+    memset(s, 0, offsetof(stream_t, head)); /* head itself need not be */
+    s->id = id;
+    s->fd = sp[0];
+    s->peer = sp[1];
+    s->body = body;
+    s->remote_closed = closed;
+    s->insize = len + H2_WINDOW;
+    s->in = Malloc(s->insize);
+    memcpy(s->in, req, len);
+    s->inlen = len;
+    s->recv_window = H2_WINDOW;
+    s->send_window = ss->initial_window;
+    if (closed)
+        end_body(s);
+    ss->nstreams++;
+}
+/* $end open_stream */
+
+/*
+ * start_fetches - start fetch threads for waiting streams, oldest first,
+ * while fewer than H2_MAX_FETCHES are running; like a browser's few
+ * HTTP/1 connections, this keeps one client within the origin limits
+ */
+/* $begin start_fetches */
+static void start_fetches(session_t *ss)
+{
+    stream_t *s;
+    fetch_arg_t *fa;
+    pthread_t tid;
+    int i;
+
+    while (ss->fetching < H2_MAX_FETCHES) {
+        s = NULL;
+        for (i = 0; i < H2_MAX_STREAMS; i++)
+            if (ss->streams[i].id && ss->streams[i].peer >= 0 &&
+                (!s || ss->streams[i].id < s->id))
+                s = &ss->streams[i];
+        if (!s)
+            return;
+
+        fa = Malloc(sizeof(fetch_arg_t));
+        fa->ss = ss;
+        fa->fd = s->peer;
+        pthread_mutex_lock(&ss->lock);
+        ss->running++;
+        pthread_mutex_unlock(&ss->lock);
+        if (pthread_create(&tid, NULL, fetch_thread, fa) != 0) {
+            pthread_mutex_lock(&ss->lock);
+            ss->running--;
+            pthread_mutex_unlock(&ss->lock);
+            Free(fa);
+            reset_stream(ss, s, s->id, ERR_REFUSED_STREAM);
+            continue;
+        }
+        s->peer = -1; /* the thread closes it */
+        ss->fetching++;
+    }
+}
+/* $end start_fetches */
+
+/*
+ * fetch_thread - run the caller's fetch for one stream
+ */
+static void *fetch_thread(void *vargp)
+{
+    fetch_arg_t fa = *(fetch_arg_t *)vargp;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    fa.ss->fetch(fa.fd, fa.ss->arg);
+    pthread_mutex_lock(&fa.ss->lock);
+    if (--fa.ss->running == 0)
+        pthread_cond_signal(&fa.ss->done);
+    pthread_mutex_unlock(&fa.ss->lock);
+    return NULL;
+}
+
+/*
+ * push_request - write what is queued of a request to its fetch thread
+ */
+static void push_request(session_t *ss, stream_t *s)
+{
+    ssize_t n;
+
+    if (s->inlen == 0)
+        return;
+    if ((n = write(s->fd, s->in, s->inlen)) < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        n = s->inlen; /* doit answered without reading it all: drop the rest */
+    }
+    memmove(s->in, s->in + n, s->inlen - n);
+    s->inlen -= n;
+    if (s->inlen == 0 && !s->remote_closed && s->recv_window < H2_WINDOW) {
+        send_window_update(ss, s->id, H2_WINDOW - s->recv_window);
+        s->recv_window = H2_WINDOW;
+    }
+}
+
+/*
+ * pull_response - read a stream's response and send it on as frames
+ */
+/* $begin pull_response */
+static void pull_response(session_t *ss, stream_t *s)
+{
+    char *end;
+    int id = s->id, status;
+    long room;
+    ssize_t n;
+
+    if (!s->headers_sent) {
+        n = read(s->fd, s->head + s->headlen, sizeof(s->head) - 1 - s->headlen);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) { /* fetch ended before a whole head */
+            reset_stream(ss, s, id, ERR_INTERNAL);
+            return;
+        }
+        s->headlen += n;
+        s->head[s->headlen] = '\0';
+        while ((end = strstr(s->head, "\r\n\r\n")) != NULL) {
+            n = end + 4 - s->head;
+            if (sscanf(s->head, "HTTP/%*d.%*d %d", &status) == 1 &&
+                status >= 100 && status < 200) { /* interim: not passed on */
+                memmove(s->head, s->head + n, s->headlen - n + 1);
+                s->headlen -= n;
+                continue;
+            }
+            if (send_headers(ss, s, n) < 0) {
+                reset_stream(ss, s, id, ERR_INTERNAL);
+                return;
+            }
+            memmove(s->head, s->head + n, s->headlen - n);
+            s->headlen -= n;
+            s->headers_sent = 1;
+            break;
+        }
+        if (!s->headers_sent && s->headlen == sizeof(s->head) - 1)
+            reset_stream(ss, s, id, ERR_INTERNAL);
+        else if (s->headers_sent)
+            send_pending(ss, s); /* body read along with the head */
+        return;
+    }
+
+    if (s->headlen > 0) /* windows still closed */
+        return;
+    room = s->send_window < ss->send_window ? s->send_window : ss->send_window;
+    if (room > (long)sizeof(s->head))
+        room = sizeof(s->head);
+    if (room <= 0)
+        return;
+    n = read(s->fd, s->head, room);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n < 0) {
+        reset_stream(ss, s, id, ERR_INTERNAL);
+        return;
+    }
+    if (n > 0) {
+        s->headlen = n;
+        send_pending(ss, s);
+        return;
+    }
+
+    /* the response is complete */
+    send_frame(ss, FRAME_DATA, FLAG_END_STREAM, id, NULL, 0);
+    if (!s->remote_closed) /* the rest of the request is not wanted */
+        reset_stream(ss, s, id, ERR_NO_ERROR);
+    else
+        close_stream(ss, s);
+}
+/* $end pull_response */
+
+/*
+ * send_pending - send the body bytes held in s->head as DATA frames,
+ * as many as the stream and connection windows allow
+ */
+static void send_pending(session_t *ss, stream_t *s)
+{
+    long m;
+    int off = 0;
+
+    while (off < s->headlen && !ss->dead) {
+        m = s->send_window < ss->send_window ? s->send_window : ss->send_window;
+        if (m > s->headlen - off)
+            m = s->headlen - off;
+        if (m > H2_FRAME_SIZE)
+            m = H2_FRAME_SIZE;
+        if (m <= 0)
+            break;
+        send_frame(ss, FRAME_DATA, 0, s->id, s->head + off, m);
+        s->send_window -= m;
+        ss->send_window -= m;
+        off += m;
+    }
+    memmove(s->head, s->head + off, s->headlen - off);
+    s->headlen -= off;
+}
+
+/*
+ * send_headers - send the HTTP/1 response head in s->head as HEADERS
+ * The block is encoded in place in the frame send_frame writes.
+ */
+/* $begin send_headers */
+static int send_headers(session_t *ss, stream_t *s, int headlen)
+{
+    unsigned char *block = ss->out + 9;
+    char name[MAXLINE], value[MAXLINE], *line, *eol, *colon, *v;
+    int n, m, i, nl, vl, status;
+
+    if (sscanf(s->head, "HTTP/%*d.%*d %d", &status) != 1 || status < 200 || status > 999)
+        return -1;
+    sprintf(value, "%d", status);
+    if ((n = hpack_encode(":status", value, block, H2_FRAME_SIZE)) < 0)
+        return -1;
+
+    line = strstr(s->head, "\r\n") + 2;
+    while (line < s->head + headlen - 2) {
+        eol = strstr(line, "\r\n");
+        if (!(colon = memchr(line, ':', eol - line)) ||
+            (nl = colon - line) >= (int)sizeof(name)) {
+            line = eol + 2;
+            continue;
+        }
+        for (i = 0; i < nl; i++)
+            name[i] = tolower((unsigned char)line[i]);
+        name[nl] = '\0';
+        for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+            ;
+        vl = eol - v;
+        while (vl > 0 && (v[vl - 1] == ' ' || v[vl - 1] == '\t'))
+            vl--;
+        line = eol + 2;
+        if (vl >= (int)sizeof(value) || !strcmp(name, "connection") ||
+            !strcmp(name, "keep-alive") || !strcmp(name, "proxy-connection") ||
+            !strcmp(name, "transfer-encoding") || !strcmp(name, "upgrade"))
+            continue;
+        memcpy(value, v, vl);
+        value[vl] = '\0';
+        if ((m = hpack_encode(name, value, block + n, H2_FRAME_SIZE - n)) < 0)
+            return -1;
+        n += m;
+    }
+    send_frame(ss, FRAME_HEADERS, FLAG_END_HEADERS, s->id, block, n);
+    return 0;
+}
+/* $end send_headers */
+
+/*
+ * apply_settings - take the client's SETTINGS parameters
+ * Returns -1 after a connection error.
+ */
+static int apply_settings(session_t *ss, unsigned char *p, int len)
+{
+    unsigned long v;
+    long delta;
+    int i, key;
+
+    for (; len >= 6; p += 6, len -= 6) {
+        key = p[0] << 8 | p[1];
+        v = get32(p + 2);
+        if (key == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (v > MAX_WINDOW) {
+                goaway(ss, ERR_FLOW_CONTROL);
+                return -1;
+            }
+            /* open streams move by the difference, RFC 7540 6.9.2 */
+            delta = (long)v - ss->initial_window;
+            ss->initial_window = v;
+            for (i = 0; i < H2_MAX_STREAMS; i++)
+                if (ss->streams[i].id &&
+                    (ss->streams[i].send_window += delta) > MAX_WINDOW) {
+                    goaway(ss, ERR_FLOW_CONTROL);
+                    return -1;
+                }
+        } else if (key == SETTINGS_MAX_FRAME_SIZE) {
+            if (v < 16384 || v > 16777215) {
+                goaway(ss, ERR_PROTOCOL);
+                return -1;
+            }
+            /* we never send frames larger than the minimum anyway */
+        }
+        /* the others do not change what a server without push sends */
+    }
+    return 0;
+}
+
+/* append - queue request bytes for a stream, growing its buffer */
+static void append(stream_t *s, char *buf, int n)
+{
+    if (s->inlen + n > s->insize) {
+        while (s->inlen + n > s->insize)
+            s->insize *= 2;
+        s->in = Realloc(s->in, s->insize);
+    }
+    memcpy(s->in + s->inlen, buf, n);
+    s->inlen += n;
+}
+
+/* end_body - the client has sent all of a stream's request */
+static void end_body(stream_t *s)
+{
+    s->remote_closed = 1;
+    if (s->body == BODY_CHUNKED)
+        append(s, "0\r\n\r\n", 5);
+}
+
+static stream_t *find_stream(session_t *ss, int id)
+{
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+        if (ss->streams[i].id == id)
+            return &ss->streams[i];
+    return NULL;
+}
+
+/*
+ * close_stream - forget a stream; its fetch thread sees the socketpair close
+ */
+static void close_stream(session_t *ss, stream_t *s)
+{
+    close(s->fd);
+    if (s->peer >= 0) /* never started */
+        close(s->peer);
+    else
+        ss->fetching--;
+    Free(s->in);
+    s->in = NULL;
+    s->id = 0;
+    if (--ss->nstreams == 0)
+        ss->idle_ns = monotonic_ns();
+}
+
+/*
+ * reset_stream - send RST_STREAM for id and close s, if it is open
+ */
+static void reset_stream(session_t *ss, stream_t *s, int id, int code)
+{
+    unsigned char p[4];
+
+    put32(p, code);
+    send_frame(ss, FRAME_RST_STREAM, 0, id, p, 4);
+    if (s)
+        close_stream(ss, s);
+}
+
+/*
+ * send_frame - write one frame; a failed write ends the session
+ */
+static void send_frame(session_t *ss, int type, int flags, int id, void *p, int len)
+{
+    unsigned char *frame = ss->out;
+
+    if (ss->dead)
+        return;
+    frame[0] = len >> 16; frame[1] = len >> 8; frame[2] = len;
+    frame[3] = type;
+    frame[4] = flags;
+    put32(frame + 5, id);
+    if (len && p != frame + 9) /* send_headers encodes in place */
+        memcpy(frame + 9, p, len);
+    if (rio_writen_w(ss->fd, frame, 9 + len) < 0)
+        ss->dead = 1;
+}
+
+static void send_window_update(session_t *ss, int id, long inc)
+{
+    unsigned char p[4];
+
+    put32(p, inc);
+    send_frame(ss, FRAME_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+/*
+ * goaway - tell the client no more streams will be taken
+ * On an error the connection is finished; with ERR_NO_ERROR the
+ * streams already open are still served.
+ */
+static void goaway(session_t *ss, int code)
+{
+    unsigned char p[8];
+
+    put32(p, ss->last_id);
+    put32(p + 4, code);
+    send_frame(ss, FRAME_GOAWAY, 0, 0, p, 8);
+    ss->goaway = 1;
+    if (code != ERR_NO_ERROR)
+        ss->dead = 1;
+}
+
+/*
+ * decode_base64url - decode the HTTP2-Settings header, RFC 7540 3.2.1
+ * Returns the length decoded, or -1 if it is not base64url.
+ */
+static int decode_base64url(char *in, unsigned char *out, int outsize)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned long acc = 0;
+    int bits = 0, n = 0;
+    char *c;
+
+    for (; *in && *in != '='; in++) {
+        if (!(c = strchr(alphabet, *in)))
+            return -1;
+        acc = acc << 6 | (c - alphabet);
+        if ((bits += 6) >= 8) {
+            bits -= 8;
+            if (n == outsize)
+                return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n % 6 ? -1 : n;
+}
+/* $end h2.c */
@@ -0,0 +1,26 @@
+/*
+ * h2.h - HTTP/2 cleartext (h2c) frontend
+ */
+/* $begin h2.h */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+
+#define H2_MAX_STREAMS  100     /* SETTINGS_MAX_CONCURRENT_STREAMS we advertise */
+#define H2_MAX_FETCHES  6       /* streams of one connection fetched at once */
+#define H2_WINDOW       65535   /* per-stream window for request bodies */
+#define H2_FRAME_SIZE   16384   /* largest frame payload, both ways */
+#define H2_IDLE_SECS    60      /* a connection without streams this long is closed */
+
+/* Serves one stream: reads an HTTP/1 request from fd, writes the
+ * response to it and closes it. Runs on a thread of its own. */
+typedef void (*h2_fetch_t)(int fd, void *arg);
+
+extern int h2_enabled;
+
+void h2_serve(int fd, rio_t *rio, char *upgrade_request, char *upgrade_settings,
+    h2_fetch_t fetch, void *arg);
+
+#endif /* __H2_H__ */
+/* $end h2.h */
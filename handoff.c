@@ -0,0 +1,247 @@
+/*
+ * handoff.c - pass the listening socket to a new proxy process
+ *
+ * Upgrading the proxy without refusing a single connection: the old
+ * process listens on a Unix domain socket at path (-H). A new process
+ * started with the same path connects there first and receives the
+ * listening descriptor itself over SCM_RIGHTS, instead of binding the
+ * port anew. Once it is ready to accept it says so with one byte. The
+ * old process then stops accepting, waits up to HANDOFF_DRAIN_SECS
+ * for the connections it already has, and exits; the new process has
+ * meanwhile taken over the control socket for the next upgrade.
+ *
+ * Because both processes hold the same socket, connections arriving
+ * during the switch wait in its listen queue for whichever process
+ * accepts them; none are refused. If the new process dies before it
+ * is ready, the old one just carries on.
+ *
+ * SIGTERM triggers the same drain without a successor. It is only
+ * ever delivered to the main thread, interrupting its accept.
+ */
+/* $begin handoff.c */
+#include <sys/un.h>
+#include "csapp.h"
+#include "handoff.h"
+#include "admit.h"
+
+volatile sig_atomic_t handoff_draining = 0;
+
+static char *ctl_path;
+static int predecessor = -1;     /* control connection to the old process */
+static int listen_fd;
+static pthread_t main_tid;
+static volatile int stopped = 0; /* main thread left its accept loop */
+
+static void *control_thread(void *vargp);
+static void drain_handler(int sig);
+static int send_fd(int sock, int fd);
+static int recv_fd(int sock);
+
+/*
+ * handoff_init - catch SIGTERM in the calling (main) thread only; the
+ * threads it creates until handoff_ready inherit it blocked
+ * A forked worker process (prefork.c) calls it again with no path, and
+ * leaves the predecessor and any successor to its parent.
+ */
+void handoff_init(char *path)
+{
+    struct sigaction action;
+    sigset_t mask;
+
+    if (predecessor >= 0) { /* the parent's copy still answers it */
+        close(predecessor);
+        predecessor = -1;
+    }
+    ctl_path = path;
+    main_tid = pthread_self();
+
+    action.sa_handler = drain_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0; /* no SA_RESTART: accept must return EINTR */
+    if (sigaction(SIGTERM, &action, NULL) < 0)
+        unix_error("handoff_init: sigaction error");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/*
+ * handoff_receive - take over the listening socket of a running proxy
+ * Returns the descriptor, or -1 if no proxy answers at the control path.
+ */
+/* $begin handoff_receive */
+int handoff_receive(void)
+{
+    struct sockaddr_un addr;
+    int sock, fd;
+
+    if (!ctl_path)
+        return -1;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ctl_path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (SA *)&addr, sizeof(addr)) < 0 || (fd = recv_fd(sock)) < 0) {
+        close(sock);
+        return -1;
+    }
+    predecessor = sock; /* acknowledged in handoff_ready */
+    printf("PROXY: Took over the listening socket from the running proxy.\n");
+    return fd;
+}
+/* $end handoff_receive */
+
+/*
+ * handoff_ready - called by the main thread just before it accepts:
+ * let SIGTERM in, release the predecessor and serve successors
+ */
+/* $begin handoff_ready */
+void handoff_ready(int listenfd)
+{
+    pthread_t tid;
+    sigset_t mask;
+    char ready = 'R';
+
+    listen_fd = listenfd;
+    if (predecessor >= 0) {
+        if (write(predecessor, &ready, 1) != 1)
+            fprintf(stderr, "handoff: could not notify the old proxy\n");
+        close(predecessor);
+        predecessor = -1;
+    }
+    if (ctl_path)
+        Pthread_create(&tid, NULL, control_thread, NULL);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+/* $end handoff_ready */
+
+/*
+ * handoff_drain - called by the main thread once it stopped accepting:
+ * wait for the connections in flight, then exit
+ */
+/* $begin handoff_drain */
+void handoff_drain(void)
+{
+    int left;
+
+    stopped = 1;
+    close(listen_fd); /* the successor, if any, holds its own reference */
+    printf("PROXY: Draining connections in flight.\n");
+    fflush(stdout);
+    if ((left = admit_drain(HANDOFF_DRAIN_SECS)) > 0)
+        printf("PROXY: %d connections still open after %d s, closing.\n", 
+               left, HANDOFF_DRAIN_SECS);
+    exit(0);
+}
+/* $end handoff_drain */
+
+/*
+ * control_thread - hand the listening socket to each new process that
+ * asks, until one confirms it is accepting; then make main stop
+ */
+static void *control_thread(void *vargp)
+{
+    struct sockaddr_un addr;
+    int sock, conn;
+    char ready;
+
+    Pthread_detach(pthread_self());
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "handoff: socket: %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ctl_path, sizeof(addr.sun_path) - 1);
+    unlink(ctl_path); /* left by the predecessor, or a crash */
+    if (bind(sock, (SA *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        fprintf(stderr, "handoff: %s: %s\n", ctl_path, strerror(errno));
+        close(sock);
+        return NULL;
+    }
+
+    while (1) {
+        if ((conn = accept(sock, NULL, NULL)) < 0)
+            continue;
+        if (send_fd(conn, listen_fd) == 0 && read(conn, &ready, 1) == 1)
+            break;
+        close(conn); /* successor gave up before it was ready */
+    }
+    close(conn);
+    close(sock); /* the path now belongs to the successor */
+    printf("PROXY: New proxy is accepting, handing over.\n");
+
+    /* the main thread may be blocked in accept; interrupt it until it stops */
+    handoff_draining = 1;
+    while (!stopped) {
+        pthread_kill(main_tid, SIGTERM);
+        usleep(HANDOFF_KICK_MS * 1000);
+    }
+    return NULL;
+}
+
+static void drain_handler(int sig)
+{
+    handoff_draining = 1;
+}
+
+/* send_fd - pass descriptor fd over the Unix socket sock */
+static int send_fd(int sock, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 'F';
+    union { /* aligned room for one descriptor */
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/* recv_fd - receive a descriptor sent by send_fd; -1 on failure */
+static int recv_fd(int sock)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte;
+    int fd;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(sock, &msg, 0) != 1)
+        return -1;
+    if (!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+/* $end handoff.c */
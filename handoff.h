@@ -0,0 +1,21 @@
+/*
+ * handoff.h - pass the listening socket to a new proxy process
+ */
+/* $begin handoff.h */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <signal.h>
+
+#define HANDOFF_DRAIN_SECS 30   /* longest wait for in-flight connections */
+#define HANDOFF_KICK_MS    100  /* how often to interrupt a blocked accept */
+
+extern volatile sig_atomic_t handoff_draining; /* stop accepting */
+
+void handoff_init(char *path);
+int handoff_receive(void);
+void handoff_ready(int listenfd);
+void handoff_drain(void);
+
+#endif /* __HANDOFF_H__ */
+/* $end handoff.h */
@@ -0,0 +1,432 @@
+/*
+ * hpack.c - HPACK header compression for the HTTP/2 frontend
+ *
+ * The decoder implements all of RFC 7541: indexed fields, literals with
+ * and without indexing, dynamic table size updates and Huffman-coded
+ * strings. The dynamic table holds at most HPACK_TABLE_SIZE bytes,
+ * which is what h2.c advertises, and is kept newest first in a small
+ * array; at 32 bytes of overhead per entry it never has more than
+ * HPACK_TABLE_SIZE / 32 entries, so inserting is a short memmove.
+ *
+ * Huffman strings are decoded bit by bit down a tree built once from
+ * the code table. Padding longer than 7 bits, padding that is not all
+ * ones, and an EOS symbol inside a string are all errors.
+ *
+ * The encoder, used for responses, only writes literals without
+ * indexing, naming the header by its static table index where there is
+ * one. That leaves no encoder state to keep in step with the peer, at
+ * the price of a few bytes per header.
+ */
+/* $begin hpack.c */
+#include "csapp.h"
+#include "hpack.h"
+
+/* RFC 7541 Appendix A */
+static const char *static_table[HPACK_STATIC + 1][2] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* RFC 7541 Appendix B: code and length in bits of each symbol, EOS last */
+static const unsigned huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const unsigned char huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static int tree[512][2];     /* child > 0: node, < 0: leaf -(sym + 1), 0: none */
+static pthread_once_t tree_once = PTHREAD_ONCE_INIT;
+
+static void build_tree(void);
+static int huff_decode(unsigned char *in, int len, char *out, int outsize);
+static int decode_int(unsigned char **p, unsigned char *end, int prefix, size_t *val);
+static int decode_string(unsigned char **p, unsigned char *end, char *buf, int bufsize);
+static int lookup(hpack_t *t, size_t index, char *name, int *nl, char *value, int *vl);
+static void add(hpack_t *t, char *name, int nl, char *value, int vl);
+static void evict(hpack_t *t, size_t room);
+static int encode_int(unsigned char *out, int outsize, int prefix, int flags, size_t v);
+
+/*
+ * hpack_init - an empty decoding context for a new connection
+ */
+void hpack_init(hpack_t *t, size_t limit)
+{
+    pthread_once(&tree_once, build_tree);
+    t->count = 0;
+    t->size = 0;
+    t->max_size = t->limit = limit;
+}
+
+/*
+ * hpack_free - release the dynamic table
+ */
+void hpack_free(hpack_t *t)
+{
+    while (t->count > 0)
+        Free(t->entries[--t->count].name);
+    t->size = 0;
+}
+
+/*
+ * hpack_decode - decode one complete header block, calling emit for
+ * each field in order
+ * Returns 0, or -1 on anything malformed, which is a connection error
+ * (COMPRESSION_ERROR) since the dynamic table can no longer be trusted.
+ */
+/* $begin hpack_decode */
+int hpack_decode(hpack_t *t, unsigned char *in, int len, hpack_emit_t emit, void *arg)
+{
+    unsigned char *p = in, *end = in + len;
+    char name[HPACK_MAX_STRING], value[HPACK_MAX_STRING];
+    size_t index;
+    int nl, vl, indexing;
+
+    while (p < end) {
+        if (*p & 0x80) { /* indexed field */
+            if (decode_int(&p, end, 7, &index) < 0 ||
+                lookup(t, index, name, &nl, value, &vl) < 0)
+                return -1;
+            emit(name, nl, value, vl, arg);
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) { /* dynamic table size update */
+            if (decode_int(&p, end, 5, &index) < 0 || index > t->limit)
+                return -1;
+            t->max_size = index;
+            evict(t, 0);
+            continue;
+        }
+
+        /* literal, with incremental indexing or without (or never) indexed */
+        indexing = (*p & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0)
+            return -1;
+        if (index == 0)
+            nl = decode_string(&p, end, name, sizeof(name));
+        else if (lookup(t, index, name, &nl, value, &vl) < 0)
+            nl = -1;
+        if (nl < 0 || (vl = decode_string(&p, end, value, sizeof(value))) < 0)
+            return -1;
+        if (indexing)
+            add(t, name, nl, value, vl);
+        emit(name, nl, value, vl, arg);
+    }
+    return 0;
+}
+/* $end hpack_decode */
+
+/*
+ * hpack_encode - encode name: value as a literal without indexing
+ * name must be lowercase. Returns the bytes written, or -1 if out is
+ * too small.
+ */
+/* $begin hpack_encode */
+int hpack_encode(char *name, char *value, unsigned char *out, int outsize)
+{
+    int i, n, m, nl = strlen(name), vl = strlen(value);
+
+    for (i = 1; i <= HPACK_STATIC && strcmp(static_table[i][0], name); i++)
+        ;
+    if (i <= HPACK_STATIC) /* indexed name */
+        n = encode_int(out, outsize, 4, 0x00, i);
+    else if ((n = encode_int(out, outsize, 4, 0x00, 0)) > 0) { /* new name */
+        if ((m = encode_int(out + n, outsize - n, 7, 0x00, nl)) < 0 || n + m + nl > outsize)
+            return -1;
+        memcpy(out + n + m, name, nl);
+        n += m + nl;
+    }
+    if (n < 0 || (m = encode_int(out + n, outsize - n, 7, 0x00, vl)) < 0 ||
+        n + m + vl > outsize)
+        return -1;
+    memcpy(out + n + m, value, vl);
+    return n + m + vl;
+}
+/* $end hpack_encode */
+
+/* helpers */
+
+/* build_tree - the Huffman decoding tree, from the code table */
+static void build_tree(void)
+{
+    int sym, i, bit, n, nodes = 1;
+
+    for (sym = 0; sym < 257; sym++) {
+        for (n = 0, i = huff_len[sym] - 1; i > 0; i--) {
+            bit = (huff_code[sym] >> i) & 1;
+            if (!tree[n][bit])
+                tree[n][bit] = nodes++;
+            n = tree[n][bit];
+        }
+        tree[n][huff_code[sym] & 1] = -(sym + 1);
+    }
+}
+
+/* huff_decode - decode len Huffman-coded bytes; the decoded length, or -1 */
+static int huff_decode(unsigned char *in, int len, char *out, int outsize)
+{
+    int i, b, bit, next, n = 0, depth = 0, ones = 1, used = 0;
+
+    for (i = 0; i < len; i++) {
+        for (b = 7; b >= 0; b--) {
+            bit = (in[i] >> b) & 1;
+            if (!(next = tree[n][bit]))
+                return -1;
+            ones &= bit;
+            depth++;
+            if (next > 0) {
+                n = next;
+                continue;
+            }
+            if (next == -257 || used == outsize)
+                return -1; /* EOS inside a string, or too long */
+            out[used++] = -next - 1;
+            n = depth = 0;
+            ones = 1;
+        }
+    }
+    /* what is left must be padding: the start of EOS, fewer than 8 bits */
+    return depth > 7 || !ones ? -1 : used;
+}
+
+/* decode_int - an integer with a prefix-bit first byte, RFC 7541 5.1 */
+static int decode_int(unsigned char **p, unsigned char *end, int prefix, size_t *val)
+{
+    size_t max = (1 << prefix) - 1, v = **p & max;
+    int shift = 0, b;
+
+    (*p)++;
+    if (v < max) {
+        *val = v;
+        return 0;
+    }
+    while (*p < end) {
+        b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if ((shift += 7) > 28)
+            return -1;
+        if (!(b & 0x80)) {
+            *val = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* decode_string - a string literal, RFC 7541 5.2; its length, or -1 */
+static int decode_string(unsigned char **p, unsigned char *end, char *buf, int bufsize)
+{
+    int huff, n;
+    size_t len;
+
+    if (*p >= end)
+        return -1;
+    huff = **p & 0x80;
+    if (decode_int(p, end, 7, &len) < 0 || len > end - *p)
+        return -1;
+    if (huff)
+        n = huff_decode(*p, len, buf, bufsize);
+    else if ((n = len) <= bufsize)
+        memcpy(buf, *p, len);
+    else
+        return -1;
+    *p += len;
+    return n;
+}
+
+/* lookup - copy entry index of the static or dynamic table; -1 if none */
+static int lookup(hpack_t *t, size_t index, char *name, int *nl, char *value, int *vl)
+{
+    const char *n, *v;
+
+    if (index == 0)
+        return -1;
+    if (index <= HPACK_STATIC) {
+        n = static_table[index][0];
+        v = static_table[index][1];
+    } else if (index - HPACK_STATIC - 1 < t->count) {
+        n = t->entries[index - HPACK_STATIC - 1].name;
+        v = t->entries[index - HPACK_STATIC - 1].value;
+    } else
+        return -1;
+    *nl = strlen(n);
+    *vl = strlen(v);
+    memcpy(name, n, *nl);
+    memcpy(value, v, *vl);
+    return 0;
+}
+
+/* add - insert a field at the front of the dynamic table, RFC 7541 4.4 */
+static void add(hpack_t *t, char *name, int nl, char *value, int vl)
+{
+    hpack_entry_t *e;
+    size_t size = nl + vl + 32;
+
+    evict(t, size);
+    if (size > t->max_size)
+        return; /* bigger than the table: it is left empty */
+    memmove(&t->entries[1], &t->entries[0], t->count * sizeof(hpack_entry_t));
+    e = &t->entries[0];
+    e->name = Malloc(nl + vl + 2);
+    memcpy(e->name, name, nl);
+    e->name[nl] = '\0';
+    e->value = e->name + nl + 1;
+    memcpy(e->value, value, vl);
+    e->value[vl] = '\0';
+    e->size = size;
+    t->count++;
+    t->size += size;
+}
+
+/* evict - drop the oldest entries until room more bytes fit */
+static void evict(hpack_t *t, size_t room)
+{
+    while (t->count > 0 && t->size + room > t->max_size) {
+        t->count--;
+        t->size -= t->entries[t->count].size;
+        Free(t->entries[t->count].name);
+    }
+}
+
+/* encode_int - an integer with a prefix-bit first byte; bytes written, or -1 */
+static int encode_int(unsigned char *out, int outsize, int prefix, int flags, size_t v)
+{
+    size_t max = (1 << prefix) - 1;
+    int n = 0;
+
+    if (outsize < 1)
+        return -1;
+    if (v < max) {
+        out[n++] = flags | v;
+        return n;
+    }
+    out[n++] = flags | max;
+    for (v -= max; v >= 128; v >>= 7) {
+        if (n == outsize)
+            return -1;
+        out[n++] = (v & 0x7f) | 0x80;
+    }
+    if (n == outsize)
+        return -1;
+    out[n++] = v;
+    return n;
+}
+/* $end hpack.c */
@@ -0,0 +1,37 @@
+/*
+ * hpack.h - HPACK header compression for the HTTP/2 frontend
+ */
+/* $begin hpack.h */
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stddef.h>
+
+#define HPACK_STATIC      61     /* entries in the static table */
+#define HPACK_TABLE_SIZE  4096   /* dynamic table size we let the peer use */
+#define HPACK_MAX_STRING  8192   /* longest name or value we decode */
+
+typedef struct {
+    char *name, *value;      /* one allocation, name first */
+    size_t size;             /* name + value + 32, RFC 7541 4.1 */
+} hpack_entry_t;
+
+/* Decoding context of one connection: the dynamic table, newest first */
+typedef struct {
+    hpack_entry_t entries[HPACK_TABLE_SIZE / 32];
+    int count;
+    size_t size;             /* sum of entry sizes */
+    size_t max_size;         /* as last set by the peer, at most limit */
+    size_t limit;            /* SETTINGS_HEADER_TABLE_SIZE we advertised */
+} hpack_t;
+
+/* called for each decoded field; the strings are not NUL-terminated */
+typedef void (*hpack_emit_t)(char *name, int namelen, char *value, int valuelen, void *arg);
+
+void hpack_init(hpack_t *t, size_t limit);
+void hpack_free(hpack_t *t);
+int hpack_decode(hpack_t *t, unsigned char *in, int len, hpack_emit_t emit, void *arg);
+int hpack_encode(char *name, char *value, unsigned char *out, int outsize);
+
+#endif /* __HPACK_H__ */
+/* $end hpack.h */
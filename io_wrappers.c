@@ -4,6 +4,12 @@
 /* $begin io_wrappers.c */
 #include "csapp.h"
 #include "io_wrappers.h"
+#include "coro.h"
+#include "bufpool.h"
+
+static ssize_t rio_read_w(rio_t *rp, char *usrbuf, size_t n);
+static int io_wait(int fd, int events);
+static void io_error(char *msg);
 
 /****************************************
  * The Rio_w package - Robust I/O functions
@@ -23,6 +29,8 @@ ssize_t rio_writen_w(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		  nwritten = 0;    /* and call write() again */
+        else if (errno == EAGAIN && io_wait(fd, POLLOUT) == 0)
+		  nwritten = 0;    /* a coroutine's socket has room again */
         else if (errno == EPIPE) { /* EDIT: announce EPIPE error at the proxy */
             // printf("EPIPE error.\n");
             return -1; /* EDIT: crash out */
@@ -45,13 +53,16 @@ static ssize_t rio_read_w(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
+    if (!rp->rio_buf)           /* taken on first use; see rio_releaseb */
+	rp->rio_buf = bufpool_get(RIO_BUFSIZE);
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
 	if (rp->rio_cnt < 0) {
         if (errno == ECONNRESET) { /* EDIT: treat prematurely closed socket as EOF */
             return 0;
         }
+	    if (errno == EAGAIN && io_wait(rp->rio_fd, POLLIN) == 0)
+		continue;   /* a coroutine's socket has data again */
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
 	}
@@ -124,15 +135,44 @@ ssize_t rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb_w */
 
+/*
+ * rio_readsome_w - read whatever is available, up to n bytes
+ * Bytes still in the rio buffer come first; after that reads go
+ * straight into usrbuf, so a large usrbuf means few, large reads.
+ */
+/* $begin rio_readsome_w */
+ssize_t rio_readsome_w(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t rc;
+
+    if (rp->rio_cnt > 0)
+	return rio_read_w(rp, usrbuf, n);
+    while ((rc = read(rp->rio_fd, usrbuf, n)) < 0) {
+	if (errno == ECONNRESET) /* as rio_read_w: treat as EOF */
+	    return 0;
+	if (errno == EAGAIN && io_wait(rp->rio_fd, POLLIN) == 0)
+	    continue;
+	if (errno != EINTR)
+	    return -1;
+    }
+    return rc;
+}
+/* $end rio_readsome_w */
+
 /**********************************
  * Wrappers for robust I/O routines
+ * Unlike those in csapp.c they never exit: an error on one connection
+ * is reported and returned as -1, and only that request is abandoned.
  **********************************/
 
 
-void Rio_writen_w(int fd, void *usrbuf, size_t n) 
+int Rio_writen_w(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen_w(fd, usrbuf, n) != n)
-	unix_error("Rio_writen error");
+    if (rio_writen_w(fd, usrbuf, n) != n) {
+	io_error("Rio_writen error");
+	return -1;
+    }
+    return 0;
 }
 
 
@@ -142,7 +182,7 @@ ssize_t Rio_readnb_w(rio_t *rp, void *usrbuf, size_t n)
     ssize_t rc;
 
     if ((rc = rio_readnb_w(rp, usrbuf, n)) < 0)
-	unix_error("Rio_readnb error");
+	io_error("Rio_readnb error");
     return rc;
 }
 
@@ -151,7 +191,49 @@ ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen)
     ssize_t rc;
 
     if ((rc = rio_readlineb_w(rp, usrbuf, maxlen)) < 0)
-	unix_error("Rio_readlineb error");
+	io_error("Rio_readlineb error");
+    return rc;
+} 
+
+ssize_t Rio_readsome_w(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsome_w(rp, usrbuf, n)) < 0)
+	io_error("Rio_readsome error");
     return rc;
 } 
 
+/*
+ * io_wait - park the calling coroutine until fd is ready for events
+ * Waits no longer than the socket's SO_RCVTIMEO or SO_SNDTIMEO would
+ * have let a blocking call, and fails at once on an ordinary thread,
+ * where EAGAIN means that timeout has passed. Returns 0 once ready,
+ * -1 with errno EAGAIN otherwise.
+ */
+static int io_wait(int fd, int events)
+{
+    struct pollfd pfd;
+    struct timeval tv = { 0, 0 };
+    socklen_t len = sizeof(tv);
+    int timeout = -1;
+
+    if (!coro_self())
+	return -1;
+    getsockopt(fd, SOL_SOCKET, events == POLLIN ? SO_RCVTIMEO : SO_SNDTIMEO, &tv, &len);
+    if (tv.tv_sec || tv.tv_usec)
+	timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    pfd.fd = fd;
+    pfd.events = events;
+    if (coro_poll(&pfd, 1, timeout) > 0)
+	return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+/* io_error - unix_error without the exit */
+static void io_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+}
+
@@ -5,10 +5,11 @@
 // #include "csapp.h"
 
 ssize_t rio_writen_w(int fd, void *usrbuf, size_t n);
-static ssize_t rio_read_w(rio_t *rp, char *usrbuf, size_t n);
 ssize_t rio_readnb_w(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
-void Rio_writen_w(int fd, void *usrbuf, size_t n);
+ssize_t rio_readsome_w(rio_t *rp, void *usrbuf, size_t n);
+int Rio_writen_w(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readnb_w(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readsome_w(rio_t *rp, void *usrbuf, size_t n);
 
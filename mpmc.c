@@ -0,0 +1,137 @@
+/*
+ * mpmc.c - lock-free bounded queue of accepted connections
+ *
+ * With -Q the accept loop hands connections to the workers through
+ * this queue instead of sbuf. It is Vyukov's bounded MPMC array queue:
+ * each cell carries a sequence number that tells producers and
+ * consumers whose turn it is, so both sides claim a cell with one CAS
+ * on their own position counter and never take a lock. A consumer that
+ * finds the queue empty polls it MPMC_SPIN times and then parks on a
+ * futex; a producer pays for a wakeup only while someone is parked.
+ * Connections are handed out first come, first served, without the
+ * per-client round robin of sbuf.
+ */
+/* $begin mpmc.c */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "mpmc.h"
+
+static int try_insert(mpmc_t *q, conn_t *item);
+static int try_remove(mpmc_t *q, conn_t *item);
+
+/* Create an empty queue of at least n slots */
+void mpmc_init(mpmc_t *q, int n)
+{
+    size_t i, slots = 1;
+
+    while (slots < n)
+        slots <<= 1;
+    q->cells = Calloc(slots, sizeof(mpmc_cell_t));
+    for (i = 0; i < slots; i++)
+        atomic_init(&q->cells[i].seq, i);  /* free for the producer at pos i */
+    q->mask = slots - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    atomic_init(&q->sleepers, 0);
+    atomic_init(&q->epoch, 0);
+}
+
+/*
+ * mpmc_insert - append a copy of item, waking a parked consumer if any
+ * The admission limit keeps the queue from filling; if it does, the
+ * producer yields until there is room.
+ */
+/* $begin mpmc_insert */
+void mpmc_insert(mpmc_t *q, conn_t *item)
+{
+    while (!try_insert(q, item))
+        sched_yield();
+    atomic_thread_fence(memory_order_seq_cst); /* pairs with sleepers++ in mpmc_remove */
+    if (atomic_load_explicit(&q->sleepers, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&q->epoch, 1);
+        syscall(SYS_futex, &q->epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+/* $end mpmc_insert */
+
+/*
+ * mpmc_remove - take the oldest item into *item, parking until there is one
+ */
+/* $begin mpmc_remove */
+void mpmc_remove(mpmc_t *q, conn_t *item)
+{
+    int spins = 0, epoch;
+
+    while (!try_remove(q, item)) {
+        if (++spins < MPMC_SPIN)
+            continue;
+        /* announce ourselves before the last look, so that a producer
+         * either sees us parked or we see its item */
+        atomic_fetch_add(&q->sleepers, 1);
+        epoch = atomic_load(&q->epoch);
+        if (try_remove(q, item)) {
+            atomic_fetch_sub(&q->sleepers, 1);
+            return;
+        }
+        syscall(SYS_futex, &q->epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+        atomic_fetch_sub(&q->sleepers, 1);
+        spins = 0;
+    }
+}
+/* $end mpmc_remove */
+
+/*
+ * A cell at position pos is free for a producer when its seq is pos, and
+ * holds an item for a consumer when its seq is pos + 1. The consumer
+ * hands it back for the next lap by setting seq to pos + slots.
+ */
+
+/* try_insert - returns 0 if the queue is full */
+static int try_insert(mpmc_t *q, conn_t *item)
+{
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    mpmc_cell_t *cell;
+    intptr_t dif;
+
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0)
+            return 0; /* a lap behind: full */
+        else
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+    cell->conn = *item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* try_remove - returns 0 if the queue is empty */
+static int try_remove(mpmc_t *q, conn_t *item)
+{
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    mpmc_cell_t *cell;
+    intptr_t dif;
+
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0)
+            return 0; /* not yet written: empty */
+        else
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+    *item = cell->conn;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return 1;
+}
+/* $end mpmc.c */
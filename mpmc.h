@@ -0,0 +1,37 @@
+/*
+ * mpmc.h - lock-free bounded queue of accepted connections
+ */
+/* $begin mpmc.h */
+#ifndef __MPMC_H__
+#define __MPMC_H__
+
+#include <stdatomic.h>
+#include "sbuf.h"
+
+#define MPMC_SPIN 100  /* empty polls before a consumer parks */
+
+typedef struct {
+    atomic_size_t seq;       /* whose turn the cell is, see mpmc.c */
+    conn_t conn;
+} mpmc_cell_t;
+
+/* $begin mpmct */
+typedef struct {
+    mpmc_cell_t *cells;
+    size_t mask;             /* slots - 1, slots a power of 2 */
+    char pad0[64];
+    atomic_size_t enqueue_pos;
+    char pad1[64];           /* producers and consumers on their own lines */
+    atomic_size_t dequeue_pos;
+    char pad2[64];
+    atomic_int sleepers;     /* consumers parked or about to park */
+    atomic_int epoch;        /* futex word, bumped to wake them */
+} mpmc_t;
+/* $end mpmct */
+
+void mpmc_init(mpmc_t *q, int n);
+void mpmc_insert(mpmc_t *q, conn_t *item);
+void mpmc_remove(mpmc_t *q, conn_t *item);
+
+#endif /* __MPMC_H__ */
+/* $end mpmc.h */
@@ -0,0 +1,283 @@
+/*
+ * origin.c - per-origin concurrency limits and circuit breaker
+ *
+ * Every host:port the proxy talks to gets a small record holding the
+ * number of requests in flight to it and the outcome (success or
+ * failure) of its last ORIGIN_WINDOW requests. A request may proceed
+ * only while the origin has fewer than -m (ORIGIN_MAX_INFLIGHT) requests
+ * in flight, so one slow origin can tie up at most that many workers.
+ * One over the limit waits for a slot, as long as a connect may take,
+ * before it is refused. Records are hashed over ORIGIN_BUCKETS chains
+ * under striped locks, as client.c does, and one that has had nothing
+ * in flight for ORIGIN_IDLE_SECS is reclaimed when a lookup passes it,
+ * so a client naming ever new hosts does not grow the table for good.
+ *
+ * The breaker opens when ORIGIN_FAIL_RUN requests in a row fail or the
+ * failure rate over the window reaches ORIGIN_FAIL_PCT. While open,
+ * requests for the origin fail at once. After the open period a single
+ * request is let through as a half-open probe: success closes the
+ * breaker, failure reopens it for twice as long (up to ORIGIN_MAX_OPEN).
+ *
+ * Failures are connect errors and timeouts, responses that never
+ * arrive, and 5xx statuses. origin_connect bounds the connect and all
+ * later socket I/O, so a stuck origin cannot hold a worker forever.
+ */
+/* $begin origin.c */
+#include <poll.h>
+#include "csapp.h"
+#include "origin.h"
+#include "sockopt.h"
+#include "coro.h"
+
+#define CLOSED    0
+#define OPEN      1
+#define HALF_OPEN 2
+
+struct origin {
+    char *key;          /* host:port */
+    unsigned chain;     /* index into buckets */
+    time_t seen;        /* last acquired or released */
+    int inflight;
+    int state;
+    int probing;        /* half-open probe in flight */
+    unsigned window;    /* bit i set: i-th most recent outcome failed */
+    int samples;        /* outcomes in window, up to ORIGIN_WINDOW */
+    int run;            /* consecutive failures */
+    int open_secs;      /* length of the current/next open period */
+    time_t open_until;
+    struct origin *next;
+};
+
+static origin_t *buckets[ORIGIN_BUCKETS];
+static pthread_mutex_t locks[ORIGIN_STRIPES];
+static int max_inflight;
+
+static origin_t *find_origin(char *key, unsigned h, time_t now);
+static unsigned hash_key(char *key);
+static int failures(unsigned window, int samples);
+
+void origin_init(int max)
+{
+    int i;
+
+    max_inflight = max;
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < ORIGIN_STRIPES; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+/*
+ * origin_acquire - claim an in-flight slot on host:port, waiting up to
+ * wait_ms for one if they are all taken
+ * Returns the origin's record, to be handed back to origin_release, or
+ * NULL with *why set to ORIGIN_BUSY or ORIGIN_OPEN.
+ */
+/* $begin origin_acquire */
+origin_t *origin_acquire(char *host, char *port, int wait_ms, int *why)
+{
+    char key[MAXLINE];
+    origin_t *o;
+    unsigned h;
+    time_t now;
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    h = hash_key(key) % ORIGIN_BUCKETS;
+    while (1) {
+        now = time(NULL);
+        pthread_mutex_lock(&locks[h % ORIGIN_STRIPES]);
+        o = find_origin(key, h, now);
+        if (o->state == OPEN && now >= o->open_until) {
+            o->state = HALF_OPEN; /* time to probe */
+            o->probing = 0;
+        }
+        if (o->state == OPEN || (o->state == HALF_OPEN && o->probing)) {
+            *why = ORIGIN_OPEN;
+            o = NULL;
+        } else if (o->inflight >= max_inflight) {
+            *why = ORIGIN_BUSY;
+            o = NULL;
+        } else {
+            if (o->state == HALF_OPEN)
+                o->probing = 1;
+            o->inflight++;
+            o->seen = now;
+        }
+        pthread_mutex_unlock(&locks[h % ORIGIN_STRIPES]);
+        if (o || *why != ORIGIN_BUSY || wait_ms <= 0)
+            return o;
+
+        /* a coroutine parks, a thread sleeps */
+        coro_poll(NULL, 0, ORIGIN_WAIT_MS);
+        wait_ms -= ORIGIN_WAIT_MS;
+    }
+}
+/* $end origin_acquire */
+
+/*
+ * origin_release - give back the slot, recording whether the request
+ * succeeded, and open or close the breaker accordingly
+ */
+/* $begin origin_release */
+void origin_release(origin_t *o, int ok)
+{
+    pthread_mutex_t *lock = &locks[o->chain % ORIGIN_STRIPES];
+
+    pthread_mutex_lock(lock);
+    o->inflight--;
+    o->seen = time(NULL);
+    o->window = (o->window << 1 | !ok) & ((1u << ORIGIN_WINDOW) - 1);
+    if (o->samples < ORIGIN_WINDOW)
+        o->samples++;
+    o->run = ok ? 0 : o->run + 1;
+
+    if (o->state == HALF_OPEN) {
+        o->probing = 0;
+        if (ok) { /* recovered: start over with a clean record */
+            o->state = CLOSED;
+            o->window = o->samples = 0;
+            o->open_secs = ORIGIN_OPEN_SECS;
+            printf("PROXY: Origin %s recovered, breaker closed.\n", o->key);
+        } else {
+            o->state = OPEN;
+            o->open_secs = o->open_secs * 2 > ORIGIN_MAX_OPEN ? ORIGIN_MAX_OPEN : o->open_secs * 2;
+            o->open_until = time(NULL) + o->open_secs;
+        }
+    } else if (o->state == CLOSED && !ok && (o->run >= ORIGIN_FAIL_RUN || 
+               (o->samples >= ORIGIN_MIN_SAMPLES && 
+                failures(o->window, o->samples) * 100 >= ORIGIN_FAIL_PCT * o->samples))) {
+        o->state = OPEN;
+        o->open_until = time(NULL) + o->open_secs;
+        printf("PROXY: Origin %s failing, breaker open for %d s.\n", o->key, o->open_secs);
+    }
+    pthread_mutex_unlock(lock);
+}
+/* $end origin_release */
+
+/* A getaddrinfo call, so that a coroutine can have it run elsewhere */
+typedef struct {
+    char *host, *port;
+    struct addrinfo hints, *list;
+    int rc;
+} lookup_t;
+
+static void lookup(void *arg)
+{
+    lookup_t *lk = arg;
+
+    lk->rc = getaddrinfo(lk->host, lk->port, &lk->hints, &lk->list);
+}
+
+/*
+ * origin_connect - open_clientfd with a bounded connect, and with send
+ * and receive timeouts set on the connected socket
+ * On a coroutine the lookup runs on a helper thread, the connect waits
+ * in coro_poll and the socket is left non-blocking.
+ * Returns a connected descriptor, or -1.
+ */
+/* $begin origin_connect */
+int origin_connect(char *host, char *port)
+{
+    int fd = -1, err, flags;
+    socklen_t errlen = sizeof(err);
+    struct addrinfo *listp, *p;
+    struct pollfd pfd;
+    struct timeval tv = { ORIGIN_IO_SECS, 0 };
+    lookup_t lk;
+
+    memset(&lk.hints, 0, sizeof(struct addrinfo));
+    lk.hints.ai_socktype = SOCK_STREAM;
+    lk.hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    lk.host = host;
+    lk.port = port;
+    coro_offload(lookup, &lk); /* DNS may block: not on a loop thread */
+    if (lk.rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(lk.rc));
+        return -1;
+    }
+    listp = lk.list;
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        sockopt_upstream(fd);
+        flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        if (errno == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (coro_poll(&pfd, 1, ORIGIN_CONNECT_MS) == 1 && 
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+                break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    if (fd < 0)
+        return -1;
+
+    if (!coro_self())
+        fcntl(fd, F_SETFL, flags);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+/* $end origin_connect */
+
+/* helpers */
+
+/*
+ * find_origin - find or create key's record on chain h, reclaiming idle
+ * records on the way; caller holds the chain's lock
+ * A record is idle with nothing in flight and no open breaker to remember.
+ */
+static origin_t *find_origin(char *key, unsigned h, time_t now)
+{
+    origin_t *o, **pp;
+
+    for (pp = &buckets[h]; (o = *pp) != NULL; ) {
+        if (!strcmp(o->key, key))
+            return o;
+        if (!o->inflight && now - o->seen > ORIGIN_IDLE_SECS &&
+            (o->state != OPEN || now >= o->open_until)) {
+            *pp = o->next; /* reclaim on the way */
+            Free(o->key);
+            Free(o);
+            continue;
+        }
+        pp = &o->next;
+    }
+
+    o = Calloc(1, sizeof(origin_t));
+    o->key = Malloc(strlen(key) + 1);
+    strcpy(o->key, key);
+    o->chain = h;
+    o->seen = now;
+    o->state = CLOSED;
+    o->open_secs = ORIGIN_OPEN_SECS;
+    o->next = buckets[h];
+    buckets[h] = o;
+    return o;
+}
+
+/* hash_key - djb2 over host:port */
+static unsigned hash_key(char *key)
+{
+    unsigned h = 5381;
+
+    for (; *key; key++)
+        h = h * 33 + (unsigned char)*key;
+    return h;
+}
+
+static int failures(unsigned window, int samples)
+{
+    int n = 0;
+
+    for (; samples > 0; samples--, window >>= 1)
+        n += window & 1;
+    return n;
+}
+/* $end origin.c */
@@ -0,0 +1,34 @@
+/*
+ * origin.h - per-origin concurrency limits and circuit breaker
+ */
+/* $begin origin.h */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#define ORIGIN_MAX_INFLIGHT 8    /* default concurrent requests per host:port (-m) */
+#define ORIGIN_WAIT_MS      10   /* between looks for a free slot, while waiting */
+#define ORIGIN_BUCKETS      1024 /* hash chains over host:port */
+#define ORIGIN_STRIPES      64   /* locks; chain i is guarded by lock i % ORIGIN_STRIPES */
+#define ORIGIN_IDLE_SECS    60   /* idle records this long are reclaimed */
+#define ORIGIN_WINDOW       20   /* outcomes remembered per origin */
+#define ORIGIN_MIN_SAMPLES  10   /* outcomes needed before judging the rate */
+#define ORIGIN_FAIL_PCT     50   /* failure rate that opens the breaker */
+#define ORIGIN_FAIL_RUN     5    /* consecutive failures that open it */
+#define ORIGIN_OPEN_SECS    5    /* first open period; doubles per failed probe */
+#define ORIGIN_MAX_OPEN     60   /* longest open period */
+#define ORIGIN_CONNECT_MS   3000 /* connect timeout */
+#define ORIGIN_IO_SECS      15   /* send/receive timeout once connected */
+
+/* Why origin_acquire turned a request away */
+#define ORIGIN_BUSY 1 /* the most requests allowed already in flight */
+#define ORIGIN_OPEN 2 /* breaker open: origin considered down */
+
+typedef struct origin origin_t;
+
+void origin_init(int max_inflight);
+origin_t *origin_acquire(char *host, char *port, int wait_ms, int *why);
+void origin_release(origin_t *o, int ok);
+int origin_connect(char *host, char *port);
+
+#endif /* __ORIGIN_H__ */
+/* $end origin.h */
@@ -0,0 +1,377 @@
+/*
+ * peer.c - consistent-hash cache sharing between sibling proxies
+ *
+ * With -p self,sibling,... (each host:port) proxies running side by
+ * side divide the cache between them instead of each caching
+ * everything it is asked for. Every proxy places all of them, itself
+ * included, on a hash ring at PEER_VNODES points each, so all agree on
+ * which one owns a cache key: the first proxy clockwise from the key's
+ * hash that is up. A miss on a key some sibling owns is first asked of
+ * that sibling; what is fetched from the origin for such a key is
+ * handed to its owner rather than kept here. If the owner is down its
+ * keys fall to the next proxy on the ring, and only those move.
+ *
+ * The siblings speak a line protocol on the port named first:
+ *
+ *     GET <key>              ->  HIT <size>, then size bytes | MISS
+ *     PUT <size> <key>       followed by size bytes, no answer
+ *     PING                   ->  PONG
+ *
+ * Only fresh objects are answered with HIT. A thread pings each
+ * sibling every PEER_HEARTBEAT_MS, and one that has not answered for
+ * PEER_DEAD_MS (or just failed a request) owns nothing until it does.
+ * Connections are taken only from the addresses in the list.
+ */
+/* $begin peer.c */
+#include <stdint.h>
+#include "csapp.h"
+#include "io_wrappers.h"
+#include "peer.h"
+#include "cache.h"
+#include "origin.h"
+#include "admit.h"
+
+typedef struct {
+    char host[MAXLINE];
+    char port[8];
+    char addr[NI_MAXHOST];         /* numeric, to recognize its connections */
+    volatile long long last_seen;  /* monotonic ns of its last answer, 0 if down */
+} node_t;
+
+typedef struct {
+    uint64_t hash;
+    int node;
+} vnode_t;
+
+/* a store on its way to the owner */
+typedef struct {
+    int peer;
+    int size;
+    char key[MAXLINE];
+    char obj[];
+} store_t;
+
+int peer_enabled = 0;
+
+static node_t nodes[PEER_MAX];     /* nodes[0] is this proxy */
+static int nnodes;
+static vnode_t ring[PEER_MAX * PEER_VNODES];
+static int nring;
+static int peer_listenfd;
+
+static void *listen_thread(void *vargp);
+static void *serve_thread(void *vargp);
+static void *heartbeat_thread(void *vargp);
+static void *store_thread(void *vargp);
+static int peer_connect(int peer);
+static int peer_up(int peer);
+static int vnode_cmp(const void *a, const void *b);
+static uint64_t hash_str(char *s);
+
+/*
+ * peer_init - parse "self,sibling,..." and listen for the siblings;
+ * called before any fork, so that worker processes share the socket
+ */
+/* $begin peer_init */
+void peer_init(char *spec)
+{
+    struct addrinfo hints, *ai;
+    char *tok, *save, *colon, name[MAXLINE + 16];
+    int i, v;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    for (tok = strtok_r(spec, ",", &save); tok && nnodes < PEER_MAX; 
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!(colon = strrchr(tok, ':')) || colon == tok || strlen(colon + 1) >= 8) {
+            fprintf(stderr, "peer: bad address %s, want host:port\n", tok);
+            exit(1);
+        }
+        *colon = '\0';
+        strcpy(nodes[nnodes].host, tok);
+        strcpy(nodes[nnodes].port, colon + 1);
+        if (getaddrinfo(tok, colon + 1, &hints, &ai) == 0) {
+            getnameinfo(ai->ai_addr, ai->ai_addrlen, nodes[nnodes].addr, NI_MAXHOST,
+                        NULL, 0, NI_NUMERICHOST);
+            freeaddrinfo(ai);
+        }
+        nnodes++;
+    }
+
+    /* the ring is built from the names alone, the same on every proxy */
+    for (i = 0; i < nnodes; i++)
+        for (v = 0; v < PEER_VNODES; v++) {
+            snprintf(name, sizeof(name), "%s:%s#%d", nodes[i].host, nodes[i].port, v);
+            ring[nring].hash = hash_str(name);
+            ring[nring++].node = i;
+        }
+    qsort(ring, nring, sizeof(vnode_t), vnode_cmp);
+
+    peer_listenfd = Open_listenfd(nodes[0].port);
+    peer_enabled = 1;
+}
+/* $end peer_init */
+
+/*
+ * peer_start - answer siblings and ping them, in each process
+ */
+void peer_start(void)
+{
+    pthread_t tid;
+
+    if (!peer_enabled)
+        return;
+    Pthread_create(&tid, NULL, listen_thread, NULL);
+    Pthread_create(&tid, NULL, heartbeat_thread, NULL);
+}
+
+/*
+ * peer_owner - the sibling that owns key
+ * Returns its index for peer_lookup and peer_store, or -1 if this
+ * proxy owns key itself (or peer mode is off).
+ */
+/* $begin peer_owner */
+int peer_owner(char *key)
+{
+    uint64_t h;
+    int lo, hi, mid, n, node;
+
+    if (!peer_enabled)
+        return -1;
+    h = hash_str(key);
+    for (lo = 0, hi = nring; lo < hi; ) { /* first point at or after h */
+        mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (n = 0; n < nring; n++) {
+        node = ring[(lo + n) % nring].node;
+        if (node == 0)
+            return -1;
+        if (peer_up(node))
+            return node;
+    }
+    return -1;
+}
+/* $end peer_owner */
+
+/*
+ * peer_lookup - ask a sibling for keys in turn, into objbuf
+ * Returns the index of the key it had fresh, or -1.
+ */
+/* $begin peer_lookup */
+int peer_lookup(int peer, char **keys, int nkeys, char *objbuf, int *size)
+{
+    rio_t rio;
+    char line[MAXLINE];
+    int fd, i;
+
+    if ((fd = peer_connect(peer)) < 0)
+        return -1;
+    rio_readinitb(&rio, fd);
+    for (i = 0; i < nkeys; i++) {
+        snprintf(line, MAXLINE, "GET %.8000s\r\n", keys[i]);
+        if (rio_writen_w(fd, line, strlen(line)) < 0 || rio_readlineb_w(&rio, line, MAXLINE) <= 0) {
+            nodes[peer].last_seen = 0; /* skip it until the next heartbeat */
+            break;
+        }
+        if (sscanf(line, "HIT %d", size) == 1) {
+            if (*size <= 0 || *size > MAX_OBJECT_SIZE || rio_readnb_w(&rio, objbuf, *size) != *size)
+                break;
+            rio_releaseb(&rio);
+            close(fd);
+            return i;
+        }
+    }
+    rio_releaseb(&rio);
+    close(fd);
+    return -1;
+}
+/* $end peer_lookup */
+
+/*
+ * peer_store - hand a copy of obj to the sibling that owns key, from a
+ * detached thread so that the client is not kept waiting
+ */
+void peer_store(int peer, char *key, char *obj, int size)
+{
+    pthread_t tid;
+    store_t *st = Malloc(sizeof(store_t) + size);
+
+    st->peer = peer;
+    st->size = size;
+    snprintf(st->key, MAXLINE, "%s", key);
+    memcpy(st->obj, obj, size);
+    if (pthread_create(&tid, NULL, store_thread, st) != 0)
+        Free(st); /* the owner fetches it itself next time */
+}
+
+static void *store_thread(void *vargp)
+{
+    store_t *st = vargp;
+    char line[MAXLINE + 32];
+    int fd;
+
+    Pthread_detach(pthread_self());
+    if ((fd = peer_connect(st->peer)) >= 0) {
+        snprintf(line, sizeof(line), "PUT %d %s\r\n", st->size, st->key);
+        if (rio_writen_w(fd, line, strlen(line)) < 0 || rio_writen_w(fd, st->obj, st->size) < 0)
+            nodes[st->peer].last_seen = 0;
+        close(fd);
+    }
+    Free(st);
+    return NULL;
+}
+
+/* listen_thread - take connections from the siblings, a thread each */
+static void *listen_thread(void *vargp)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    char addr[NI_MAXHOST];
+    pthread_t tid;
+    int fd, i, *fdp;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        salen = sizeof(sa);
+        if ((fd = accept(peer_listenfd, (SA *)&sa, &salen)) < 0)
+            continue;
+        addr[0] = '\0';
+        getnameinfo((SA *)&sa, salen, addr, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
+        for (i = 1; i < nnodes && strcmp(addr, nodes[i].addr); i++)
+            ;
+        if (i == nnodes) { /* not a sibling */
+            close(fd);
+            continue;
+        }
+        fdp = Malloc(sizeof(int));
+        *fdp = fd;
+        if (pthread_create(&tid, NULL, serve_thread, fdp) != 0) {
+            close(fd);
+            Free(fdp);
+        }
+    }
+    return NULL;
+}
+
+/* serve_thread - answer one sibling's requests until it hangs up */
+/* $begin serve_thread */
+static void *serve_thread(void *vargp)
+{
+    int fd = *(int *)vargp, size;
+    struct timeval tv = { PEER_IDLE_SECS, 0 };
+    cache_policy_t policy;
+    rio_t rio;
+    char line[MAXLINE], *key, *obj = Malloc(MAX_OBJECT_SIZE);
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    rio_readinitb(&rio, fd);
+    while (rio_readlineb_w(&rio, line, MAXLINE) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!strcmp(line, "PING")) {
+            if (rio_writen_w(fd, "PONG\r\n", 6) < 0)
+                break;
+        } else if (!strncmp(line, "GET ", 4)) {
+            if (cache_lookup(line + 4, obj, &size) == CACHE_FRESH) {
+                snprintf(line, MAXLINE, "HIT %d\r\n", size);
+                if (rio_writen_w(fd, line, strlen(line)) < 0 || rio_writen_w(fd, obj, size) < 0)
+                    break;
+            } else if (rio_writen_w(fd, "MISS\r\n", 6) < 0)
+                break;
+        } else if (sscanf(line, "PUT %d", &size) == 1 && (key = strchr(line + 4, ' ')) &&
+                   size > 0 && size <= MAX_OBJECT_SIZE) {
+            if (rio_readnb_w(&rio, obj, size) != size)
+                break;
+            cache_parse_policy(obj, size, &policy);
+            cache_insert(key + 1, obj, size, &policy);
+        } else
+            break; /* not our protocol */
+        if (rio.rio_cnt == 0) /* idle until the sibling's next request */
+            rio_releaseb(&rio);
+    }
+    rio_releaseb(&rio);
+    close(fd);
+    Free(obj);
+    return NULL;
+}
+/* $end serve_thread */
+
+/* heartbeat_thread - ping every sibling, noting which answer */
+static void *heartbeat_thread(void *vargp)
+{
+    rio_t rio;
+    char line[MAXLINE];
+    int fd, i, up;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        for (i = 1; i < nnodes; i++) {
+            up = peer_up(i);
+            if ((fd = peer_connect(i)) >= 0) {
+                rio_readinitb(&rio, fd);
+                if (rio_writen_w(fd, "PING\r\n", 6) == 6 && 
+                    rio_readlineb_w(&rio, line, MAXLINE) > 0 && !strncmp(line, "PONG", 4))
+                    nodes[i].last_seen = monotonic_ns();
+                rio_releaseb(&rio);
+                close(fd);
+            }
+            if (up != peer_up(i))
+                printf("PROXY: Peer %s:%s is %s.\n", nodes[i].host, nodes[i].port, 
+                       up ? "down" : "up");
+        }
+        usleep(PEER_HEARTBEAT_MS * 1000);
+    }
+    return NULL;
+}
+
+/* peer_connect - connect to a sibling with short timeouts, or -1 */
+static int peer_connect(int peer)
+{
+    struct timeval tv = { PEER_IO_MS / 1000, PEER_IO_MS % 1000 * 1000 };
+    int fd;
+
+    if ((fd = origin_connect(nodes[peer].host, nodes[peer].port)) < 0) {
+        nodes[peer].last_seen = 0;
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static int peer_up(int peer)
+{
+    long long seen = nodes[peer].last_seen;
+
+    return seen && monotonic_ns() - seen < PEER_DEAD_MS * 1000000LL;
+}
+
+static int vnode_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((vnode_t *)a)->hash, y = ((vnode_t *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+/* hash_str - 64-bit FNV-1a, then the murmur3 finalizer: names that
+ * differ only in their last digits must land far apart on the ring */
+static uint64_t hash_str(char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+/* $end peer.c */
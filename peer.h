@@ -0,0 +1,24 @@
+/*
+ * peer.h - consistent-hash cache sharing between sibling proxies
+ */
+/* $begin peer.h */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#define PEER_MAX          16    /* proxies in the ring, this one included */
+#define PEER_VNODES       64    /* points per proxy on the hash ring */
+#define PEER_HEARTBEAT_MS 1000  /* how often each sibling is pinged */
+#define PEER_DEAD_MS      3000  /* a sibling silent this long owns nothing */
+#define PEER_IO_MS        500   /* send/receive timeout toward a sibling */
+#define PEER_IDLE_SECS    10    /* a sibling's connection idle this long is closed */
+
+extern int peer_enabled;
+
+void peer_init(char *spec);
+void peer_start(void);
+int peer_owner(char *key);
+int peer_lookup(int peer, char **keys, int nkeys, char *objbuf, int *size);
+void peer_store(int peer, char *key, char *obj, int size);
+
+#endif /* __PEER_H__ */
+/* $end peer.h */
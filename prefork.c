@@ -0,0 +1,77 @@
+/*
+ * prefork.c - the proxy as several worker processes
+ *
+ * With -P n the process that owns the listening socket forks n copies
+ * of itself and from then on only supervises them. Each worker process
+ * starts its own threads and accepts on the inherited socket, so a
+ * crash takes down one process's connections rather than all of them;
+ * the cache, mapped shared before the fork (cache.c), is common to all.
+ * A worker that exits is replaced. SIGTERM, or a successor taking over
+ * the socket with -H, makes the supervisor pass SIGTERM on to the
+ * workers and exit once they have drained. Should the supervisor die,
+ * the kernel sends its workers SIGTERM as well.
+ */
+/* $begin prefork.c */
+#include <sys/prctl.h>
+#include "csapp.h"
+#include "prefork.h"
+#include "handoff.h"
+
+static pid_t spawn(void);
+
+/*
+ * prefork - fork nprocs worker processes and supervise them
+ * Returns in each worker; the supervisor itself never returns.
+ */
+/* $begin prefork */
+void prefork(int nprocs, int listenfd)
+{
+    pid_t *pids = Calloc(nprocs, sizeof(pid_t)), pid;
+    int i, status;
+
+    fflush(stdout); /* or every worker prints it again */
+    for (i = 0; i < nprocs; i++)
+        if ((pids[i] = spawn()) == 0)
+            return;
+    handoff_ready(listenfd);
+
+    while (!handoff_draining) {
+        if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
+            sleep(PREFORK_POLL_SECS); /* SIGTERM cuts this short */
+            continue;
+        }
+        for (i = 0; i < nprocs && pids[i] != pid; i++)
+            ;
+        if (i == nprocs)
+            continue;
+        if (WIFSIGNALED(status))
+            printf("PROXY: Worker process %d killed by signal %d, restarting it.\n", 
+                   (int)pid, WTERMSIG(status));
+        else
+            printf("PROXY: Worker process %d exited with status %d, restarting it.\n", 
+                   (int)pid, WEXITSTATUS(status));
+        fflush(stdout);
+        if ((pids[i] = spawn()) == 0)
+            return;
+    }
+
+    for (i = 0; i < nprocs; i++)
+        kill(pids[i], SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+    handoff_drain(); /* exits */
+}
+/* $end prefork */
+
+/* spawn - fork a worker that drains on SIGTERM, as the proxy would */
+static pid_t spawn(void)
+{
+    pid_t pid;
+
+    if ((pid = Fork()) == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        handoff_init(NULL);
+    }
+    return pid;
+}
+/* $end prefork.c */
@@ -0,0 +1,13 @@
+/*
+ * prefork.h - the proxy as several worker processes
+ */
+/* $begin prefork.h */
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+#define PREFORK_POLL_SECS 1  /* how often the supervisor reaps workers */
+
+void prefork(int nprocs, int listenfd);
+
+#endif /* __PREFORK_H__ */
+/* $end prefork.h */
@@ -40,11 +40,114 @@
  * from binary data; need to copy such data (like images/videos)
  * from the server to the client.
  *
- * Implementing POST and HEAD is optional.
+ * Implementing POST and HEAD is optional. POST, PUT, PATCH and DELETE
+ * are passed on (never cached), their bodies streamed to the origin as
+ * they arrive, whether framed by Content-Length or chunked; a client
+ * that sends Expect: 100-continue is told to go ahead once the origin
+ * is connected.
  *
- * Part II
+ * Part II (implemented)
+ * The proxy is prethreaded: the main thread accepts and NTHREADS
+ * workers serve connections taken from a bounded buffer (sbuf.c).
+ * Between the two sits an admission controller (admit.c) that limits
+ * the connections in flight by how long they wait for a worker, so
+ * that when origins slow down new clients are refused at once with
+ * 503 + Retry-After (or, with -a backlog, left in the listen queue)
+ * instead of every request timing out behind stuck workers. Each
+ * origin may hold at most -m workers (ORIGIN_MAX_INFLIGHT unless given;
+ * requests over that wait briefly for one to free up), connects and
+ * reads toward it time out, and a circuit breaker (origin.c) fails
+ * requests to an origin fast while it keeps failing.
+ *
+ * Each client address has its own token buckets (client.c), -r
+ * requests and -b bytes per second; a client over either is refused
+ * with 429 + Retry-After. Both are off unless given, so that a load
+ * test from a single address measures the proxy, not the limit. Connections waiting for a worker are queued
+ * per client and handed out by deficit round robin, so that a client
+ * pulling large objects or opening many connections cannot crowd out
+ * the others. With -Q they go through a lock-free FIFO (mpmc.c)
+ * instead, which costs less per connection at high accept rates but
+ * gives up that fairness.
+ *
+ * Clients are identified by numeric address only; -l writes an access
+ * log (accesslog.c), and -R adds host names to it, looked up by
+ * background threads (rdns.c) so that no request waits on DNS.
+ *
+ * SIGTERM makes the proxy stop accepting and exit once the requests
+ * in flight are done. With -H a newly started proxy takes over the
+ * listening socket from the running one over a Unix socket (handoff.c),
+ * and the old one then drains the same way, so an upgrade refuses no
+ * connection and cuts no download short.
+ *
+ * All sockets get the TCP profile given with -o (sockopt.c): by default
+ * TCP_NODELAY, TCP_DEFER_ACCEPT on the listener, and TCP_CORK around
+ * writes that would otherwise leave headers in a segment of their own.
+ * 
+ * With -P n, the proxy forks n worker processes that each run all of
+ * the above on the same listening socket, supervised by the first
+ * (prefork.c), which replaces any that die.
  * 
- * Part III
+ * Part III (implemented)
+ * Responses of up to MAX_OBJECT_SIZE bytes are kept in an in-memory
+ * LRU cache (cache.c) keyed by a hash of the URL in canonical form
+ * (cachekey.c), so that spellings of a URL that differ only in case,
+ * escapes, dot segments or the order of the query share one copy; a
+ * response with Vary is kept per value of the request headers it
+ * names. The cache is mapped shared, so worker processes all serve
+ * from the same one. Objects without an explicit Cache-Control max-age
+ * stay fresh for DEFAULT_MAX_AGE seconds. Past that, an object inside its stale-while-revalidate
+ * window is still served at once while a detached thread refetches
+ * it through the usual connect/send_request path; an object
+ * inside its stale-if-error window is served only when the origin
+ * cannot be reached or answers with a 5xx. Both windows default to
+ * the -w/-e command line values when the origin does not name them.
+ *
+ * Clients that accept gzip get text/html, text/plain and JSON bodies
+ * compressed at level -z (gzip.c) when the origin did not encode them.
+ * The compressed copy is cached under its own key, beside the plain
+ * one, so it is only compressed again when it is refetched. Only those
+ * clients' requests ask the origin for gzip, so the plain copy is never
+ * one the origin encoded.
+ *
+ * With -p, proxies running side by side split the cache by consistent
+ * hashing (peer.c): a miss on a key a sibling owns is asked of that
+ * sibling before the origin, and an object fetched for such a key is
+ * handed to its owner instead of being cached here.
+ *
+ * CONNECT host:port opens a tunnel: once the target is connected and
+ * the client told so, both sockets go to a single epoll thread
+ * (tunnel.c) that splices bytes each way until both sides are done or
+ * the tunnel idles out, so open tunnels tie up no worker.
+ *
+ * With -U the accept loop and the relay of bodies too big to cache
+ * run on io_uring (uring.c): one multishot accept stays armed on the
+ * listening socket, and bodies are spliced origin->pipe->client in
+ * linked pairs. Without kernel support the plain syscalls are used.
+ *
+ * With -2, clients may speak HTTP/2 over cleartext (h2.c), by prior
+ * knowledge or by upgrading a GET. Each stream is turned back into an
+ * HTTP/1 request on a socketpair and served by doit on a thread of its
+ * own, so streams share the cache and origin limits with everything
+ * else; the connection itself keeps its worker while it is open.
+ *
+ * With -t n, one request in n is traced (trace.c): the time it spends
+ * waiting for a worker, reading the request, in the cache, connecting,
+ * sending and relaying is recorded, per thread and without locking, and
+ * SIGUSR1 writes what is held as Chrome trace-event JSON, one timeline
+ * per request, for chrome://tracing or Perfetto.
+ *
+ * With -C n, connections are not queued for workers but each served by
+ * a coroutine on one of n epoll loops (coro.c). The request path is the
+ * same code: the rio wrappers yield to the loop where a read or write
+ * would block, so an idle or slow connection costs a stack rather than
+ * a thread, and the admission limit rises to CORO_MAX.
+ *
+ * With -S n, n workers accept for themselves instead, each onto a
+ * deque of its own, and a worker with nothing to do steals from a busy
+ * one (steal.c), so that connections stuck behind a slow download on
+ * one worker are picked up by another without a shared queue to
+ * contend on. Connections are then served in no per-client order.
+ *
  * For testing, browser caching should be disabled. For firefox, 
  * type "about:config" in a new tab, search for 
  * network.http.use-cache and toggle from true to false.
@@ -70,90 +173,653 @@
 #include <stdio.h>
 #include "csapp.h"
 #include "io_wrappers.h"
+#include "cache.h"
+#include "uring.h"
+#include "sbuf.h"
+#include "admit.h"
+#include "origin.h"
+#include "client.h"
+#include "accesslog.h"
+#include "handoff.h"
+#include "bufpool.h"
+#include "sockopt.h"
+#include "gzip.h"
+#include "tunnel.h"
+#include "h2.h"
+#include "coro.h"
+#include "steal.h"
+#include "mpmc.h"
+#include "prefork.h"
+#include "peer.h"
+#include "cachekey.h"
+#include "trace.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Worker pool */
+#define NTHREADS 16
+#define SBUFSIZE 64
 
 /* You won't lose style points for including this long line in your code */
 // static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *user_agent_hdr_alt = "Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:84.0) Gecko/20100101 Firefox/84.0";
 static const char *accept_header = "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
-static const char *accept_encoding_header = "gzip, deflate";
+static const char *accept_encoding_header = "gzip"; /* or identity, see send_request */
+
+/* request headers the proxy looks at, and those it passes through */
+typedef struct {
+    char host[MAXLINE];     /* Host: value, or the URL's host if absent */
+    char range[MAXLINE];    /* Range: value, empty if absent */
+    int gzip;               /* the client accepts gzip (and -z is not 0) */
+    long length;            /* Content-Length of the body, -1 if absent */
+    int chunked;            /* the body comes in chunked framing */
+    int expect_continue;    /* Expect: 100-continue */
+    int h2c;                /* Upgrade: h2c, and -2 is given */
+    char h2settings[MAXLINE]; /* HTTP2-Settings: value, empty if absent */
+    char toserver[MAXLINE]; /* remaining headers, forwarded unaltered */
+} reqhdrs_t;
+
+/* what a background refresh needs to refetch a cached object */
+typedef struct {
+    char key[MAXLINE];      /* cache key of the identity variant */
+    char claim[MAXLINE];    /* key of the copy being refreshed */
+    char url[MAXLINE];      /* canonical URL, for the log */
+    int gzip;               /* refetch for a client that accepts gzip */
+    char targethost[MAXLINE];
+    char port[8];
+    reqhdrs_t hdrs;         /* Host, and the headers the copy varies on */
+    char request_toserver[MAXLINE];
+} refresh_t;
+
+/* what doit works with, kept off its stack: a coroutine's is small (coro.h) */
+typedef struct {
+    char targethost[MAXLINE], path[MAXLINE], request_toserver[MAXLINE];
+    char server_port[8], request_method[64], url[MAXLINE];
+    char cache_key[MAXLINE], gzip_key[MAXLINE], hit_key[MAXLINE], names[MAXLINE];
+    char upgrade[4 * MAXLINE + 64]; /* an Upgrade: h2c request, as stream 1 */
+    reqhdrs_t hdrs;
+    char objbuf[MAX_OBJECT_SIZE];
+} request_t;
+
+sbuf_t sbuf; /* accepted connections waiting for a worker */
+mpmc_t fifo; /* the same, first come first served, with -Q */
+int use_fifo = 0;
 
 /* HTTP functionality */
+void *thread(void *vargp);
+void dispatch(conn_t *conn);
+void serve(conn_t *conn);
+void serve_coro(void *arg);
+void doit(conn_t *conn, rio_t *rio_client, access_t *ac);
+void h2_stream(int fd, void *arg);
+void trace_request(long long id, long long start_ns, access_t *ac);
 int readparse_request(int fd, char *targethost, char *path, char *port, char *method, 
 	char *request_toserver, rio_t *rp);
-void parse_url(char *url, char *host, char *abs_path, char *port);
-void send_request(int server_connfd, char *request_toserver, char *targethost, rio_t *rio_client);
-void forward_response(rio_t *rio_server, rio_t *rio_client, int server_connfd, int client_connfd);
+int parse_url(char *url, char *host, char *abs_path, char *port);
+int parse_authority(char *authority, char *host, char *port);
+int read_requesthdrs(rio_t *rio_client, reqhdrs_t *hdrs);
+int send_request(int server_connfd, char *request_toserver, reqhdrs_t *hdrs);
+int send_body(rio_t *rio_client, int client_connfd, int server_connfd, reqhdrs_t *hdrs);
+int copy_body(rio_t *rio_client, int server_connfd, long n, char *buf, size_t bufsize);
+int forward_response(rio_t *rio_server, int server_connfd, int client_connfd, 
+	char *objbuf, int stale_ok, int *gzip, int *status, long *sent);
+int pass_on(int client_connfd, char *buf, ssize_t n, char *objbuf, int *objsize, long *sent);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void serve_cached(int client_connfd, char *obj, int size, char *range, access_t *ac);
+void open_tunnel(int client_connfd, rio_t *rio_client, char *host, char *port, access_t *ac);
+int parse_range(char *range, int total, int *first, int *last);
 
-void debug_status(rio_t *rp, int client_connfd);
+/* cache maintenance */
+void start_refresh(char *claim, char *key, int gzip, char *url, char *targethost, char *port, 
+	reqhdrs_t *hdrs, char *names, char *request_toserver);
+void variant_key(char *key, char *base, int gzip);
+int lookup_variant(char *key, char *objbuf, int *size, reqhdrs_t *hdrs, char *names);
+int lookup_peer(int peer, char **keys, int nkeys, char *objbuf, int *size, reqhdrs_t *hdrs);
+void store_response(char *key, char *obj, int size, reqhdrs_t *hdrs, int peer);
+void vary_key(char *key, char *base, char *names, reqhdrs_t *hdrs);
+int sent_header(reqhdrs_t *hdrs, char *name, char *value);
+void *refresh_thread(void *vargp);
+
+void debug_status(char *buf, int rio_cnt);
 void identify_client(const struct sockaddr *sa, socklen_t clientlen);
 
 
 /* $begin main */
 int main(int argc, char **argv)
 {
-    int listenfd, client_connfd, server_connfd, rio_cnt, content_length;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    rio_t rio_client, rio_server; /* or initiate new rio struct in each iteration? */
-    char targethost[MAXLINE], path[MAXLINE], request_toserver[MAXLINE], 
-    	server_buf[MAXLINE], server_port[8], request_method[64];
+    int i, listenfd, opt, use_uring = 0, admit_mode = ADMIT_SHED, resolve = 0, nloops = 0;
+    int nworkers = 0, nprocs = 0, trace_rate = 0, max_inflight = ORIGIN_MAX_INFLIGHT;
+    int default_swr = DEFAULT_SWR, default_sie = DEFAULT_SIE;
+    int req_rate = CLIENT_REQ_RATE;
+    long byte_rate = CLIENT_BYTE_RATE;
+    char *logfile = NULL, *handoff_path = NULL, *peers = NULL;
+    conn_t conn;
+    pthread_t tid;
 
 	/* Check command line args */
-    if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "w:e:Ua:r:b:l:RH:o:z:2C:S:QP:p:t:m:")) != -1) {
+        switch (opt) {
+        case 'w': /* default stale-while-revalidate window */
+            default_swr = atoi(optarg);
+            break;
+        case 'e': /* default stale-if-error window */
+            default_sie = atoi(optarg);
+            break;
+        case 'U': /* io_uring accept and relay, where the kernel has it */
+            use_uring = 1;
+            break;
+        case 'a': /* what to do over the admission limit: shed|backlog */
+            admit_mode = strcmp(optarg, "backlog") ? ADMIT_SHED : ADMIT_BACKLOG;
+            break;
+        case 'r': /* requests per second per client, 0 for no limit */
+            req_rate = atoi(optarg);
+            break;
+        case 'b': /* response bytes per second per client, 0 for no limit */
+            byte_rate = atol(optarg);
+            break;
+        case 'l': /* access log file, - for stdout */
+            logfile = optarg;
+            break;
+        case 'R': /* log client host names, resolved in the background */
+            resolve = 1;
+            break;
+        case 'H': /* control socket for handing the port to a new process */
+            handoff_path = optarg;
+            break;
+        case 'o': /* socket options, e.g. nodelay,cork,defer=1,sndbuf=262144 */
+            if (sockopt_parse(optarg) < 0)
+                optind = argc;
+            break;
+        case 'z': /* gzip level for compressible responses, 0 = off */
+            gzip_level = atoi(optarg);
+            if (gzip_level < 0 || gzip_level > 9)
+                optind = argc;
+            break;
+        case '2': /* HTTP/2 cleartext, by prior knowledge or Upgrade: h2c */
+            h2_enabled = 1;
+            break;
+        case 'C': /* serve connections as coroutines on this many event loops */
+            if ((nloops = atoi(optarg)) < 1)
+                optind = argc;
+            break;
+        case 'P': /* this many worker processes, sharing the cache */
+            if ((nprocs = atoi(optarg)) < 1)
+                optind = argc;
+            break;
+        case 'p': /* share the cache with siblings: self,sibling,... as host:port */
+            peers = optarg;
+            break;
+        case 'Q': /* lock-free FIFO to the workers instead of the fair sbuf */
+            use_fifo = 1;
+            break;
+        case 'S': /* this many work-stealing workers that accept themselves */
+            if ((nworkers = atoi(optarg)) < 1)
+                optind = argc;
+            break;
+        case 't': /* trace one request in this many, dumped on SIGUSR1 */
+            if ((trace_rate = atoi(optarg)) < 1)
+                optind = argc;
+            break;
+        case 'm': /* requests in flight to any one origin */
+            if ((max_inflight = atoi(optarg)) < 1)
+                optind = argc;
+            break;
+        default:
+            optind = argc; /* force the usage message */
+        }
+    }
+    if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-w swr_secs] [-e sie_secs] [-U] [-a shed|backlog] [-r reqs/s] [-b bytes/s] [-l logfile [-R]] [-H ctlsock] [-o sockopts] [-m per_origin] [-z gzip_level] [-p self,sibling,...] [-P procs] [-Q] [-2] [-t 1_in_n] [-C loops | -S workers] <port>\n", argv[0]);
 		exit(1);
     }
 
-	/* ignore SIGPIPE signals */
+	/* ignore SIGPIPE signals; SIGTERM drains, and goes to this thread only */
 	Signal(SIGPIPE, SIG_IGN);
+    handoff_init(handoff_path);
+    trace_init(trace_rate); /* SIGUSR1 too is kept from the threads to come */
 
-    /* sequential proxy: waits for contact by client, services a request, closes connection */
-    listenfd = Open_listenfd(argv[1]); /* exit if cmdline port invalid */
-    while (1) {
+    cache_init(default_swr, default_sie); /* shared with worker processes */
+    origin_init(max_inflight);
+    client_init(req_rate, byte_rate);
+
+    /* prethreaded proxy: main thread accepts, workers service requests */
+    if ((listenfd = handoff_receive()) < 0) /* a running proxy hands over its port */
+        listenfd = Open_listenfd(argv[optind]); /* exit if cmdline port invalid */
+    sockopt_listener(listenfd);
+    if (peers)
+		peer_init(peers);
+    if (nprocs)
+		prefork(nprocs, listenfd); /* returns in each worker process */
+    peer_start();
+    trace_start();
+    tunnel_init();
+    if (logfile)
+        accesslog_init(logfile, resolve);
+    if (use_uring)
+        uring_init(); /* leaves uring_enabled clear if unsupported */
+    if (nloops) { /* a coroutine per connection: no worker to wait for */
+		coro_init(nloops);
+		admit_init(CORO_MAX, admit_mode);
+    } else if (nworkers) {
+		/* with -a backlog a worker may wait in admit_enter, so it must
+		 * not hold connections others could be serving meanwhile */
+		admit_init(nworkers * (STEAL_DEQUE + 1), admit_mode);
+		steal_init(nworkers, listenfd, 
+			admit_mode == ADMIT_BACKLOG ? 1 : STEAL_BATCH, dispatch, serve);
+    } else {
+		if (use_fifo)
+			mpmc_init(&fifo, SBUFSIZE);
+		else
+			sbuf_init(&sbuf, SBUFSIZE);
+		admit_init(NTHREADS + SBUFSIZE, admit_mode); /* never blocks in sbuf_insert */
+		for (i = 0; i < NTHREADS; i++)
+			Pthread_create(&tid, NULL, thread, NULL);
+    }
+
+    if (!steal_enabled) /* a -S predecessor leaves it non-blocking */
+		fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) & ~O_NONBLOCK);
+
+    handoff_ready(listenfd);
+
+    while (steal_enabled && !handoff_draining)
+		sleep(1); /* the workers accept; SIGTERM cuts this short */
+    while (!steal_enabled && !handoff_draining) {
 		/* accept incoming connections */
-		clientlen = sizeof(clientaddr);
-		if ((client_connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
-			printf("Couldn't connect to client.\n"); 
+		conn.addrlen = sizeof(conn.addr);
+		if (uring_enabled) {
+			if ((conn.fd = uring_accept(listenfd)) >= 0)
+				getpeername(conn.fd, (SA *)&conn.addr, &conn.addrlen);
+		} else
+			conn.fd = accept(listenfd, (SA *)&conn.addr, &conn.addrlen);
+		if (conn.fd < 0) {
+			if (errno != EINTR)
+				printf("Couldn't connect to client.\n"); 
 			continue;
 		}
+		dispatch(&conn);
+    }
 
-		/* debugging, obtain client info; not necessary for basic proxy tasks */
-		identify_client((SA *) &clientaddr, clientlen);
+    /* upgrade or SIGTERM: serve what was accepted, then finish in-flight work */
+    if (steal_enabled)
+		steal_stop();
+    else if (uring_enabled) {
+		uring_accept_stop();
+		while ((conn.fd = uring_accept(listenfd)) >= 0 || errno == EINTR) {
+			conn.addrlen = sizeof(conn.addr);
+			if (conn.fd >= 0 && getpeername(conn.fd, (SA *)&conn.addr, &conn.addrlen) == 0)
+				dispatch(&conn);
+		}
+    }
+    handoff_drain(); /* exits */
 
-		/* set up the client-facing I/O buffer from rio package; extract the host/path/port requested by client */
-		if  (readparse_request(client_connfd, targethost, path, 
-			server_port, request_method, request_toserver, &rio_client) < 0) 
-			continue; /* move on to next request if unsuccessful */
+	return 0;
+}
+/* $end main */
 
-		/* proxy performs a client role: connect to the server */
-		if ((server_connfd = Open_clientfd(targethost, server_port)) < 0)
-			continue; /* move on to next request if unsuccessful */
+/*
+ * dispatch - queue an accepted connection for a worker, unless the
+ * client is over its rate or the proxy over its admission limit
+ */
+/* $begin dispatch */
+void dispatch(conn_t *conn)
+{
+    int retry;
+    access_t ac;
 
-		/* send request, check and modify mandatory headers then send all headers to server */  
-		send_request(server_connfd, request_toserver, targethost, &rio_client);
+    conn->accepted_ns = monotonic_ns();
 
-		/* set up server-facing I/O buffer; write server response to client */
-		forward_response(&rio_server, &rio_client, server_connfd, client_connfd);
+	/* debugging, obtain client info; not necessary for basic proxy tasks */
+	identify_client((SA *) &conn->addr, conn->addrlen);
 
-		Close(server_connfd);
-		Close(client_connfd);
+	/* per-client rate limits, then fail fast rather than queue behind stuck workers */
+	conn->client = client_acquire((SA *) &conn->addr);
+	if ((retry = client_admit(conn->client, &conn->cost))) {
+		admit_reject(conn->fd, "429 Too Many Requests", retry);
+		ac.status = 429;
+	} else if (!admit_enter()) {
+		admit_reject(conn->fd, "503 Service Unavailable", ADMIT_RETRY_AFTER);
+		ac.status = 503;
+	} else if (coro_enabled) {
+		coro_spawn(serve_coro, memcpy(Malloc(sizeof(conn_t)), conn, sizeof(conn_t)));
+		return;
+	} else if (steal_enabled) {
+		steal_push(conn); /* onto the deque of the worker that accepted it */
+		return;
+	} else if (use_fifo) {
+		mpmc_insert(&fifo, conn);
+		return;
+	} else {
+		sbuf_insert(&sbuf, conn);
+		return;
+	}
+	client_release(conn->client);
+	strcpy(ac.request, "-");
+	ac.bytes = 0;
+	accesslog_write((SA *) &conn->addr, conn->addrlen, &ac);
+}
+/* $end dispatch */
+
+/*
+ * thread - worker: service connections from the shared buffer forever
+ */
+/* $begin thread */
+void *thread(void *vargp)
+{
+    conn_t conn;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+		if (use_fifo)
+			mpmc_remove(&fifo, &conn);
+		else
+			sbuf_remove(&sbuf, &conn);
+		serve(&conn);
     }
+}
+/* $end thread */
 
-    Close(listenfd);
+/*
+ * serve_coro - coroutine: service one connection copied by dispatch
+ */
+void serve_coro(void *arg)
+{
+    conn_t *conn = arg;
 
-	return 0;
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    serve(conn);
+    Free(conn);
+}
+
+/*
+ * serve - service an admitted connection, then account for it
+ */
+/* $begin serve */
+void serve(conn_t *conn)
+{
+    access_t ac;
+    rio_t rio;
+    long long t;
+
+	admit_dequeued(conn->accepted_ns);
+	conn->trace = trace_sample();
+	trace_span(conn->trace, "queued", conn->accepted_ns, NULL); /* accept to worker */
+	sockopt_accepted(conn->fd);
+	strcpy(ac.request, "-");
+	ac.status = 0;
+	ac.bytes = 0;
+	t = TRACE_START(conn->trace);
+	doit(conn, &rio, &ac);
+	rio_releaseb(&rio);
+	close(conn->fd);
+	trace_request(conn->trace, t, &ac);
+	client_charge(conn->client, ac.bytes);
+	client_release(conn->client);
+	accesslog_write((SA *) &conn->addr, conn->addrlen, &ac);
+	admit_exit();
+}
+/* $end serve */
+
+/*
+ * doit - service one client request, from the cache when possible
+ * What was requested and sent is noted in *ac for the access log.
+ * The caller releases rio_client (rio_releaseb) once done with conn.
+ */
+/* $begin doit */
+void doit(conn_t *conn, rio_t *rio_client, access_t *ac)
+{
+    int client_connfd = conn->fd, server_connfd, objsize, stale_size, state, why, rc, get;
+    int peer, hit_gzip;
+    long long id = conn->trace, t; /* spans of a traced request (trace.c) */
+    rio_t rio_server;
+    origin_t *origin;
+    request_t *rq = Malloc(sizeof(request_t));
+    char *targethost = rq->targethost, *path = rq->path, *request_toserver = rq->request_toserver, 
+    	*server_port = rq->server_port, *request_method = rq->request_method, *url = rq->url, 
+    	*cache_key = rq->cache_key, *gzip_key = rq->gzip_key, *hit_key = rq->hit_key, 
+    	*names = rq->names, *keys[2], *objbuf = rq->objbuf;
+    reqhdrs_t *hdrs = &rq->hdrs;
+
+	/* set up the client-facing I/O buffer from rio package; extract the host/path/port requested by client */
+	t = TRACE_START(id);
+	rc = readparse_request(client_connfd, targethost, path, 
+		server_port, request_method, request_toserver, rio_client);
+	trace_span(id, "readparse_request", t, NULL);
+	if (rc != 0) {
+		if (rc == 400)
+			clienterror(client_connfd, "request", "400", "Bad Request", 
+				"The proxy could not parse this");
+		else if (rc == 501)
+			clienterror(client_connfd, "method", "501", "Not Implemented", 
+				"The proxy does not implement this");
+		ac->status = rc > 0 ? rc : 0;
+		goto done; /* move on to next request if unsuccessful */
+	}
+	if (!strcmp(request_method, "PRI")) { /* HTTP/2 by prior knowledge */
+		strcpy(ac->request, "PRI * HTTP/2.0");
+		h2_serve(client_connfd, rio_client, NULL, NULL, h2_stream, conn);
+		goto done;
+	}
+	t = TRACE_START(id);
+	rc = read_requesthdrs(rio_client, hdrs);
+	trace_span(id, "read_requesthdrs", t, NULL);
+	if (rc < 0) {
+		clienterror(client_connfd, "request body", "400", "Bad Request", 
+			"The proxy could not tell the length of this");
+		ac->status = 400;
+		goto done;
+	}
+	if (!strcmp(request_method, "CONNECT")) {
+		snprintf(ac->request, MAXLINE, "CONNECT %.2000s:%s", targethost, server_port);
+		open_tunnel(client_connfd, rio_client, targethost, server_port, ac);
+		goto done;
+	}
+	snprintf(ac->request, MAXLINE, "%s http://%.2000s:%s%.4000s", 
+		request_method, targethost, server_port, path);
+	if (!strcmp(hdrs->host, ""))
+		strcpy(hdrs->host, targethost);
+	if (hdrs->chunked) /* chunked framing is HTTP/1.1; the proxy closes after anyway */
+		snprintf(request_toserver, MAXLINE, "%.63s %.4096s HTTP/1.1\r\n", request_method, path);
+	get = !strcmp(request_method, "GET");
+	if (get && hdrs->h2c && hdrs->h2settings[0] && hdrs->length <= 0 && !hdrs->chunked) {
+		/* Upgrade: h2c; this request becomes stream 1; room for every
+		 * part whole, so the header block always keeps its end */
+		char *upgrade = rq->upgrade;
+
+		snprintf(upgrade, sizeof(rq->upgrade), "GET http://%s:%s%s HTTP/1.1\r\nHost: %s\r\n%s%s", 
+			targethost, server_port, path, hdrs->host, 
+			hdrs->gzip ? "Accept-Encoding: gzip\r\n" : "", hdrs->toserver);
+		h2_serve(client_connfd, rio_client, upgrade, hdrs->h2settings, h2_stream, conn);
+		ac->status = 101;
+		goto done;
+	}
+
+	/* fresh, or stale but revalidating in the background: answer from the cache;
+	 * a client that takes gzip gets the compressed variant if there is one;
+	 * the key is a hash of the URL in canonical form (cachekey.c); one
+	 * too long to hash whole is passed on uncached, like other methods */
+	t = TRACE_START(id);
+	if (cachekey_url(targethost, server_port, path, url) < 0)
+		get = 0;
+	cachekey_hash(url, cache_key);
+	variant_key(gzip_key, cache_key, 1);
+	state = CACHE_MISS;
+	hit_gzip = get && hdrs->gzip; /* other methods go to the origin, and are not cached */
+	if (hit_gzip)
+		state = lookup_variant(strcpy(hit_key, gzip_key), objbuf, &stale_size, hdrs, names);
+	if (get && state == CACHE_MISS) {
+		hit_gzip = 0;
+		state = lookup_variant(strcpy(hit_key, cache_key), objbuf, &stale_size, hdrs, names);
+	}
+	trace_span(id, "cache_lookup", t, state == CACHE_MISS ? "miss" : 
+		state == CACHE_STALE ? "stale" : "hit");
+	if (state == CACHE_FRESH || state == CACHE_REVALIDATE) {
+		printf("PROXY: Serving %s%s from cache%s.\n", url, hit_gzip ? " (gzip)" : "", 
+			state == CACHE_REVALIDATE ? " (stale, revalidating)" : "");
+		t = TRACE_START(id);
+		serve_cached(client_connfd, objbuf, stale_size, hdrs->range, ac);
+		trace_span(id, "serve_cached", t, NULL);
+		if (state == CACHE_REVALIDATE)
+			start_refresh(hit_key, cache_key, hit_gzip, url, targethost, server_port, 
+				hdrs, names, request_toserver);
+		goto done;
+	}
+
+	/* a miss here may be a hit at the sibling owning the key */
+	keys[0] = hdrs->gzip ? gzip_key : cache_key;
+	keys[1] = cache_key;
+	if (state == CACHE_MISS && get && (peer = peer_owner(cache_key)) >= 0) {
+		t = TRACE_START(id);
+		rc = lookup_peer(peer, keys, hdrs->gzip ? 2 : 1, objbuf, &stale_size, hdrs);
+		trace_span(id, "peer_lookup", t, rc < 0 ? "miss" : "hit");
+		if (rc >= 0) {
+			printf("PROXY: Serving %s from a peer.\n", url);
+			t = TRACE_START(id);
+			serve_cached(client_connfd, objbuf, stale_size, hdrs->range, ac);
+			trace_span(id, "serve_cached", t, NULL);
+			goto done;
+		}
+	}
+
+	/* one slow or failing origin may only tie up its own share of workers */
+	/* a stale copy is served at once rather than waiting for a slot */
+	if (!(origin = origin_acquire(targethost, server_port,
+		state == CACHE_STALE ? 0 : ORIGIN_CONNECT_MS, &why))) {
+		if (state == CACHE_STALE) { /* stale-if-error */
+			printf("PROXY: Origin unavailable, serving stale %s.\n", url);
+			serve_cached(client_connfd, objbuf, stale_size, hdrs->range, ac);
+			goto done;
+		}
+		clienterror(client_connfd, targethost, "503", "Service Unavailable", 
+			why == ORIGIN_BUSY ? "Too many requests in flight to" : "Failing fast for");
+		ac->status = 503;
+		goto done;
+	}
+
+	/* proxy performs a client role: connect to the server */
+	t = TRACE_START(id);
+	server_connfd = origin_connect(targethost, server_port);
+	trace_span(id, "origin_connect", t, server_connfd < 0 ? "failed" : NULL);
+	if (server_connfd < 0) {
+		origin_release(origin, 0);
+		if (state == CACHE_STALE) { /* stale-if-error */
+			printf("PROXY: Origin unreachable, serving stale %s.\n", url);
+			serve_cached(client_connfd, objbuf, stale_size, hdrs->range, ac);
+			goto done;
+		}
+		clienterror(client_connfd, targethost, "502", "Bad Gateway", "Could not connect to");
+		ac->status = 502;
+		goto done; /* move on to next request if unsuccessful */
+	}
+
+	/* send request, check and modify mandatory headers then send all headers to server;
+	 * stream any request body after them; set up server-facing I/O buffer; 
+	 * write server response to client;
+	 * a ranged request is passed on as is and streamed back uncached */
+	t = TRACE_START(id);
+	rc = send_request(server_connfd, request_toserver, hdrs);
+	trace_span(id, "send_request", t, NULL);
+	if (rc == 0) {
+		t = TRACE_START(id);
+		rc = send_body(rio_client, client_connfd, server_connfd, hdrs);
+		trace_span(id, "send_body", t, NULL);
+		if (rc == -1) {
+			close(server_connfd); /* the client failed or left mid-body; the origin is not to blame */
+			origin_release(origin, 1);
+			clienterror(client_connfd, "request body", "400", "Bad Request", 
+				"The proxy could not read all of this");
+			ac->status = 400;
+			goto done;
+		}
+		rc = 0; /* if the origin stopped reading, it may have answered already */
+	}
+	if (rio_client->rio_cnt == 0) /* the client is idle until the response */
+		rio_releaseb(rio_client);
+	if (rc < 0)
+		objsize = 0; /* as if the origin had not answered */
+	else {
+		t = TRACE_START(id);
+		objsize = forward_response(&rio_server, server_connfd, client_connfd, 
+			objbuf, state == CACHE_STALE, &hdrs->gzip, &ac->status, &ac->bytes);
+		trace_span(id, "forward_response", t, NULL);
+		rio_releaseb(&rio_server);
+	}
+	close(server_connfd);
+	origin_release(origin, ac->status > 0 && ac->status < 500);
+
+	if (objsize == -2 || (ac->status == 0 && state == CACHE_STALE)) { 
+		/* stale-if-error: objbuf still holds the stale copy */
+		printf("PROXY: Origin error, serving stale %s.\n", url);
+		serve_cached(client_connfd, objbuf, stale_size, hdrs->range, ac);
+	} else if (ac->status == 0) {
+		clienterror(client_connfd, targethost, "502", "Bad Gateway", "No response from");
+		ac->status = 502;
+	} else if (objsize > 0 && get) { /* hdrs->gzip as forward_response left it */
+		t = TRACE_START(id);
+		store_response(hdrs->gzip ? gzip_key : cache_key, objbuf, objsize, hdrs, 
+			peer_owner(cache_key));
+		trace_span(id, "store_response", t, NULL);
+	}
+ done:
+	Free(rq);
+}
+/* $end doit */
+
+/*
+ * h2_stream - serve one HTTP/2 stream, handed over by h2_serve as an
+ * HTTP/1 exchange on fd; arg is the client connection. Each stream is
+ * rate limited, charged and logged as a request of its own.
+ */
+/* $begin h2_stream */
+void h2_stream(int fd, void *arg)
+{
+    conn_t sc = *(conn_t *)arg;
+    access_t ac;
+    rio_t rio;
+    int retry;
+    long long t;
+
+    sc.fd = fd;
+    sc.trace = trace_sample();
+    strcpy(ac.request, "-");
+    ac.status = 0;
+    ac.bytes = 0;
+    if ((retry = client_admit(sc.client, &sc.cost))) {
+        admit_reject(fd, "429 Too Many Requests", retry);
+        ac.status = 429;
+    } else {
+        t = TRACE_START(sc.trace);
+        doit(&sc, &rio, &ac);
+        rio_releaseb(&rio);
+        close(fd);
+        trace_request(sc.trace, t, &ac);
+    }
+    client_charge(sc.client, ac.bytes);
+    accesslog_write((SA *) &sc.addr, sc.addrlen, &ac);
+}
+/* $end h2_stream */
+
+/*
+ * trace_request - record the span of a traced request as a whole,
+ * named after its request line and status, which names its track
+ */
+void trace_request(long long id, long long start_ns, access_t *ac)
+{
+    char detail[TRACE_DETAIL];
+
+    if (!id)
+        return;
+    snprintf(detail, TRACE_DETAIL, "%d %.80s", ac->status, ac->request);
+    trace_span(id, "request", start_ns, detail);
 }
-/* $end main */
 
 
 /*
  * readparse_request - read and parse requests received from client 
  * Expected requests are according to rfc1945. Scheme is http, 
  * version HTTP/1.0. 
+ * Returns 0 once a request is extracted, -1 if the client sent nothing
+ * (or could not be read), else the status to refuse the request with:
+ * 400 for a malformed request line or URL, 501 for methods but GET,
+ * POST, PUT, PATCH, DELETE and CONNECT. A CONNECT leaves path empty.
+ * With -2, the HTTP/2 preface line is returned as method "PRI".
  */
 /* $begin readparse_request */
 int readparse_request(int fd, char *targethost, char *path, char *port, char *request_method, char *request_toserver, rio_t *rp)
@@ -165,21 +831,35 @@ int readparse_request(int fd, char *targethost, char *path, char *port, char *re
 
     /* Read request line and headers */
     Rio_readinitb(rp, fd);
-    if (!Rio_readlineb_w(rp, buf, MAXLINE))  /* can't parse ampersand from cmdline; need \& */
-        return 0; /* nothing to read */
+    if (Rio_readlineb_w(rp, buf, MAXLINE) <= 0)  /* can't parse ampersand from cmdline; need \& */
+        return -1; /* nothing to read */
     printf("Buffer prior to sscanf:\n%s", buf);    
+    if (h2_enabled && !strcmp(buf, "PRI * HTTP/2.0\r\n")) {
+        strcpy(request_method, "PRI");
+        return 0;
+    }
 
-    sscanf(buf, "%s %s %s", method, uri, version);  
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3 || strncmp(version, "HTTP/", 5)) {
+        printf("PROXY: Malformed request line; rejected.\n");
+        return 400;
+    }
     printf("PROXY: Request of method [%s] received from client:\n%s", method, buf);    
-    if (/*strcasecmp(method, "GET") != 0*/ !strstr(method,"GET")) {   
-        printf("PROXY: Request of method [%s] not implemented; ignored.\n", method);    
-        return -1;
+    if (!strcmp(method, "CONNECT")) { /* tunnel to host:port */
+        if (parse_authority(uri, targethost, port) < 0)
+            return 400;
+        strcpy(request_method, method);
+        return 0;
+    }
+    if (strcmp(method, "GET") && strcmp(method, "POST") && strcmp(method, "PUT") && 
+        strcmp(method, "PATCH") && strcmp(method, "DELETE")) {   
+        printf("PROXY: Request of method [%s] not implemented; rejected.\n", method);    
+        return 501;
     }                                                   
-    parse_url(uri, targethost, path, port);
+    if (strlen(uri) > MAXLINE / 2 || parse_url(uri, targethost, path, port) < 0)
+        return 400;
     strcpy(request_method, method);
 
-    strcpy(request_toserver, ""); 
-	sprintf(request_toserver, "%s %s HTTP/1.0\r\n", request_method, path);
+    snprintf(request_toserver, MAXLINE, "%s %s HTTP/1.0\r\n", request_method, path);
 
     return 0; /* request extracted */
 }
@@ -189,138 +869,847 @@ int readparse_request(int fd, char *targethost, char *path, char *port, char *re
  * parse_url - parse URI into targethost and path
  * Expected URL format: 
  * http_URL       = "http:" "//" host [ ":" port ] [ abs_path ]       
+ * Returns 0, or -1 if the URL is not of that form, and then host and
+ * abs_path may hold parts of it.
  */
 /* $begin parse_url */
-void parse_url(char *url, char *host, char *abs_path, char *port) 
+int parse_url(char *url, char *host, char *abs_path, char *port) 
 {
-	/* authority may contain host:port ; suffix may contain path?query#fragment */
-    char scheme[10], authority[MAXLINE], suffix[MAXLINE];
-    char hostbuf[MAXLINE], portbuf[6];
+	/* authority may contain host:port ; suffix may contain path?query#fragment;
+	 * both are scanned straight into host and abs_path */
+    char scheme[16], *authority = host, *suffix = abs_path, *colon, *end;
+    long portnum;
 
 	/* extract fields from URL */ 
-    sscanf(url, "%[^:]%*[:/]%[^/]%s", scheme, authority, suffix); // printf("sc: %s| aut: %s | suf: %s\n", scheme, authority, suffix);
-
-    /* check if valid request */
-	if (!strstr(scheme, "http")) {
+    strcpy(suffix, "");
+    if (sscanf(url, "%15[^:]://%[^/]%s", scheme, authority, suffix) < 2 || 
+        strcasecmp(scheme, "http")) {
 		printf("PROXY: ERROR: no http prefix. \n");
-		exit(0);
-		return;
+		return -1;
 	}
 
 	/* extract port if specified; otherwise default TCP port=80 */
-    if (strchr(authority, ':') != NULL) {	
-	    sscanf(authority, "%[^:]:%s", hostbuf, portbuf);
-    	strcpy(host, hostbuf);
-		strcpy(port, portbuf);
-    } else {
-    	strcpy(host, authority);
+    if ((colon = strchr(authority, ':')) != NULL) {	
+    	*colon = '\0';
+    	portnum = strtol(colon + 1, &end, 10);
+    	if (end == colon + 1 || *end || portnum < 1 || portnum > 65535) {
+    		printf("PROXY: ERROR: bad port in %s. \n", url);
+    		return -1;
+    	}
+    	sprintf(port, "%ld", portnum);
+    } else
     	strcpy(port, "80");
-    }
+    if (authority[0] == '\0')
+    	return -1;
 
-    /* clear path, then formulate path */
-    strcat(abs_path, suffix); 
-    return;
+    /* formulate path; an empty one means the root */
+    if (!suffix[0])
+    	strcpy(abs_path, "/"); 
+    return 0;
 }
 /* $end parse_url */
 
 /*
- * send_request - sends request + proxy headers + client headers
- * RFC2616: ordering of headers only matters if multiple headers of same name
+ * parse_authority - parse the host:port target of a CONNECT
+ * The port is required; an IPv6 host comes in brackets.
+ * Returns 0, or -1 if the target is not of that form.
  */
-/* $begin send_request */
-void send_request(int server_connfd, char *request_toserver, char *targethost, rio_t *rio_client) 
+/* $begin parse_authority */
+int parse_authority(char *authority, char *host, char *port)
 {
-	char buf[MAXLINE], buf_client[MAXLINE], proxy_toserver[MAXLINE], client_toserver[MAXLINE];
-	printf("Request sent by proxy, to client:\n%s\n", request_toserver);
+    char *colon, *end;
+    long portnum;
+
+    if (!(colon = strrchr(authority, ':')) || colon == authority)
+    	return -1;
+    portnum = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end || portnum < 1 || portnum > 65535)
+    	return -1;
+    sprintf(port, "%ld", portnum);
+
+    if (authority[0] == '[' && colon[-1] == ']') /* [v6addr]:port */
+    	sprintf(host, "%.*s", (int)(colon - authority - 2), authority + 1);
+    else
+    	sprintf(host, "%.*s", (int)(colon - authority), authority);
+    return host[0] ? 0 : -1;
+}
+/* $end parse_authority */
+
+/*
+ * read_requesthdrs - read the client's request headers
+ * The Host header is kept apart (left empty if the client sent none);
+ * headers the proxy sets itself are dropped and the rest are collected,
+ * unaltered, in hdrs->toserver. Range is noted and passed on as well.
+ * The framing of a request body is noted: Content-Length is resent by
+ * send_request (and dropped when the body is chunked, which takes
+ * precedence); Expect is answered by the proxy and not passed on, and
+ * so is an Upgrade to h2c, which is noted with its HTTP2-Settings.
+ * Returns 0, or -1 if the length of the body cannot be told.
+ */
+/* $begin read_requesthdrs */
+int read_requesthdrs(rio_t *rio_client, reqhdrs_t *hdrs)
+{
+	char buf_client[MAXLINE], *client_toserver = hdrs->toserver, *end;
+	int bad = 0;
+
+    strcpy(hdrs->host, ""); strcpy(hdrs->range, ""); strcpy(client_toserver, "");
+    hdrs->gzip = 0;
+    hdrs->length = -1;
+    hdrs->chunked = 0;
+    hdrs->expect_continue = 0;
+    hdrs->h2c = 0;
+    strcpy(hdrs->h2settings, "");
 
     /* override client headers with proxy preference; overtake the rest */
-    do
-    {
-        Rio_readlineb_w(rio_client, buf_client, MAXLINE);
+    while (Rio_readlineb_w(rio_client, buf_client, MAXLINE) > 0 && strcmp(buf_client, "\r\n")) {
     	if (strstr(buf_client, "Host:")) {
-    		sscanf(buf_client, "Host: %s", targethost);
+    		sscanf(buf_client, "Host: %1023s", hdrs->host); /* room left for the other proxy headers */
+    	} else if (!strncasecmp(buf_client, "Accept-Encoding:", 16)) {
+    		hdrs->gzip = gzip_accepted(buf_client + 16); /* the proxy may compress for it */
+    	} else if (!strncasecmp(buf_client, "Content-Length:", 15)) {
+    		hdrs->length = strtol(buf_client + 15, &end, 10);
+    		if (end == buf_client + 15 || hdrs->length < 0)
+    			bad = 1;
+    	} else if (!strncasecmp(buf_client, "Expect:", 7)) {
+    		hdrs->expect_continue = strstr(buf_client, "100-continue") != NULL;
+    	} else if (!strncasecmp(buf_client, "Upgrade:", 8) && strstr(buf_client, "h2c")) {
+    		hdrs->h2c = h2_enabled;
+    	} else if (!strncasecmp(buf_client, "HTTP2-Settings:", 15)) {
+    		sscanf(buf_client + 15, " %1023[^\r\n]", hdrs->h2settings);
     	} else if (strstr(buf_client, "Connection:") || strstr(buf_client, "Proxy-") || 
     		strstr(buf_client, "Accept:") || strstr(buf_client, "Accept-En")) {
     		continue;
     	} else { /* build the content to be sent to server from client unaltered */
-    		sprintf(client_toserver, "%s%s", client_toserver, buf_client);
+    		if (!strncasecmp(buf_client, "Range:", 6))
+    			sscanf(buf_client + 6, " %[^\r\n]", hdrs->range);
+    		if (!strncasecmp(buf_client, "Transfer-Encoding:", 18)) {
+    			/* chunked must come last; any other coding leaves the length unknown */
+    			end = buf_client + strcspn(buf_client, "\r\n");
+    			hdrs->chunked = end - buf_client >= 25 && !strncasecmp(end - 7, "chunked", 7) &&
+    				strchr(" ,:", end[-8]);
+    			bad |= !hdrs->chunked;
+    		}
+    		if (strlen(client_toserver) + strlen(buf_client) < MAXLINE)
+    			strcat(client_toserver, buf_client);
     	}
+    }
+    strcat(client_toserver, "\r\n"); /* end of headers */
+    return bad ? -1 : 0;
+}
+/* $end read_requesthdrs */
 
-        /* potential intercession for non-GET requests would go here */
+/*
+ * send_request - sends request + proxy headers + client headers
+ * RFC2616: ordering of headers only matters if multiple headers of same name
+ * The origin is asked for gzip only for a client that takes it, so
+ * that what is cached for the others is never encoded.
+ * Returns 0, or -1 if the origin could not be written to.
+ */
+/* $begin send_request */
+int send_request(int server_connfd, char *request_toserver, reqhdrs_t *hdrs) 
+{
+	char proxy_toserver[MAXLINE], *client_toserver = hdrs->toserver;
+	printf("Request sent by proxy, to client:\n%s\n", request_toserver);
 
-    } while (strcmp(buf_client, "\r\n")); 
-    
     /* build proxy headers */
-    sprintf(proxy_toserver, "Host: %s\r\n", targethost);
-    sprintf(proxy_toserver, "%sUser-Agent: %s\r\n", proxy_toserver, user_agent_hdr_alt); 
-    sprintf(proxy_toserver, "%sAccept: %s\r\n", proxy_toserver, accept_header); 
-    sprintf(proxy_toserver, "%sAccept-Encoding: %s\r\n", proxy_toserver, accept_encoding_header); 
-    sprintf(proxy_toserver, "%sConnection: close\r\n", proxy_toserver); 
-    sprintf(proxy_toserver, "%sProxy-Connection: close\r\n\r\n", proxy_toserver); /* terminate with \r\n\r\n */
+    /* a host is at most MAXLINE / 2, from the request line or Host: */
+    snprintf(proxy_toserver, MAXLINE, "Host: %.*s\r\n", MAXLINE / 2, hdrs->host);
+    sprintf(proxy_toserver + strlen(proxy_toserver), "User-Agent: %s\r\n", user_agent_hdr_alt); 
+    sprintf(proxy_toserver + strlen(proxy_toserver), "Accept: %s\r\n", accept_header); 
+    sprintf(proxy_toserver + strlen(proxy_toserver), "Accept-Encoding: %s\r\n", 
+    	hdrs->gzip ? accept_encoding_header : "identity"); 
+    if (hdrs->length >= 0 && !hdrs->chunked)
+    	sprintf(proxy_toserver + strlen(proxy_toserver), "Content-Length: %ld\r\n", hdrs->length); 
+    strcat(proxy_toserver, "Connection: close\r\n"); 
+    strcat(proxy_toserver, "Proxy-Connection: close\r\n"); /* client headers end with \r\n */
     
     /* for debugging */
     printf("Request headers built by proxy, to server:\n%s", proxy_toserver);
     printf("Request headers forwarded from client, to server:\n%sEnd of headers.\n\n", client_toserver);
 
-    /* send mandatory headers by proxy, then forward the rest from client. */   
-    Rio_writen_w(server_connfd, request_toserver, strlen(request_toserver)); /* request */
-    Rio_writen_w(server_connfd, proxy_toserver, strlen(proxy_toserver));
-    Rio_writen_w(server_connfd, client_toserver, strlen(client_toserver));
+    /* send mandatory headers by proxy, then forward the rest from client, in one segment */   
+    sockopt_cork(server_connfd, 1);
+    if (Rio_writen_w(server_connfd, request_toserver, strlen(request_toserver)) < 0 || /* request */
+        Rio_writen_w(server_connfd, proxy_toserver, strlen(proxy_toserver)) < 0 ||
+        Rio_writen_w(server_connfd, client_toserver, strlen(client_toserver)) < 0) {
+        sockopt_cork(server_connfd, 0); /* never leave a pooled origin corked */
+        return -1;
+    }
+    sockopt_cork(server_connfd, 0);
 
-    return;
+    return 0;
 }
 /* $end send_request */
 
+/*
+ * send_body - stream the request body, if any, from client to origin
+ * A Content-Length body is copied byte for byte; a chunked one is
+ * passed on chunk by chunk, framing and trailers included, with the
+ * sizes read to find its end. Either way only one pooled buffer's
+ * worth is held at a time, whatever the size of the upload. A client
+ * that asked for 100-continue is told to go ahead only now that the
+ * origin is connected, so nothing is uploaded toward an origin that
+ * cannot take it.
+ * Returns 0, -1 if the client failed (or framed the body wrongly),
+ * -2 if the origin stopped reading.
+ */
+/* $begin send_body */
+int send_body(rio_t *rio_client, int client_connfd, int server_connfd, reqhdrs_t *hdrs)
+{
+	static char *go_ahead = "HTTP/1.1 100 Continue\r\n\r\n";
+	char line[MAXLINE], *end, *buf;
+	size_t bufsize = BUFPOOL_MAX / 4;
+	long size;
+	int rc = 0;
+
+    if (!hdrs->chunked && hdrs->length <= 0)
+    	return 0; /* no body */
+    if (hdrs->expect_continue && Rio_writen_w(client_connfd, go_ahead, strlen(go_ahead)) < 0)
+    	return -1;
+
+    buf = bufpool_get(bufsize);
+    if (!hdrs->chunked)
+    	rc = copy_body(rio_client, server_connfd, hdrs->length, buf, bufsize);
+    else while (rc == 0) {
+    	/* chunk-size [; extensions] CRLF, then the data and its CRLF */
+    	if (Rio_readlineb_w(rio_client, line, MAXLINE) <= 0) {
+    		rc = -1;
+    		break;
+    	}
+    	size = strtol(line, &end, 16);
+    	if (end == line || size < 0) {
+    		rc = -1;
+    		break;
+    	}
+    	if (Rio_writen_w(server_connfd, line, strlen(line)) < 0) {
+    		rc = -2;
+    		break;
+    	}
+    	if (size > 0) {
+    		rc = copy_body(rio_client, server_connfd, size + 2, buf, bufsize);
+    		continue;
+    	}
+
+    	/* last chunk: trailers up to the blank line that ends the body */
+    	while (rc == 0 && strcmp(line, "\r\n")) {
+    		if (Rio_readlineb_w(rio_client, line, MAXLINE) <= 0)
+    			rc = -1;
+    		else if (Rio_writen_w(server_connfd, line, strlen(line)) < 0)
+    			rc = -2;
+    	}
+    	break;
+    }
+    bufpool_put(buf, bufsize);
+    return rc;
+}
+/* $end send_body */
+
+/*
+ * copy_body - copy n bytes from client to origin through buf
+ * Returns 0, -1 if the client failed, -2 if the origin did.
+ */
+int copy_body(rio_t *rio_client, int server_connfd, long n, char *buf, size_t bufsize)
+{
+    ssize_t got;
+
+    while (n > 0) {
+    	if ((got = Rio_readsome_w(rio_client, buf, n < bufsize ? n : bufsize)) <= 0)
+    		return -1; /* client left or timed out before the end of the body */
+    	if (Rio_writen_w(server_connfd, buf, got) < 0)
+    		return -2;
+    	n -= got;
+    }
+    return 0;
+}
+
 /*
  * forward_response - forward server's response to client
+ * A copy of the response is kept in objbuf (of MAX_OBJECT_SIZE bytes)
+ * for the cache. Returns the response size, or -1 if it did not fit
+ * or did not arrive whole (or the client went away).
+ * A negative client_connfd only collects the response. With stale_ok
+ * set, a 5xx response is not forwarded at all and -2 is returned
+ * instead, leaving objbuf untouched for the caller's stale copy.
+ * The origin's status code is left in *status (0 if none arrived),
+ * the number of bytes forwarded to the client in *sent.
+ * Past the status line the body is moved with reads straight into a
+ * pooled buffer (bufpool.c) that starts at BUFPOOL_MIN and grows 4x
+ * each time a read fills it, up to BUFPOOL_MAX: small responses stay
+ * small, bulk transfers take a few large reads instead of many 8 KB ones.
+ * If *gzip is set the client accepts gzip, and an eligible response
+ * (gzip.c) is compressed on the way; *gzip is left set only if the
+ * response went out encoded, compressed here or by the origin, and
+ * objbuf then holds the encoded response. If the headers were too long
+ * to tell, *gzip is left -1 and -1 returned: the response went out
+ * whole, but is not to be cached under either key.
  */
 /* $begin forward_response */
-void forward_response(rio_t *rio_server, rio_t *rio_client, int server_connfd, int client_connfd)
+int forward_response(rio_t *rio_server, int server_connfd, int client_connfd, 
+	char *objbuf, int stale_ok, int *gzip, int *status, long *sent)
 {
-	int rio_cnt;
-	char server_buf[MAXLINE];
+	ssize_t n, m = 0, relayed;
+	int objsize = 0, compress = 0, encoded = 0, ended = 0;
+	size_t bufsize = BUFPOOL_MIN;
+	char *buf = bufpool_get(bufsize), *head, *hdrs, *out;
+	gzip_t gz;
 
     /* set up rio buffer to read server responses */
     Rio_readinitb(rio_server, server_connfd); 
-	debug_status(rio_server, client_connfd); 
+    *status = 0;
+    *sent = 0;
 
-	/* write server response to client */
-    while ( (rio_cnt = Rio_readnb_w(rio_server, server_buf, MAXLINE)) != 0 ) {
-    	Rio_writen_w(client_connfd, server_buf, rio_cnt); /* write text to client from server buffer */
+    /* status code from server */
+    if ((n = Rio_readlineb_w(rio_server, buf, bufsize)) > 0) {
+    	debug_status(buf, n);
+    	sscanf(buf, "HTTP/%*d.%*d %d", status);
+    	if (stale_ok && *status >= 500) {
+    		bufpool_put(buf, bufsize);
+    		return -2;
+    	}
+    }
 
-    	/* determine end of headers, extract content type/length, service non-GET requests */
-    	// if (!(strcmp(server_buf, "\r\n")) ) {}        	}
+	/* write server response to client; reads grow with the response;
+	 * corked, so the status line does not leave in a segment of its own */
+    if (client_connfd >= 0)
+    	sockopt_cork(client_connfd, 1);
+
+	/* the client takes gzip: read the headers whole to see whether to compress,
+	 * and whether the origin did; headers that do not end within MAXBUF go
+	 * out as they are, and the response is not cached, encoded or not */
+    if (n > 0 && *gzip) {
+    	head = bufpool_get(2 * MAXBUF); /* hdrs is its second half */
+    	hdrs = head + MAXBUF;
+    	memcpy(head, buf, n + 1);
+    	while (n < MAXBUF - 1 && (m = Rio_readlineb_w(rio_server, head + n, MAXBUF - n)) > 0) {
+    		n += m;
+    		if (m == 2 && head[n - 3] == '\n' && !strcmp(head + n - 2, "\r\n")) {
+    			compress = gzip_eligible(head, n, *status);
+    			encoded = gzip_encoded(head, n);
+    			ended = 1;
+    			break;
+    		}
+    	}
+    	out = head;
+    	if (m < 0)
+    		n = -1;
+    	else if (compress && (m = gzip_headers(head, n, hdrs, MAXBUF)) > 0 && gzip_begin(&gz) == 0) {
+    		printf("PROXY: Compressing response at level %d.\n", gzip_level);
+    		out = hdrs;
+    		n = m;
+    	} else
+    		compress = 0;
+    	if (!ended)
+    		objsize = -1; /* pass_on keeps no copy */
+    	if (n > 0 && pass_on(client_connfd, out, n, objbuf, &objsize, sent) < 0)
+    		n = -1;
+    	else if (n > 0)
+    		n = Rio_readsome_w(rio_server, buf, bufsize); /* on to the body */
+    	bufpool_put(head, 2 * MAXBUF);
     }
+    *gzip = ended || !*gzip ? compress || encoded : -1;
 
-    return;
+    for ( ; n > 0; n = Rio_readsome_w(rio_server, buf, bufsize)) {
+    	if (compress) { /* the body goes through zlib */
+    		if ((m = gzip_step(&gz, buf, n, 0)) < 0 ||
+    			pass_on(client_connfd, gz.out, m, objbuf, &objsize, sent) < 0) {
+    			n = -1;
+    			break;
+    		}
+    	} else if (pass_on(client_connfd, buf, n, objbuf, &objsize, sent) < 0) {
+    		n = -1; /* client went away */
+    		break;
+    	}
+
+    	/* too big to cache: flush what rio holds and let the kernel move the rest */
+    	if (objsize < 0 && uring_enabled && client_connfd >= 0 && !compress && !coro_self()) {
+    		if (Rio_writen_w(client_connfd, rio_server->rio_bufptr, rio_server->rio_cnt) < 0) {
+    			n = -1;
+    			break;
+    		}
+    		*sent += rio_server->rio_cnt;
+    		rio_server->rio_cnt = 0;
+    		if ((relayed = uring_relay(server_connfd, client_connfd)) > 0)
+    			*sent += relayed;
+    		break;
+    	}
+
+    	/* a read that filled the buffer means more is already waiting: read bigger */
+    	if (n == bufsize && bufsize < BUFPOOL_MAX) {
+    		bufpool_put(buf, bufsize);
+    		bufsize *= 4;
+    		buf = bufpool_get(bufsize);
+    	}
+    }
+    if (compress) { /* the origin is done: so is the gzip stream */
+    	if (n == 0 && ((n = gzip_step(&gz, NULL, 0, 1)) < 0 ||
+    		pass_on(client_connfd, gz.out, n, objbuf, &objsize, sent) < 0))
+    		n = -1;
+    	gzip_end(&gz);
+    }
+    bufpool_put(buf, bufsize);
+    if (client_connfd >= 0)
+    	sockopt_cork(client_connfd, 0);
+    if (n < 0) /* origin failed or timed out midway, or the client left: not a whole object */
+    	return -1;
+
+    return objsize;
 }
 /* $end forward_response */
 
+/*
+ * pass_on - send n bytes of response to the client, if there is one,
+ * keeping a copy in objbuf while the object still fits in the cache
+ * (*objsize becomes -1 once it does not). Returns -1 if the client
+ * could not be written to.
+ */
+int pass_on(int client_connfd, char *buf, ssize_t n, char *objbuf, int *objsize, long *sent)
+{
+    if (client_connfd >= 0) {
+    	if (Rio_writen_w(client_connfd, buf, n) < 0) /* write text to client from server buffer */
+    		return -1;
+    	*sent += n;
+    }
 
-/* debugging helpers */
+    if (*objsize >= 0 && *objsize + n <= MAX_OBJECT_SIZE) {
+    	memcpy(objbuf + *objsize, buf, n);
+    	*objsize += n;
+    } else
+    	*objsize = -1;
+    return 0;
+}
 
-void debug_status(rio_t *rp, int client_connfd)
+/*
+ * serve_cached - answer a request from a complete cached response
+ * A single satisfiable byte range is sliced out of the cached body and
+ * sent as 206 Partial Content; an unsatisfiable one gets 416. Anything
+ * else (no Range, several ranges, bad syntax) gets the whole object.
+ * The status and bytes sent are noted in *ac.
+ */
+/* $begin serve_cached */
+void serve_cached(int client_connfd, char *obj, int size, char *range, access_t *ac)
 {
-	char server_buf[MAXLINE];
-	int rio_cnt;
+    char hdr[MAXBUF], *body, *p, *eol;
+    int total, first, last, rc;
 
-    if ( (rio_cnt = Rio_readnb_w(rp, server_buf, MAXLINE)) != 0 ) { /* status code from server */
-        printf("Server response status (first response header) has read %d bytes: \n", rio_cnt);
-        printf("%s\r\n",server_buf);
-        Rio_writen_w(client_connfd, server_buf, rio_cnt);
-	}
+    body = strstr(obj, "\r\n\r\n"); /* headers of cached objects are complete */
+    if (!strcmp(range, "") || !body || body + 4 > obj + size) {
+    	Rio_writen_w(client_connfd, obj, size);
+    	ac->status = 200; /* only 200 responses are cached */
+    	ac->bytes = size;
+    	return;
+    }
+    body += 4;
+    total = obj + size - body;
+
+    if ((rc = parse_range(range, total, &first, &last)) < 0) {
+    	Rio_writen_w(client_connfd, obj, size);
+    	ac->status = 200; /* only 200 responses are cached */
+    	ac->bytes = size;
+    	return;
+    }
+    if (rc == 0) {
+    	sprintf(hdr, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+    		"Content-Range: bytes */%d\r\nContent-Length: 0\r\n\r\n", total);
+    	Rio_writen_w(client_connfd, hdr, strlen(hdr));
+    	ac->status = 416;
+    	ac->bytes = strlen(hdr);
+    	return;
+    }
+
+    /* keep the origin's headers, except the length, which now changes */
+    strcpy(hdr, "HTTP/1.0 206 Partial Content\r\n");
+    for (p = strstr(obj, "\r\n") + 2; p < body - 2; p = eol + 2) {
+    	eol = strstr(p, "\r\n");
+    	if (strncasecmp(p, "Content-Length:", 15) && 
+    		strlen(hdr) + (eol + 2 - p) + 128 < MAXBUF)
+    		strncat(hdr, p, eol + 2 - p);
+    }
+    sprintf(hdr + strlen(hdr), "Content-Range: bytes %d-%d/%d\r\n"
+    	"Content-Length: %d\r\n\r\n", first, last, total, last - first + 1);
+
+    printf("PROXY: Serving bytes %d-%d/%d from cache.\n", first, last, total);
+    sockopt_cork(client_connfd, 1);
+    Rio_writen_w(client_connfd, hdr, strlen(hdr));
+    Rio_writen_w(client_connfd, body + first, last - first + 1);
+    sockopt_cork(client_connfd, 0);
+    ac->status = 206;
+    ac->bytes = strlen(hdr) + last - first + 1;
+}
+/* $end serve_cached */
+
+/*
+ * open_tunnel - answer a CONNECT: connect to host:port, say so, and
+ * hand both connections to the relay thread (tunnel.c)
+ * The access log gets the CONNECT once the tunnel is established; the
+ * bytes it carries are not counted.
+ */
+/* $begin open_tunnel */
+void open_tunnel(int client_connfd, rio_t *rio_client, char *host, char *port, access_t *ac)
+{
+    static char *established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    int server_connfd, why, tunnel_fd;
+    origin_t *origin;
+
+    /* the breaker still protects a failing target; open tunnels hold no slot */
+    if (!(origin = origin_acquire(host, port, ORIGIN_CONNECT_MS, &why))) {
+    	clienterror(client_connfd, host, "503", "Service Unavailable", 
+    		why == ORIGIN_BUSY ? "Too many requests in flight to" : "Failing fast for");
+    	ac->status = 503;
+    	return;
+    }
+    server_connfd = origin_connect(host, port);
+    origin_release(origin, server_connfd >= 0);
+    if (server_connfd < 0) {
+    	clienterror(client_connfd, host, "502", "Bad Gateway", "Could not connect to");
+    	ac->status = 502;
+    	return;
+    }
+
+    /* anything the client sent ahead of our answer is already in rio's buffer */
+    if (Rio_writen_w(client_connfd, established, strlen(established)) < 0 ||
+    	Rio_writen_w(server_connfd, rio_client->rio_bufptr, rio_client->rio_cnt) < 0) {
+    	close(server_connfd);
+    	return;
+    }
+    ac->status = 200;
+    ac->bytes = strlen(established);
+
+    /* the worker closes its own descriptor for the client when it is done */
+    if ((tunnel_fd = dup(client_connfd)) < 0 || tunnel_add(tunnel_fd, server_connfd) < 0) {
+    	printf("PROXY: Could not open a tunnel to %s:%s.\n", host, port);
+    	if (tunnel_fd >= 0)
+    		close(tunnel_fd);
+    	close(server_connfd);
+    	return;
+    }
+    printf("PROXY: Tunnel to %s:%s open.\n", host, port);
+}
+/* $end open_tunnel */
+
+/*
+ * parse_range - resolve a Range header against a body of total bytes
+ * Accepts one range: "bytes=first-last", "bytes=first-" or "bytes=-suffix".
+ * Returns 1 with first/last set if satisfiable, 0 if not satisfiable,
+ * -1 if the header should be ignored.
+ */
+/* $begin parse_range */
+int parse_range(char *range, int total, int *first, int *last)
+{
+    char *p, *end;
+    long a, b;
+
+    if (strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+    	return -1;
+    p = range + 6;
+
+    if (*p == '-') { /* suffix: the final b bytes */
+    	b = strtol(p + 1, &end, 10);
+    	if (end == p + 1 || *end)
+    		return -1;
+    	if (b == 0)
+    		return 0;
+    	*first = b >= total ? 0 : total - b;
+    	*last = total - 1;
+    	return total > 0;
+    }
+
+    a = strtol(p, &end, 10);
+    if (end == p || *end != '-')
+    	return -1;
+    p = end + 1;
+    if (*p == '\0')
+    	b = total - 1;
+    else {
+    	b = strtol(p, &end, 10);
+    	if (*end || b < a)
+    		return -1;
+    }
+    if (a >= total)
+    	return 0;
+    *first = a;
+    *last = b >= total ? total - 1 : b;
+    return 1;
+}
+/* $end parse_range */
 
+
+/*
+ * start_refresh - refetch a stale cached object on a detached thread,
+ * unless a refresh of the same object is already under way
+ * claim is the key the copy was found under; key is that of the
+ * identity variant, and gzip says the compressed one is stale. A copy
+ * that varies is refetched with the client's values of the headers in
+ * names, so that it comes back under the same key.
+ */
+/* $begin start_refresh */
+void start_refresh(char *claim, char *key, int gzip, char *url, char *targethost, char *port, 
+	reqhdrs_t *hdrs, char *names, char *request_toserver)
+{
+    pthread_t tid;
+    refresh_t *rf;
+    char *name, *save, value[MAXLINE], list[MAXLINE], *toserver;
+
+    if (!cache_claim_refresh(claim))
+        return;
+
+    rf = Malloc(sizeof(refresh_t));
+    strcpy(rf->key, key);
+    strcpy(rf->claim, claim);
+    strcpy(rf->url, url);
+    rf->gzip = gzip;
+    strcpy(rf->targethost, targethost);
+    strcpy(rf->port, port);
+    strcpy(rf->hdrs.host, hdrs->host);
+    strcpy(rf->hdrs.range, "");
+    rf->hdrs.gzip = gzip;
+    rf->hdrs.length = -1;
+    rf->hdrs.chunked = 0;
+    toserver = rf->hdrs.toserver;
+    strcpy(toserver, "");
+    strcpy(list, names);
+    for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+        if (strcmp(name, "host") && strcmp(name, "user-agent") && strcmp(name, "accept") &&
+            sent_header(hdrs, name, value))
+            snprintf(toserver + strlen(toserver), MAXLINE - 2 - strlen(toserver), "%s: %s\r\n", name, value);
+    strcat(toserver, "\r\n"); /* no other client headers to pass on */
+    strcpy(rf->request_toserver, request_toserver);
+    if (pthread_create(&tid, NULL, refresh_thread, rf) != 0) { /* try again next time */
+        cache_release_refresh(claim);
+        Free(rf);
+    }
+}
+/* $end start_refresh */
+
+/*
+ * variant_key - the cache key of the gzip (or identity) variant of base
+ */
+void variant_key(char *key, char *base, int gzip)
+{
+    snprintf(key, MAXLINE, gzip ? "%.8000s gzip" : "%.8000s", base);
+}
+
+/*
+ * lookup_variant - cache_lookup of key, and if what is cached there is
+ * a Vary marker, of the key of the variant hdrs selects, left in key
+ * The names the marker lists are left in names, empty if none.
+ */
+/* $begin lookup_variant */
+int lookup_variant(char *key, char *objbuf, int *size, reqhdrs_t *hdrs, char *names)
+{
+    int state = cache_lookup(key, objbuf, size);
+
+    strcpy(names, "");
+    if (state == CACHE_MISS || !cachekey_varies(objbuf, *size, names))
+        return state;
+    vary_key(key, key, names, hdrs);
+    return cache_lookup(key, objbuf, size);
 }
+/* $end lookup_variant */
 
+/*
+ * lookup_peer - peer_lookup, then if the sibling had a Vary marker,
+ * peer_lookup of the variant hdrs selects
+ * Returns the index of the key found, or -1.
+ */
+int lookup_peer(int peer, char **keys, int nkeys, char *objbuf, int *size, reqhdrs_t *hdrs)
+{
+    char names[MAXLINE], key[CACHEKEY_LEN + 1], *vkey = key;
+    int i;
+
+    if ((i = peer_lookup(peer, keys, nkeys, objbuf, size)) < 0 ||
+        !cachekey_varies(objbuf, *size, names))
+        return i;
+    vary_key(key, keys[i], names, hdrs);
+    return peer_lookup(peer, &vkey, 1, objbuf, size) < 0 ? -1 : i;
+}
+
+/*
+ * store_response - cache a response fetched for hdrs under key, or hand
+ * it to peer if that is not -1; one that varies goes under the key of
+ * its variant, with a marker under key. Vary: * is not cached.
+ */
+/* $begin store_response */
+void store_response(char *key, char *obj, int size, reqhdrs_t *hdrs, int peer)
+{
+    cache_policy_t policy;
+    char names[MAXLINE], vkey[CACHEKEY_LEN + 1], marker[MAXBUF];
+    int n, msize = 0;
+
+    cache_parse_policy(obj, size, &policy);
+    if (!policy.cacheable || (n = cachekey_vary(obj, size, names)) < 0 ||
+        (n > 0 && (msize = cachekey_marker(obj, size, names, marker)) < 0))
+        return;
+    if (n > 0) {
+        if (peer >= 0)
+            peer_store(peer, key, marker, msize);
+        else
+            cache_insert(key, marker, msize, &policy);
+        vary_key(vkey, key, names, hdrs);
+        key = vkey;
+    }
+    if (peer >= 0)
+        peer_store(peer, key, obj, size); /* the owner keeps it */
+    else
+        cache_insert(key, obj, size, &policy);
+}
+/* $end store_response */
+
+/*
+ * vary_key - the cache key, under base, of the variant selected by the
+ * values hdrs gives the origin for the headers in names
+ */
+/* $begin vary_key */
+void vary_key(char *key, char *base, char *names, reqhdrs_t *hdrs)
+{
+    char *buf = bufpool_get(2 * MAXLINE), list[MAXLINE], value[MAXLINE], *name, *save;
+    int used;
+
+    used = snprintf(buf, 2 * MAXLINE, "%s", base);
+    strcpy(list, names);
+    for (name = strtok_r(list, ",", &save); name && used < 2 * MAXLINE; name = strtok_r(NULL, ",", &save))
+        used += snprintf(buf + used, 2 * MAXLINE - used, sent_header(hdrs, name, value) ? 
+            "\n%s: %s" : "\n%s", name, value); /* absent differs from empty */
+    cachekey_hash(buf, key);
+    bufpool_put(buf, 2 * MAXLINE);
+}
+/* $end vary_key */
+
+/*
+ * sent_header - the value send_request gives the origin for request
+ * header name (lowercase), in value with blanks squeezed; a header
+ * sent more than once has its values joined by commas
+ * Returns 0 if the header is not sent at all.
+ */
+/* $begin sent_header */
+int sent_header(reqhdrs_t *hdrs, char *name, char *value)
+{
+    char *p, *eol, *v, *start, *o = value;
+    int len = strlen(name), found = 1;
+
+    if (!strcmp(name, "host"))
+        strcpy(value, hdrs->host);
+    else if (!strcmp(name, "user-agent"))
+        strcpy(value, user_agent_hdr_alt);
+    else if (!strcmp(name, "accept"))
+        strcpy(value, accept_header);
+    else {
+        strcpy(value, "");
+        found = 0;
+    }
+    o += strlen(value);
+    for (p = hdrs->toserver; (eol = strstr(p, "\r\n")) != NULL && eol > p; p = eol + 2) {
+        if (strncasecmp(p, name, len) || p[len] != ':')
+            continue;
+        if (found && o < value + MAXLINE - 1)
+            *o++ = ',';
+        found = 1;
+        for (start = o, v = p + len + 1; v < eol && o < value + MAXLINE - 1; v++)
+            if (!isspace((unsigned char)*v))
+                *o++ = *v;
+            else if (o > start && o[-1] != ' ')
+                *o++ = ' ';
+        while (o > start && o[-1] == ' ')
+            o--;
+        *o = '\0';
+    }
+    return found;
+}
+/* $end sent_header */
+
+/*
+ * refresh_thread - fetch a fresh copy from the origin into the cache
+ * Failures leave the stale copy in place (stale-if-error).
+ */
+/* $begin refresh_thread */
+void *refresh_thread(void *vargp)
+{
+    refresh_t *rf = vargp;
+    int server_connfd, objsize, status, why, gzip = rf->gzip;
+    long sent;
+    char key[MAXLINE];
+    rio_t rio_server;
+    origin_t *origin;
+    char *objbuf = Malloc(MAX_OBJECT_SIZE);
+
+    Pthread_detach(pthread_self());
+
+    if (!(origin = origin_acquire(rf->targethost, rf->port, 0, &why)))
+        server_connfd = -1; /* origin busy or down: keep serving stale */
+    else if ((server_connfd = origin_connect(rf->targethost, rf->port)) < 0)
+        origin_release(origin, 0);
+    if (server_connfd >= 0) {
+        if (send_request(server_connfd, rf->request_toserver, &rf->hdrs) < 0)
+            objsize = status = 0;
+        else {
+            objsize = forward_response(&rio_server, server_connfd, -1, objbuf, 0, 
+            	&gzip, &status, &sent);
+            rio_releaseb(&rio_server);
+        }
+        close(server_connfd);
+        origin_release(origin, status > 0 && status < 500);
+
+        if (objsize > 0) {
+            variant_key(key, rf->key, gzip);
+            store_response(key, objbuf, objsize, &rf->hdrs, -1);
+        }
+    }
+    printf("PROXY: Background refresh of %s done.\n", rf->url);
+
+    cache_release_refresh(rf->claim);
+    Free(objbuf);
+    Free(rf);
+    return NULL;
+}
+/* $end refresh_thread */
+
+/*
+ * clienterror - returns an error message to the client
+ */
+/* $begin clienterror */
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+{
+    char buf[MAXLINE], body[MAXBUF];
+
+    /* Build the HTTP response body */
+    snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+        "<body bgcolor=""ffffff"">\r\n%s: %s\r\n"
+        "<p>%s %.4000s\r\n<hr><em>The proxy</em>\r\n", 
+        errnum, shortmsg, longmsg, cause);
+
+    /* Print the HTTP response */
+    sprintf(buf, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+        "Content-length: %d\r\nConnection: close\r\n\r\n", 
+        errnum, shortmsg, (int)strlen(body));
+    sockopt_cork(fd, 1);
+    Rio_writen_w(fd, buf, strlen(buf));
+    Rio_writen_w(fd, body, strlen(body));
+    sockopt_cork(fd, 0);
+}
+/* $end clienterror */
+
+
+/* debugging helpers */
+
+void debug_status(char *buf, int rio_cnt)
+{
+    printf("Server response status (first response header) has read %d bytes: \n", rio_cnt);
+    printf("%s\r\n", buf);
+}
+
+/*
+ * identify_client - print the client's numeric address and port
+ * No reverse DNS here: this runs on the accept path, before a byte of
+ * the request is read. Host names, if wanted, go to the access log.
+ */
 void identify_client(const struct sockaddr *sa, socklen_t clientlen) 
 {
-	char hostname[MAXLINE], port[8];
+	char hostname[NI_MAXHOST], port[NI_MAXSERV];
 
-    Getnameinfo(sa, clientlen, hostname, MAXLINE, 
-            port, MAXLINE, 0);
+    if (getnameinfo(sa, clientlen, hostname, sizeof(hostname), 
+            port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        return;
     printf("PROXY: Accepted connection from client (%s, %s)\n", hostname, port);
 
     return;
 }
 
-
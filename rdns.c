@@ -0,0 +1,124 @@
+/*
+ * rdns.c - asynchronous, TTL-cached reverse DNS for the access log
+ *
+ * A PTR lookup can take seconds, and the resolver may fail outright,
+ * so no caller ever waits for one. rdns_name answers from a small
+ * direct-mapped cache; on a miss it queues the address for one of
+ * RDNS_THREADS resolver threads and returns the numeric address for
+ * now. Later lines for the same client then carry its name, until
+ * the entry expires after RDNS_TTL seconds (RDNS_NEG_TTL for lookups
+ * that failed). When the queue is full the lookup is simply dropped.
+ */
+/* $begin rdns.c */
+#include "csapp.h"
+#include "rdns.h"
+
+typedef struct {
+    char addr[NI_MAXHOST];    /* numeric address, "" if unused */
+    char name[NI_MAXHOST];    /* resolved name */
+    time_t expires;
+    int pending;              /* queued or being resolved */
+} rdns_entry_t;
+
+typedef struct {
+    struct sockaddr_storage sa;
+    socklen_t salen;
+} rdns_req_t;
+
+static rdns_entry_t cache[RDNS_SLOTS];
+static rdns_req_t queue[RDNS_QUEUE];
+static int qhead, qcount;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+
+static void *resolver(void *vargp);
+static rdns_entry_t *slot_of(char *addr);
+
+void rdns_init(void)
+{
+    int i;
+    pthread_t tid;
+
+    qhead = qcount = 0;
+    for (i = 0; i < RDNS_THREADS; i++)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * rdns_name - the cached name of the address in sa, or its numeric
+ * form (queueing a lookup) if none is known yet; never blocks on DNS
+ */
+/* $begin rdns_name */
+void rdns_name(const struct sockaddr *sa, socklen_t salen, char *host, size_t hostlen)
+{
+    char addr[NI_MAXHOST];
+    rdns_entry_t *e;
+
+    if (getnameinfo(sa, salen, addr, sizeof(addr), NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(addr, "-");
+    snprintf(host, hostlen, "%s", addr);
+    if (addr[0] == '-')
+        return;
+
+    pthread_mutex_lock(&lock);
+    e = slot_of(addr);
+    if (!strcmp(e->addr, addr) && (e->pending || time(NULL) < e->expires)) {
+        if (!e->pending)
+            snprintf(host, hostlen, "%s", e->name);
+    } else if (qcount < RDNS_QUEUE) { /* miss or expired: look it up */
+        strcpy(e->addr, addr);
+        e->pending = 1;
+        memcpy(&queue[(qhead + qcount) % RDNS_QUEUE].sa, sa, salen);
+        queue[(qhead + qcount) % RDNS_QUEUE].salen = salen;
+        qcount++;
+        pthread_cond_signal(&nonempty);
+    }
+    pthread_mutex_unlock(&lock);
+}
+/* $end rdns_name */
+
+/*
+ * resolver - resolver thread: perform queued lookups, fill the cache
+ */
+static void *resolver(void *vargp)
+{
+    rdns_req_t req;
+    char addr[NI_MAXHOST], name[NI_MAXHOST];
+    rdns_entry_t *e;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (qcount == 0)
+            pthread_cond_wait(&nonempty, &lock);
+        req = queue[qhead];
+        qhead = (qhead + 1) % RDNS_QUEUE;
+        qcount--;
+        pthread_mutex_unlock(&lock);
+
+        getnameinfo((SA *)&req.sa, req.salen, addr, sizeof(addr), NULL, 0, NI_NUMERICHOST);
+        rc = getnameinfo((SA *)&req.sa, req.salen, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+
+        pthread_mutex_lock(&lock);
+        e = slot_of(addr);
+        if (!strcmp(e->addr, addr)) { /* not taken over by another address meanwhile */
+            strcpy(e->name, rc == 0 ? name : addr);
+            e->expires = time(NULL) + (rc == 0 ? RDNS_TTL : RDNS_NEG_TTL);
+            e->pending = 0;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* slot_of - cache slot for a numeric address; caller holds lock */
+static rdns_entry_t *slot_of(char *addr)
+{
+    unsigned h = 5381;
+
+    while (*addr)
+        h = h * 33 + (unsigned char)*addr++;
+    return &cache[h % RDNS_SLOTS];
+}
+/* $end rdns.c */
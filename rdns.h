@@ -0,0 +1,20 @@
+/*
+ * rdns.h - asynchronous, TTL-cached reverse DNS for the access log
+ */
+/* $begin rdns.h */
+#ifndef __RDNS_H__
+#define __RDNS_H__
+
+#include <sys/socket.h>
+
+#define RDNS_SLOTS   256   /* cached names, direct-mapped by address */
+#define RDNS_QUEUE   32    /* lookups waiting for a resolver; more are dropped */
+#define RDNS_THREADS 2     /* resolver threads */
+#define RDNS_TTL     3600  /* seconds a resolved name is kept */
+#define RDNS_NEG_TTL 300   /* seconds a failed lookup is remembered */
+
+void rdns_init(void);
+void rdns_name(const struct sockaddr *sa, socklen_t salen, char *host, size_t hostlen);
+
+#endif /* __RDNS_H__ */
+/* $end rdns.h */
@@ -0,0 +1,124 @@
+/*
+ * sbuf.c - bounded buffer of accepted connections (CS:APP 12.5.5),
+ *     holding conn_t records instead of bare descriptors
+ *
+ * Rather than one FIFO, each client with connections waiting has its
+ * own FIFO (a flow), and workers take connections from the flows by
+ * deficit round robin: on its turn a flow earns SBUF_QUANTUM bytes of
+ * credit and gives up connections for as long as the credit covers
+ * their cost, the bytes its client has recently been sent per request.
+ * A client fetching large objects, or opening many connections at
+ * once, thus gets the same share of the workers as any other client
+ * with work queued instead of starving them.
+ */
+/* $begin sbufc */
+#include "csapp.h"
+#include "sbuf.h"
+
+/* Create an empty, bounded, shared buffer with n slots */
+/* $begin sbuf_init */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    int i;
+
+    sp->buf = Calloc(n, sizeof(conn_t)); 
+    sp->link = Calloc(n, sizeof(int));
+    sp->flows = Calloc(n, sizeof(sbuf_flow_t));
+    sp->n = n;                       /* Buffer holds max of n items */
+    for (i = 0; i < n; i++)          /* All slots start on the free list */
+        sp->link[i] = i + 1 < n ? i + 1 : -1;
+    sp->free = 0;
+    sp->last = -1;                   /* No flow has anything waiting */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+}
+/* $end sbuf_init */
+
+/* Clean up buffer sp */
+/* $begin sbuf_deinit */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->link);
+    Free(sp->flows);
+}
+/* $end sbuf_deinit */
+
+/* Insert item onto the rear of its client's flow in sp */
+/* $begin sbuf_insert */
+void sbuf_insert(sbuf_t *sp, conn_t *item)
+{
+    int slot, f;
+    sbuf_flow_t *fp;
+
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    slot = sp->free;                        /* Insert the item */
+    sp->free = sp->link[slot];
+    sp->buf[slot] = *item;
+    sp->link[slot] = -1;
+
+    /* find the client's flow among those waiting, or start one */
+    for (f = 0; f < sp->n; f++)
+        if (sp->flows[f].client == item->client)
+            break;
+    if (f == sp->n) {
+        for (f = 0; sp->flows[f].client; f++)
+            ;
+        fp = &sp->flows[f];
+        fp->client = item->client;
+        fp->head = slot;
+        fp->deficit = 0;
+        if (sp->last < 0)                   /* join the round at its end */
+            fp->next = f;
+        else {
+            fp->next = sp->flows[sp->last].next;
+            sp->flows[sp->last].next = f;
+        }
+        sp->last = f;
+    } else {
+        fp = &sp->flows[f];
+        sp->link[fp->tail] = slot;
+    }
+    fp->tail = slot;
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+/* $end sbuf_insert */
+
+/* Remove the next item due by deficit round robin from sp into *item */
+/* $begin sbuf_remove */
+void sbuf_remove(sbuf_t *sp, conn_t *item)
+{
+    int slot, f;
+    sbuf_flow_t *fp;
+
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    while (1) {
+        f = sp->flows[sp->last].next;       /* flow at the front of the round */
+        fp = &sp->flows[f];
+        if (fp->deficit >= sp->buf[fp->head].cost)
+            break;
+        fp->deficit += SBUF_QUANTUM;        /* next turn: earn and go to the back */
+        sp->last = f;
+    }
+    slot = fp->head;                        /* Remove the item */
+    *item = sp->buf[slot];
+    fp->deficit -= item->cost;
+    fp->head = sp->link[slot];
+    sp->link[slot] = sp->free;
+    sp->free = slot;
+    if (fp->head < 0) {                     /* flow drained: leave the round */
+        fp->client = NULL;
+        if (fp->next == f)
+            sp->last = -1;
+        else
+            sp->flows[sp->last].next = fp->next;
+    }
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+}
+/* $end sbuf_remove */
+/* $end sbufc */
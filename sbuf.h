@@ -0,0 +1,51 @@
+/*
+ * sbuf.h - bounded buffer of accepted connections (CS:APP 12.5.5),
+ *     shared fairly between clients
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+#include "client.h"
+
+#define SBUF_QUANTUM 16384  /* bytes of credit a client earns per round */
+
+/* An accepted connection waiting for a worker */
+typedef struct {
+    int fd;
+    struct sockaddr_storage addr;  /* client address */
+    socklen_t addrlen;
+    long long accepted_ns;         /* CLOCK_MONOTONIC at accept */
+    client_t *client;              /* whose queue it waits in */
+    int cost;                      /* expected bytes to serve it */
+    long long trace;               /* request id if traced (trace.c), else 0 */
+} conn_t;
+
+/* Connections of one client, waiting in arrival order */
+typedef struct {
+    client_t *client;  /* NULL if the flow is unused */
+    int head, tail;    /* first and last slot of the flow */
+    int deficit;       /* credit left this round */
+    int next;          /* next flow in the round */
+} sbuf_flow_t;
+
+/* $begin sbuft */
+typedef struct {
+    conn_t *buf;       /* Buffer array */         
+    int *link;         /* Next slot in the same flow, or next free slot */
+    sbuf_flow_t *flows;/* At most n clients can have connections waiting */
+    int n;             /* Maximum number of slots */
+    int free;          /* First free slot, -1 if full */
+    int last;          /* Flow at the end of the round, -1 if empty */
+    sem_t mutex;       /* Protects accesses to buf */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+} sbuf_t;
+/* $end sbuft */
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, conn_t *item);
+void sbuf_remove(sbuf_t *sp, conn_t *item);
+
+#endif /* __SBUF_H__ */
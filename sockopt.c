@@ -0,0 +1,124 @@
+/*
+ * sockopt.c - TCP tuning profile for listening, client and origin sockets
+ *
+ * One profile, set with -o, is applied at the three places sockets
+ * come from: the listener (TCP_DEFER_ACCEPT, so a worker is only
+ * handed a connection once its request has arrived; TCP_FASTOPEN; the
+ * receive buffer, which accepted sockets inherit), accepted client
+ * sockets and origin sockets (TCP_NODELAY, buffer sizes; fast open on
+ * connect). Buffer sizes are left to kernel autotuning unless given,
+ * since fixing them also fixes the window.
+ *
+ * With TCP_NODELAY set, a response written as status line, headers and
+ * body in several writes would go out in as many small segments;
+ * sockopt_cork brackets such writes so the kernel coalesces them.
+ *
+ * The spec is a comma-separated list of name[=value], e.g.
+ * "nodelay,cork,defer=1,fastopen=64,sndbuf=262144"; a bare name means
+ * 1 and name=0 turns an option off.
+ */
+/* $begin sockopt.c */
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "sockopt.h"
+
+sockopt_t sockopt = { 1, 1, 1, 0, 0, 0 };
+
+static void set_int(int fd, int level, int name, int val, char *what);
+
+/*
+ * sockopt_parse - update the profile from spec; -1 if it is malformed
+ */
+/* $begin sockopt_parse */
+int sockopt_parse(char *spec)
+{
+    char buf[MAXLINE], *name, *eq, *save;
+    int val;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        val = 1;
+        if ((eq = strchr(name, '=')) != NULL) {
+            *eq = '\0';
+            val = atoi(eq + 1);
+        }
+        if (!strcmp(name, "nodelay"))
+            sockopt.nodelay = val;
+        else if (!strcmp(name, "cork"))
+            sockopt.cork = val;
+        else if (!strcmp(name, "defer"))
+            sockopt.defer = val;
+        else if (!strcmp(name, "fastopen"))
+            sockopt.fastopen = val;
+        else if (!strcmp(name, "sndbuf"))
+            sockopt.sndbuf = val;
+        else if (!strcmp(name, "rcvbuf"))
+            sockopt.rcvbuf = val;
+        else {
+            fprintf(stderr, "unknown socket option: %s\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+/* $end sockopt_parse */
+
+/*
+ * sockopt_listener - tune the listening socket
+ */
+void sockopt_listener(int fd)
+{
+    if (sockopt.defer)
+        set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, sockopt.defer, "TCP_DEFER_ACCEPT");
+    if (sockopt.fastopen)
+        set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, sockopt.fastopen, "TCP_FASTOPEN");
+    if (sockopt.rcvbuf) /* inherited by accepted sockets */
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, sockopt.rcvbuf, "SO_RCVBUF");
+}
+
+/*
+ * sockopt_accepted - tune a client socket returned by accept
+ */
+void sockopt_accepted(int fd)
+{
+    if (sockopt.nodelay)
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (sockopt.sndbuf)
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, sockopt.sndbuf, "SO_SNDBUF");
+}
+
+/*
+ * sockopt_upstream - tune an origin socket; call before connect so the
+ * receive buffer counts toward the window scale it negotiates
+ */
+void sockopt_upstream(int fd)
+{
+    if (sockopt.nodelay)
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (sockopt.fastopen)
+        set_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+    if (sockopt.sndbuf)
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, sockopt.sndbuf, "SO_SNDBUF");
+    if (sockopt.rcvbuf)
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, sockopt.rcvbuf, "SO_RCVBUF");
+}
+
+/*
+ * sockopt_cork - hold back partial segments on fd while on; turning it
+ * off sends what is pending at once
+ */
+void sockopt_cork(int fd, int on)
+{
+    if (sockopt.cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* set_int - setsockopt of an int; failures are reported once per option */
+static void set_int(int fd, int level, int name, int val, char *what)
+{
+    static int reported[64];
+
+    if (setsockopt(fd, level, name, &val, sizeof(val)) < 0 && !reported[name % 64]++)
+        fprintf(stderr, "setsockopt %s: %s\n", what, strerror(errno));
+}
+/* $end sockopt.c */
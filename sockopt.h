@@ -0,0 +1,27 @@
+/*
+ * sockopt.h - TCP tuning profile for listening, client and origin sockets
+ */
+/* $begin sockopt.h */
+#ifndef __SOCKOPT_H__
+#define __SOCKOPT_H__
+
+/* Profile applied to every socket the proxy opens or accepts */
+typedef struct {
+    int nodelay;      /* TCP_NODELAY on client and origin sockets */
+    int cork;         /* TCP_CORK around header+body writes */
+    int defer;        /* TCP_DEFER_ACCEPT seconds on the listener, 0 = off */
+    int fastopen;     /* TCP_FASTOPEN queue on the listener (and connect), 0 = off */
+    int sndbuf;       /* SO_SNDBUF bytes, 0 = kernel autotuning */
+    int rcvbuf;       /* SO_RCVBUF bytes, 0 = kernel autotuning */
+} sockopt_t;
+
+extern sockopt_t sockopt;
+
+int sockopt_parse(char *spec);
+void sockopt_listener(int fd);
+void sockopt_accepted(int fd);
+void sockopt_upstream(int fd);
+void sockopt_cork(int fd, int on);
+
+#endif /* __SOCKOPT_H__ */
+/* $end sockopt.h */
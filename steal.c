@@ -0,0 +1,278 @@
+/*
+ * steal.c - work-stealing worker threads that accept for themselves
+ *
+ * With -S the main thread does not accept and there is no shared
+ * buffer. Each worker owns a Chase-Lev deque of connections (Chase and
+ * Lev, SPAA 2005, with the C11 orderings of Le et al., PPoPP 2013): it
+ * pushes what it accepts and pops at the bottom without a lock, while
+ * an idle worker takes from the top of another's deque with one CAS.
+ * A worker whose own deque is empty and who finds nothing to steal
+ * accepts a batch of connections itself, so that a burst is taken in
+ * by whichever worker is free and spread from there, and otherwise
+ * sleeps in epoll_wait.
+ *
+ * Sleeping workers are woken by the kernel, one at a time
+ * (EPOLLEXCLUSIVE), when a connection arrives, and through a shared
+ * semaphore eventfd for each connection a worker holds beyond the one
+ * it serves next, so that the surplus is stolen instead of waiting
+ * behind a slow download. The listening socket is non-blocking in this
+ * mode; each worker waits on a dup of it, which it drops once the
+ * proxy drains so that it takes no connection meant for a successor.
+ */
+/* $begin steal.c */
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "steal.h"
+#include "handoff.h"
+
+typedef struct {
+    atomic_long top;         /* next to steal; only ever grows */
+    atomic_long bottom;      /* next to push; moved by the owner only */
+    _Atomic(conn_t *) buf[STEAL_DEQUE];
+} deque_t;
+
+typedef struct {
+    deque_t deque;
+    int epfd;
+    int listenfd;            /* own dup of the listening socket, -1 once dropped */
+    unsigned int seed;       /* for picking victims */
+} worker_t;
+
+int steal_enabled = 0;
+
+static worker_t *workers;
+static int nworkers;
+static int batch_max;
+static int wakefd;           /* semaphore: connections waiting to be stolen */
+static int stopfd;           /* readable once the proxy drains */
+static void (*accepted_fn)(conn_t *);
+static void (*serve_fn)(conn_t *);
+static __thread worker_t *self;
+
+static void *worker_thread(void *vargp);
+static int accept_batch(worker_t *w);
+static conn_t *steal_any(worker_t *w);
+static void stop_accepting(worker_t *w);
+static void deque_push(deque_t *d, conn_t *conn);
+static conn_t *deque_pop(deque_t *d);
+static conn_t *deque_steal(deque_t *d);
+static long deque_size(deque_t *d);
+
+/*
+ * steal_init - start n workers accepting on listenfd, at most batch at
+ * a time; each accepted connection is passed to accepted, which queues
+ * it with steal_push or refuses it, and queued ones to serve
+ */
+void steal_init(int n, int listenfd, int batch,
+    void (*accepted)(conn_t *), void (*serve)(conn_t *))
+{
+    struct epoll_event ev;
+    pthread_t tid;
+    worker_t *w;
+    int i;
+
+    nworkers = n;
+    batch_max = batch;
+    accepted_fn = accepted;
+    serve_fn = serve;
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if ((wakefd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        unix_error("steal_init error");
+    workers = Calloc(n, sizeof(worker_t));
+    for (i = 0; i < n; i++) {
+        w = &workers[i];
+        if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (w->listenfd = fcntl(listenfd, F_DUPFD_CLOEXEC, 0)) < 0)
+            unix_error("steal_init error");
+        w->seed = i + 1;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = w->listenfd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev);
+        ev.data.fd = wakefd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        ev.events = EPOLLIN; /* wakes every worker */
+        ev.data.fd = stopfd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, stopfd, &ev);
+    }
+    steal_enabled = 1;
+    for (i = 0; i < n; i++)
+        Pthread_create(&tid, NULL, worker_thread, &workers[i]);
+}
+
+/*
+ * steal_push - queue a copy of a connection just accepted by the
+ * calling worker on its own deque; accept_batch keeps room for it
+ */
+void steal_push(conn_t *conn)
+{
+    deque_push(&self->deque, memcpy(Malloc(sizeof(conn_t)), conn, sizeof(conn_t)));
+}
+
+/*
+ * steal_stop - called once the proxy drains: wake the workers so that
+ * they stop accepting; they go on serving what they hold
+ */
+void steal_stop(void)
+{
+    uint64_t one = 1;
+
+    if (write(stopfd, &one, sizeof(one)) < 0)
+        unix_error("steal_stop error");
+}
+
+/*
+ * worker_thread - serve our own connections newest first, then other
+ * workers' oldest first, then accept more or sleep
+ */
+/* $begin worker_thread */
+static void *worker_thread(void *vargp)
+{
+    worker_t *w = vargp;
+    struct epoll_event events[STEAL_EVENTS];
+    conn_t *conn;
+    uint64_t v;
+    int i, n;
+
+    Pthread_detach(pthread_self());
+    self = w;
+    while (1) {
+        if ((conn = deque_pop(&w->deque)) != NULL || (conn = steal_any(w)) != NULL) {
+            serve_fn(conn);
+            Free(conn);
+            continue;
+        }
+        if (handoff_draining && w->listenfd >= 0)
+            stop_accepting(w);
+        if (w->listenfd >= 0 && accept_batch(w) > 0)
+            continue;
+        n = epoll_wait(w->epfd, events, STEAL_EVENTS, -1);
+        for (i = 0; i < n; i++)
+            if (events[i].data.fd == wakefd && read(wakefd, &v, sizeof(v)) < 0)
+                ; /* another worker came for the same connection */
+    }
+    return NULL;
+}
+/* $end worker_thread */
+
+/*
+ * accept_batch - accept up to batch_max connections onto our deque and
+ * wake as many idle workers as we took beyond the first
+ * Returns the number accepted.
+ */
+static int accept_batch(worker_t *w)
+{
+    conn_t conn;
+    uint64_t surplus;
+    int n;
+
+    for (n = 0; n < batch_max && deque_size(&w->deque) < STEAL_DEQUE; n++) {
+        conn.addrlen = sizeof(conn.addr);
+        if ((conn.fd = accept(w->listenfd, (SA *)&conn.addr, &conn.addrlen)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Couldn't connect to client.\n");
+            break;
+        }
+        accepted_fn(&conn);
+    }
+    if ((surplus = deque_size(&w->deque)) > 1) {
+        surplus--; /* the one we serve next */
+        if (write(wakefd, &surplus, sizeof(surplus)) < 0)
+            ; /* the counter is saturated: there is no one left to wake */
+    }
+    return n;
+}
+
+/* steal_any - take the oldest connection of some other worker, if any */
+static conn_t *steal_any(worker_t *w)
+{
+    conn_t *conn;
+    int i, start = rand_r(&w->seed) % nworkers;
+
+    for (i = 0; i < nworkers; i++)
+        if (&workers[(start + i) % nworkers] != w &&
+            (conn = deque_steal(&workers[(start + i) % nworkers].deque)) != NULL)
+            return conn;
+    return NULL;
+}
+
+/* stop_accepting - leave the listening socket to a successor, if any */
+static void stop_accepting(worker_t *w)
+{
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listenfd, NULL);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, stopfd, NULL);
+    close(w->listenfd);
+    w->listenfd = -1;
+}
+
+/*
+ * Chase-Lev deque. Only the owner pushes and pops, at the bottom;
+ * thieves race the owner for the last element with a CAS on top.
+ */
+
+/* $begin deque_push */
+static void deque_push(deque_t *d, conn_t *conn)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+
+    atomic_store_explicit(&d->buf[b & (STEAL_DEQUE - 1)], conn, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+/* $end deque_push */
+
+/* $begin deque_pop */
+static conn_t *deque_pop(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    long t;
+    conn_t *conn;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) { /* empty */
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    conn = atomic_load_explicit(&d->buf[b & (STEAL_DEQUE - 1)], memory_order_relaxed);
+    if (t == b) { /* the last one: a thief may be after it too */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            conn = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return conn;
+}
+/* $end deque_pop */
+
+/* $begin deque_steal */
+static conn_t *deque_steal(deque_t *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    long b;
+    conn_t *conn;
+
+    while (1) {
+        atomic_thread_fence(memory_order_seq_cst);
+        b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+        if (t >= b)
+            return NULL;
+        conn = atomic_load_explicit(&d->buf[t & (STEAL_DEQUE - 1)], memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            return conn;
+        /* lost to the owner or another thief; t now holds the new top */
+    }
+}
+/* $end deque_steal */
+
+/* deque_size - connections held, as seen by the owner */
+static long deque_size(deque_t *d)
+{
+    return atomic_load_explicit(&d->bottom, memory_order_relaxed) -
+        atomic_load_explicit(&d->top, memory_order_acquire);
+}
+/* $end steal.c */
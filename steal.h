@@ -0,0 +1,22 @@
+/*
+ * steal.h - work-stealing worker threads that accept for themselves
+ */
+/* $begin steal.h */
+#ifndef __STEAL_H__
+#define __STEAL_H__
+
+#include "sbuf.h"
+
+#define STEAL_DEQUE  256  /* connections one worker may hold, a power of 2 */
+#define STEAL_BATCH  16   /* most connections accepted per wakeup */
+#define STEAL_EVENTS 4    /* epoll events taken per wait */
+
+extern int steal_enabled;
+
+void steal_init(int nworkers, int listenfd, int batch,
+    void (*accepted)(conn_t *), void (*serve)(conn_t *));
+void steal_push(conn_t *conn);
+void steal_stop(void);
+
+#endif /* __STEAL_H__ */
+/* $end steal.h */
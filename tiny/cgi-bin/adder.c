@@ -1,38 +1,67 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by Tiny's worker pool (CGI_POOL_VAR set), it stays resident and
+ * answers one request per CGI_PARAMS frame instead of exiting.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgiproto.h"
+
+void add(char *query, char *response);
 
 int main(void) {
-    char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+    char query[CGI_MAXFRAME + 1], response[MAXLINE];
+    unsigned int type;
+    int n;
+
+    if (getenv(CGI_POOL_VAR)) { /* pooled: loop over framed requests */
+	if (cgi_write_frame(STDIN_FILENO, CGI_HELLO, NULL, 0) < 0)
+	    exit(1);
+	while ((n = cgi_read_frame(STDIN_FILENO, &type, query, CGI_MAXFRAME)) >= 0) {
+	    if (type != CGI_PARAMS)
+		exit(1);
+	    query[n] = '\0';
+	    add(query, response);
+	    if (cgi_write_frame(STDIN_FILENO, CGI_STDOUT, response, strlen(response)) < 0 ||
+		cgi_write_frame(STDIN_FILENO, CGI_END, NULL, 0) < 0)
+		exit(1);
+	}
+	exit(0);
+    }
+
+    add(getenv("QUERY_STRING"), response);
+    printf("%s", response);
+    fflush(stdout);
+
+    exit(0);
+}
+
+/*
+ * add - build the HTTP response for query "n1&n2"
+ */
+void add(char *query, char *response) {
+    char *p, arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
+    if (query != NULL && (p = strchr(query, '&')) != NULL) {
 	*p = '\0';
-	strcpy(arg1, buf);
+	strcpy(arg1, query);
 	strcpy(arg2, p+1);
 	n1 = atoi(arg1);
 	n2 = atoi(arg2);
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
+    sprintf(content, "Welcome to add.com: "
+	    "THE Internet addition portal.\r\n<p>"
+	    "The answer is: %d + %d = %d\r\n<p>"
+	    "Thanks for visiting!\r\n", n1, n2, n1 + n2);
   
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
-
-    exit(0);
+    sprintf(response, "Connection: close\r\n"
+	    "Content-length: %d\r\n"
+	    "Content-type: text/html\r\n\r\n%s", (int)strlen(content), content);
 }
 /* $end adder */
@@ -0,0 +1,224 @@
+/*
+ * cgipool.c - pre-forked worker processes for Tiny's CGI programs
+ *
+ * The first request for a CGI program starts CGI_WORKERS copies of it,
+ * each with one end of a Unix domain socketpair as stdin and
+ * CGI_POOL_VAR set in its environment. A program that answers with a
+ * CGI_HELLO frame is kept warm and serves one request per CGI_PARAMS
+ * frame (see cgiproto.h); one that does not is remembered as a
+ * classic CGI program and cgipool_serve() declines it, so the caller
+ * falls back to fork/exec, as it does for requests that come while
+ * the first worker is still starting. A worker that dies is restarted
+ * lazily the next time its slot is picked.
+ */
+/* $begin cgipool.c */
+#include <poll.h>
+#include "csapp.h"
+#include "cgipool.h"
+#include "cgiproto.h"
+
+#define PROG_EMPTY  0
+#define PROG_POOLED 1 /* speaks cgiproto.h */
+#define PROG_LEGACY 2 /* plain CGI: fork/exec per request */
+#define PROG_PROBING 3 /* first worker starting; fork/exec meanwhile */
+
+typedef struct {
+    pid_t pid;
+    int fd;    /* Tiny's end of the socketpair, -1 if not running */
+    int busy;
+} cgiworker_t;
+
+typedef struct {
+    char path[MAXLINE];
+    int state;
+    cgiworker_t w[CGI_WORKERS];
+    sem_t idle; /* counts workers not serving a request */
+} cgiprog_t;
+
+static cgiprog_t progs[CGI_PROGS];
+static sem_t mutex; /* protects progs[] bookkeeping */
+static char **pool_env;
+
+static cgiprog_t *find_prog(char *filename);
+static int spawn_worker(cgiprog_t *prog, cgiworker_t *w);
+static void stop_worker(cgiworker_t *w);
+static int run_request(int workerfd, int fd, char *cgiargs);
+
+/*
+ * cgipool_init - prepare an empty pool; workers start on first use
+ */
+void cgipool_init(void)
+{
+    int i, n;
+
+    for (n = 0; environ[n]; n++)
+	;
+    pool_env = Calloc(n + 2, sizeof(char *));
+    for (i = 0; i < n; i++)
+	pool_env[i] = environ[i];
+    pool_env[n] = CGI_POOL_VAR "=1";
+
+    memset(progs, 0, sizeof(progs));
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * cgipool_serve - run the CGI program filename on a warm worker,
+ *     copying its output to fd
+ *     returns 0 if the request was served, -1 if the caller should
+ *     fall back to fork/exec (nothing has been sent to fd then)
+ */
+/* $begin cgipool_serve */
+int cgipool_serve(int fd, char *filename, char *cgiargs)
+{
+    cgiprog_t *prog;
+    cgiworker_t *w = NULL;
+    int i, rc;
+
+    if (!(prog = find_prog(filename)))
+	return -1;
+
+    P(&prog->idle); /* wait for a free worker */
+    P(&mutex);
+    for (i = 0; i < CGI_WORKERS; i++)
+	if (!prog->w[i].busy) {
+	    w = &prog->w[i];
+	    w->busy = 1;
+	    break;
+	}
+    V(&mutex);
+
+    if (w->fd < 0 && spawn_worker(prog, w) < 0)
+	rc = -1;
+    else if ((rc = run_request(w->fd, fd, cgiargs)) < 0)
+	stop_worker(w); /* out of step with us; restart on next use */
+
+    P(&mutex);
+    w->busy = 0;
+    V(&mutex);
+    V(&prog->idle);
+    return rc == -1 ? -1 : 0;
+}
+/* $end cgipool_serve */
+
+/*
+ * find_prog - look up filename's pool, creating it on first use
+ *     The slot is reserved under the mutex, which is then dropped while
+ *     the probe worker has CGI_HELLO_MS to answer, so that a slow or
+ *     broken program does not hold up every other CGI request.
+ *     returns NULL if the program is not poolable, or not yet known to be
+ */
+static cgiprog_t *find_prog(char *filename)
+{
+    cgiprog_t *prog = NULL;
+    int i, state;
+
+    P(&mutex);
+    for (i = 0; i < CGI_PROGS; i++) {
+	if (progs[i].state != PROG_EMPTY && !strcmp(progs[i].path, filename)) {
+	    prog = &progs[i];
+	    break;
+	}
+	if (progs[i].state == PROG_EMPTY && !prog)
+	    prog = &progs[i];
+    }
+    if (!prog || prog->state != PROG_EMPTY) {
+	V(&mutex);
+	return prog && prog->state == PROG_POOLED ? prog : NULL;
+    }
+
+    /* first request: probe with one worker, the rest start lazily */
+    strcpy(prog->path, filename);
+    for (i = 0; i < CGI_WORKERS; i++) {
+	prog->w[i].fd = -1;
+	prog->w[i].busy = 0;
+    }
+    Sem_init(&prog->idle, 0, CGI_WORKERS);
+    prog->state = PROG_PROBING;
+    V(&mutex);
+
+    state = spawn_worker(prog, &prog->w[0]) < 0 ? PROG_LEGACY : PROG_POOLED;
+    printf("CGI %s: %s\n", filename, 
+	   state == PROG_POOLED ? "pooled" : "fork per request");
+    P(&mutex);
+    prog->state = state;
+    V(&mutex);
+
+    return state == PROG_POOLED ? prog : NULL;
+}
+
+/*
+ * spawn_worker - start one worker and wait for its CGI_HELLO
+ */
+static int spawn_worker(cgiprog_t *prog, cgiworker_t *w)
+{
+    int sv[2];
+    unsigned int type;
+    char *argv[] = { prog->path, NULL };
+    struct pollfd pfd;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	return -1;
+    if ((w->pid = fork()) < 0) {
+	close(sv[0]);
+	close(sv[1]);
+	return -1;
+    }
+    if (w->pid == 0) { /* Child: only async-signal-safe calls until exec */
+	dup2(sv[1], STDIN_FILENO);
+	closefrom(3);
+	execve(prog->path, argv, pool_env);
+	_exit(127);
+    }
+    close(sv[1]);
+    w->fd = sv[0];
+
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_HELLO_MS) != 1 || 
+	cgi_read_frame(w->fd, &type, NULL, 0) < 0 || type != CGI_HELLO) {
+	stop_worker(w);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * stop_worker - kill and reap a worker
+ */
+static void stop_worker(cgiworker_t *w)
+{
+    if (w->fd < 0)
+	return;
+    close(w->fd);
+    w->fd = -1;
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+}
+
+/*
+ * run_request - hand one request to a worker and relay its output
+ *     returns 0 on success, -1 if the worker failed before producing
+ *     output, -2 if it failed part way through
+ */
+static int run_request(int workerfd, int fd, char *cgiargs)
+{
+    char buf[CGI_MAXFRAME];
+    unsigned int type;
+    int n, sent = 0, client_ok = 1;
+
+    if (cgi_write_frame(workerfd, CGI_PARAMS, cgiargs, strlen(cgiargs)) < 0)
+	return -1;
+    while ((n = cgi_read_frame(workerfd, &type, buf, CGI_MAXFRAME)) >= 0) {
+	if (type == CGI_END)
+	    return 0;
+	if (type != CGI_STDOUT)
+	    break;
+	/* keep draining after the client is gone, to stay in step */
+	if (client_ok && rio_writen(fd, buf, n) < 0)
+	    client_ok = 0;
+	sent = 1;
+    }
+    return sent ? -2 : -1;
+}
+/* $end cgipool.c */
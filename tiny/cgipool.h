@@ -0,0 +1,13 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGI_PROGS    8  /* distinct CGI programs kept warm */
+#define CGI_WORKERS  4  /* worker processes per program */
+#define CGI_HELLO_MS 1000 /* how long a new worker has to say hello */
+
+void cgipool_init(void);
+int cgipool_serve(int fd, char *filename, char *cgiargs);
+
+#endif /* __CGIPOOL_H__ */
@@ -0,0 +1,78 @@
+/*
+ * cgiproto.h - framing spoken between Tiny and pooled CGI workers
+ *
+ * A FastCGI-like exchange over a Unix domain socket on the worker's
+ * stdin. Every frame is a cgi_frame_t header followed by len bytes:
+ *
+ *   worker -> tiny  CGI_HELLO   once, after start-up: "I speak frames"
+ *   tiny -> worker  CGI_PARAMS  the request's QUERY_STRING
+ *   worker -> tiny  CGI_STDOUT  a piece of the CGI output (0 or more)
+ *   worker -> tiny  CGI_END     request done, ready for the next one
+ *
+ * A CGI program enters this mode when CGI_POOL_VAR is set in its
+ * environment; otherwise it is run the classic way, once per request.
+ * Header-only so that programs under cgi-bin need not link csapp.o.
+ */
+#ifndef __CGIPROTO_H__
+#define __CGIPROTO_H__
+
+#include <unistd.h>
+#include <errno.h>
+
+#define CGI_POOL_VAR   "TINY_CGI_POOL"
+#define CGI_MAXFRAME   8192
+
+#define CGI_HELLO  1
+#define CGI_PARAMS 2
+#define CGI_STDOUT 3
+#define CGI_END    4
+
+typedef struct {
+    unsigned int type;
+    unsigned int len;
+} cgi_frame_t;
+
+/* cgi_io - move exactly n bytes; returns 0, or -1 on error/EOF */
+static inline int cgi_io(int fd, char *buf, size_t n, int writing)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+	rc = writing ? write(fd, buf, n) : read(fd, buf, n);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    return -1;
+	buf += rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+/* cgi_write_frame - send one frame; returns 0, or -1 on error */
+static inline int cgi_write_frame(int fd, unsigned int type, void *buf, unsigned int len)
+{
+    cgi_frame_t f;
+
+    f.type = type;
+    f.len = len;
+    if (cgi_io(fd, (char *)&f, sizeof(f), 1) < 0)
+	return -1;
+    return cgi_io(fd, buf, len, 1);
+}
+
+/* cgi_read_frame - receive one frame of at most maxlen bytes into buf
+ *     returns the payload length, or -1 on error/EOF/oversize */
+static inline int cgi_read_frame(int fd, unsigned int *type, void *buf, unsigned int maxlen)
+{
+    cgi_frame_t f;
+
+    if (cgi_io(fd, (char *)&f, sizeof(f), 0) < 0 || f.len > maxlen)
+	return -1;
+    if (cgi_io(fd, buf, f.len, 0) < 0)
+	return -1;
+    *type = f.type;
+    return f.len;
+}
+
+#endif /* __CGIPROTO_H__ */
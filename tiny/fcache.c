@@ -0,0 +1,161 @@
+/*
+ * fcache.c - open-file cache for Tiny's static content
+ *
+ * Each entry keeps a file open together with the complete response
+ * header block built for it, so a hot file is served without stat(),
+ * open() or header formatting. Entries are checked against the file's
+ * inode, size and mtime at most every FCACHE_RECHECK seconds and are
+ * dropped when any of them changes. Entries are reference counted so
+ * that one evicted while a worker is still sending from it stays open
+ * until that worker is done.
+ */
+/* $begin fcache.c */
+#include "csapp.h"
+#include "fcache.h"
+
+static fentry_t *table[FCACHE_SLOTS];
+static unsigned long use_clock;
+static sem_t mutex; /* protects table, use_clock and all refs */
+
+static unsigned long hash_path(char *path);
+static void drop_locked(fentry_t *fe);
+static void release_locked(fentry_t *fe);
+
+void fcache_init(void)
+{
+    memset(table, 0, sizeof(table));
+    use_clock = 0;
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * fcache_get - find a still-valid entry for path
+ *     returns the entry with a reference held, or NULL on a miss
+ */
+/* $begin fcache_get */
+fentry_t *fcache_get(char *path)
+{
+    unsigned long h = hash_path(path);
+    fentry_t *fe = NULL;
+    struct stat sbuf;
+    time_t now = time(NULL);
+    int i;
+
+    P(&mutex);
+    for (i = 0; i < FCACHE_SLOTS; i++) {
+	if (table[i] && table[i]->hash == h && !strcmp(table[i]->path, path)) {
+	    fe = table[i];
+	    fe->refs++;
+	    fe->last_used = ++use_clock;
+	    break;
+	}
+    }
+    V(&mutex);
+    if (!fe || now - fe->checked < FCACHE_RECHECK)
+	return fe;
+
+    /* revalidate against the file system, outside the lock */
+    if (stat(path, &sbuf) < 0 || sbuf.st_ino != fe->ino || 
+	sbuf.st_size != fe->size || 
+	sbuf.st_mtim.tv_sec != fe->mtime.tv_sec || 
+	sbuf.st_mtim.tv_nsec != fe->mtime.tv_nsec) {
+	P(&mutex);
+	drop_locked(fe);
+	release_locked(fe);
+	V(&mutex);
+	return NULL;
+    }
+    fe->checked = now;
+    return fe;
+}
+/* $end fcache_get */
+
+/*
+ * fcache_insert - cache open file fd (described by sbuf) for path
+ *     The cache takes ownership of fd. Returns the new entry with a
+ *     reference held for the caller.
+ */
+/* $begin fcache_insert */
+fentry_t *fcache_insert(char *path, int fd, struct stat *sbuf, char *hdr, int hdrlen)
+{
+    fentry_t *fe = Malloc(sizeof(fentry_t));
+    int i, victim = 0;
+
+    fe->path = Malloc(strlen(path) + 1);
+    strcpy(fe->path, path);
+    fe->hash = hash_path(path);
+    fe->fd = fd;
+    fe->size = sbuf->st_size;
+    fe->ino = sbuf->st_ino;
+    fe->mtime = sbuf->st_mtim;
+    fe->checked = time(NULL);
+    fe->hdr = Malloc(hdrlen);
+    memcpy(fe->hdr, hdr, hdrlen);
+    fe->hdrlen = hdrlen;
+    fe->refs = 2; /* the table's and the caller's */
+    fe->dead = 0;
+
+    P(&mutex);
+    /* replace a racing insert of the same path, else take a free or LRU slot */
+    for (i = 0; i < FCACHE_SLOTS; i++) {
+	if (!table[i] || (table[i]->hash == fe->hash && !strcmp(table[i]->path, path))) {
+	    victim = i;
+	    break;
+	}
+	if (table[i]->last_used < table[victim]->last_used)
+	    victim = i;
+    }
+    if (table[victim])
+	drop_locked(table[victim]);
+    fe->last_used = ++use_clock;
+    table[victim] = fe;
+    V(&mutex);
+    return fe;
+}
+/* $end fcache_insert */
+
+/*
+ * fcache_release - caller is done sending from fe
+ */
+void fcache_release(fentry_t *fe)
+{
+    P(&mutex);
+    release_locked(fe);
+    V(&mutex);
+}
+
+/* helpers; callers hold mutex */
+
+static void drop_locked(fentry_t *fe)
+{
+    int i;
+
+    if (fe->dead)
+	return;
+    for (i = 0; i < FCACHE_SLOTS; i++)
+	if (table[i] == fe)
+	    table[i] = NULL;
+    fe->dead = 1;
+    release_locked(fe); /* the table's reference */
+}
+
+static void release_locked(fentry_t *fe)
+{
+    if (--fe->refs > 0)
+	return;
+    close(fe->fd);
+    Free(fe->path);
+    Free(fe->hdr);
+    Free(fe);
+}
+
+/* djb2 string hash */
+static unsigned long hash_path(char *path)
+{
+    unsigned long h = 5381;
+
+    while (*path)
+	h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+/* $end fcache.c */
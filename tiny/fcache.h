@@ -0,0 +1,30 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FCACHE_SLOTS   128 /* max open files kept */
+#define FCACHE_RECHECK 1   /* seconds between mtime checks of an entry */
+
+/* An open static file together with its ready-made response headers */
+typedef struct fentry {
+    char *path;
+    unsigned long hash;
+    int fd;                 /* open, read-only; shared with sendfile offsets */
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    time_t checked;         /* last time the file was stat'ed */
+    char *hdr;              /* complete response header block */
+    int hdrlen;
+    int refs;               /* table reference + requests in flight */
+    int dead;               /* dropped from the table, close on last release */
+    unsigned long last_used;
+} fentry_t;
+
+void fcache_init(void);
+fentry_t *fcache_get(char *path);
+fentry_t *fcache_insert(char *path, int fd, struct stat *sbuf, char *hdr, int hdrlen);
+void fcache_release(fentry_t *fe);
+
+#endif /* __FCACHE_H__ */
@@ -1,28 +1,51 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
+ * tiny.c - A simple, prethreaded HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
  *
+ * Updated 10/2026
+ *   - Prethreaded: the main thread accepts and a pool of NTHREADS
+ *     workers serves connections taken from a bounded sbuf (CS:APP 12.5.5).
+ *   - serve_static() sends the body with sendfile() and each response
+ *     header block with a single write.
+ *   - Static files stay open in a bounded cache (fcache.c) along with
+ *     their header block; a hot file costs one send plus one sendfile.
+ *   - CGI programs that speak the framing in cgiproto.h are kept warm
+ *     in a pre-forked worker pool (cgipool.c); others still fork/exec.
+ *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
+#include <sys/sendfile.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+
+#define NTHREADS  16
+#define SBUFSIZE  64
 
+void *thread(void *vargp);
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
+void serve_static(int fd, char *filename);
+int send_static(int fd, fentry_t *fe);
+int sendfile_all(int fd, int srcfd, size_t n);
+char *get_filetype(char *filename);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
+    int i, listenfd, connfd;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     /* Check command line args */
     if (argc != 2) {
@@ -30,18 +53,41 @@ int main(int argc, char **argv)
 	exit(1);
     }
 
+    /* a worker must not die because a client hung up early */
+    Signal(SIGPIPE, SIG_IGN);
+
     listenfd = Open_listenfd(argv[1]);
+    sbuf_init(&sbuf, SBUFSIZE);
+    fcache_init();
+    cgipool_init();
+    for (i = 0; i < NTHREADS; i++)  /* Create worker threads */
+	Pthread_create(&tid, NULL, thread, NULL);
+
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
                     port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
+	sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
+    }
+}
+/* $end tinymain */
+
+/*
+ * thread - worker: serve connections from the shared buffer forever
+ */
+/* $begin tinythread */
+void *thread(void *vargp) 
+{  
+    Pthread_detach(pthread_self()); 
+    while (1) { 
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
 	doit(connfd);                                             //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
-/* $end tinymain */
+/* $end tinythread */
 
 /*
  * doit - handle one HTTP request/response transaction
@@ -54,10 +100,11 @@ void doit(int fd)
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
     rio_t rio;
+    fentry_t *fe;
 
     /* Read request line and headers */
     Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
         return;
     printf("%s", buf);
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
@@ -70,6 +117,11 @@ void doit(int fd)
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
+    if (is_static && (fe = fcache_get(filename)) != NULL) { /* hot file */
+	send_static(fd, fe);
+	fcache_release(fe);
+	return;
+    }
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
 	clienterror(fd, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
@@ -82,7 +134,7 @@ void doit(int fd)
 			"Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	serve_static(fd, filename);                      //line:netp:doit:servestatic
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
@@ -103,10 +155,12 @@ void read_requesthdrs(rio_t *rp)
 {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	return;
     printf("%s", buf);
     while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return; /* client went away mid-request */
 	printf("%s", buf);
     }
     return;
@@ -146,48 +200,116 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, caching the open
+ *     file and its response headers for the next request
+ *     The file can be removed or changed after doit's stat, so a failed
+ *     open is the client's error (404 or 403), not the server's.
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
+void serve_static(int fd, char *filename)
+{
+    int srcfd, hdrlen;
+    struct stat sbuf;
+    char buf[MAXBUF];
+    fentry_t *fe;
+
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0) { //line:netp:servestatic:open
+	if (errno == ENOENT || errno == ENOTDIR)
+	    clienterror(fd, filename, "404", "Not found",
+			"Tiny couldn't find this file");
+	else
+	    clienterror(fd, filename, "403", "Forbidden",
+			"Tiny couldn't read the file");
+	return;
+    }
+    if (fstat(srcfd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+	close(srcfd);
+	clienterror(fd, filename, "403", "Forbidden",
+		    "Tiny couldn't read the file");
+	return;
+    }
+
+    /* Build response headers once; the cache keeps them with the file */
+    hdrlen = sprintf(buf, "HTTP/1.0 200 OK\r\n"    //line:netp:servestatic:beginserve
+	    "Server: Tiny Web Server\r\n"
+	    "Content-length: %d\r\n"
+	    "Content-type: %s\r\n\r\n", (int)sbuf.st_size, get_filetype(filename));
+
+    fe = fcache_insert(filename, srcfd, &sbuf, buf, hdrlen); /* takes srcfd */
+    send_static(fd, fe);
+    fcache_release(fe);
+}
+
+/*
+ * send_static - send a cached header block, then the file body
+ *     MSG_MORE holds the headers back so that they leave together with
+ *     the first body bytes. Returns 0 on success, -1 if the client went away.
+ */
+int send_static(int fd, fentry_t *fe)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    /* Send response headers to client */
-    get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
-
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
-    Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
-    Munmap(srcp, filesize);             //line:netp:servestatic:munmap
+    char *p = fe->hdr;
+    ssize_t rc;
+    int nleft = fe->hdrlen;
+
+    while (nleft > 0) {
+	if ((rc = send(fd, p, nleft, MSG_MORE)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += rc;
+	nleft -= rc;
+    }
+    return sendfile_all(fd, fe->fd, fe->size); //line:netp:servestatic:sendfile
 }
 
 /*
- * get_filetype - derive file type from file name
+ * sendfile_all - copy n bytes of srcfd to socket fd inside the kernel
+ *     The explicit offset leaves the file position alone, so many
+ *     workers can send from the same cached descriptor at once.
+ *     returns 0 on success, -1 if the client went away
  */
-void get_filetype(char *filename, char *filetype) 
+int sendfile_all(int fd, int srcfd, size_t n)
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
-    else
-	strcpy(filetype, "text/plain");
+    off_t off = 0;
+    ssize_t rc;
+
+    while (off < n) {
+	if ((rc = sendfile(fd, srcfd, &off, n - off)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (rc == 0) /* file shrank underneath us */
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * get_filetype - derive file type from file name extension
+ */
+static struct {
+    char *suffix;
+    char *type;
+} filetypes[] = {
+    { ".html", "text/html" },
+    { ".gif",  "image/gif" },
+    { ".png",  "image/png" },
+    { ".jpg",  "image/jpeg" },
+    { NULL,    NULL }
+};
+
+char *get_filetype(char *filename) 
+{
+    char *ext = strrchr(filename, '.');
+    int i;
+
+    if (ext)
+	for (i = 0; filetypes[i].suffix; i++)
+	    if (!strcmp(ext, filetypes[i].suffix))
+		return filetypes[i].type;
+    return "text/plain";
 }  
 /* $end serve_static */
 
@@ -198,20 +320,24 @@ void get_filetype(char *filename, char *filetype)
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
     char buf[MAXLINE], *emptylist[] = { NULL };
+    pid_t pid;
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n"); 
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
+
+    /* Prefer a warm worker from the pool */
+    if (cgipool_serve(fd, filename, cgiargs) == 0)
+	return;
   
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    Waitpid(pid, NULL, 0); /* Parent waits for and reaps its own child */ //line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
@@ -224,22 +350,15 @@ void clienterror(int fd, char *cause, char *errnum,
 {
     char buf[MAXLINE];
 
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    /* Print the HTTP response headers and body */
+    snprintf(buf, MAXLINE, "HTTP/1.0 %s %s\r\n"
+	     "Content-type: text/html\r\n\r\n"
+	     "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %.4000s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n", 
+	     errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    rio_writen(fd, buf, strlen(buf));
 }
 /* $end clienterror */
@@ -0,0 +1,227 @@
+/*
+ * trace.c - sampled per-request span tracing, dumped as trace-event JSON
+ *
+ * With -t n, one request in n is traced: serve gives it an id, and the
+ * request path records a span for each step it takes (waiting for a
+ * worker, reading the request, the cache, connecting to the origin,
+ * sending the request, relaying the response) with its CLOCK_MONOTONIC
+ * start and end. A request that is not traced has id 0, and then
+ * neither the clock is read nor anything recorded.
+ *
+ * Spans go into a ring of TRACE_SPANS in a buffer of the recording
+ * thread's own, so recording takes no lock; the oldest are overwritten.
+ * A thread that exits leaves its buffer, spans and all, to the next
+ * thread that starts recording. On SIGUSR1 a thread of its own writes
+ * every buffer to TRACE_FILE in the Chrome trace-event format, which
+ * chrome://tracing and Perfetto open: each request is a track of its
+ * own, named after its request line, so that it reads as a timeline.
+ * A span being overwritten while the dump reads it may come out
+ * garbled; the dump does not stop the proxy. With -P, each worker
+ * process keeps and writes its own, so the signal goes to the workers.
+ */
+/* $begin trace.c */
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "trace.h"
+
+typedef struct {
+    const char *name;        /* a string literal */
+    long long id;            /* of the request */
+    long long start_ns, end_ns;
+    int tid;                 /* of the thread that recorded it */
+    char detail[TRACE_DETAIL];
+} span_t;
+
+typedef struct tbuf {
+    span_t spans[TRACE_SPANS];
+    atomic_long written;     /* spans ever recorded here */
+    int tid;                 /* of the thread holding it */
+    int in_use;              /* held by a live thread */
+    struct tbuf *next;
+} tbuf_t;
+
+int trace_every = 0;
+
+static atomic_llong requests;
+static tbuf_t *bufs;         /* every buffer there is */
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buf_key;
+static __thread tbuf_t *mine;
+
+static tbuf_t *claim_buf(void);
+static void release_buf(void *vargp);
+static void *dump_thread(void *vargp);
+static void dump(void);
+static void json_string(FILE *fp, char *s);
+
+/*
+ * trace_init - trace one request in every (none if 0); called by the
+ * main thread before it starts any other, so that all of them leave
+ * SIGUSR1 to the dump thread
+ */
+void trace_init(int every)
+{
+    sigset_t mask;
+
+    if ((trace_every = every) <= 0)
+        return;
+    pthread_key_create(&buf_key, release_buf);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/* trace_start - start the dump thread, in each process that serves */
+void trace_start(void)
+{
+    pthread_t tid;
+
+    if (trace_every > 0)
+        Pthread_create(&tid, NULL, dump_thread, NULL);
+}
+
+/*
+ * trace_sample - the id of a request about to be served if it is to be
+ * traced, else 0
+ */
+long long trace_sample(void)
+{
+    long long n;
+
+    if (trace_every <= 0)
+        return 0;
+    n = atomic_fetch_add_explicit(&requests, 1, memory_order_relaxed) + 1;
+    return n % trace_every == 0 ? n : 0;
+}
+
+/*
+ * trace_span - record that request id spent from start_ns until now
+ * in name; detail, if not NULL, is kept with it
+ */
+/* $begin trace_span */
+void trace_span(long long id, const char *name, long long start_ns, char *detail)
+{
+    span_t *s;
+    long w;
+
+    if (!id || (!mine && !(mine = claim_buf())))
+        return;
+    w = atomic_load_explicit(&mine->written, memory_order_relaxed);
+    s = &mine->spans[w % TRACE_SPANS];
+    s->name = name;
+    s->id = id;
+    s->start_ns = start_ns;
+    s->end_ns = monotonic_ns();
+    s->tid = mine->tid;
+    snprintf(s->detail, TRACE_DETAIL, "%s", detail ? detail : "");
+    atomic_store_explicit(&mine->written, w + 1, memory_order_release);
+}
+/* $end trace_span */
+
+/* claim_buf - a buffer for the calling thread: one left free, or a new one */
+static tbuf_t *claim_buf(void)
+{
+    tbuf_t *b;
+
+    pthread_mutex_lock(&bufs_lock);
+    for (b = bufs; b && b->in_use; b = b->next)
+        ;
+    if (!b) {
+        b = Calloc(1, sizeof(tbuf_t));
+        b->next = bufs;
+        bufs = b;
+    }
+    b->in_use = 1;
+    b->tid = syscall(SYS_gettid);
+    pthread_mutex_unlock(&bufs_lock);
+    pthread_setspecific(buf_key, b); /* given back when the thread exits */
+    return b;
+}
+
+static void release_buf(void *vargp)
+{
+    pthread_mutex_lock(&bufs_lock);
+    ((tbuf_t *)vargp)->in_use = 0;
+    pthread_mutex_unlock(&bufs_lock);
+}
+
+/* dump_thread - write the spans out each time SIGUSR1 comes */
+static void *dump_thread(void *vargp)
+{
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    while (sigwait(&mask, &sig) == 0)
+        dump();
+    return NULL;
+}
+
+/*
+ * dump - write every span held to TRACE_FILE: an "X" (complete) event
+ * each, in microseconds, on the track of its request, and a name for
+ * each track from its "request" span
+ */
+/* $begin dump */
+static void dump(void)
+{
+    char path[64];
+    FILE *fp;
+    tbuf_t *b;
+    span_t s;
+    long w, i;
+    int n = 0;
+
+    snprintf(path, sizeof(path), TRACE_FILE, (int)getpid());
+    if (!(fp = fopen(path, "w"))) {
+        fprintf(stderr, "PROXY: ERROR: cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "{\"traceEvents\":[");
+    pthread_mutex_lock(&bufs_lock);
+    for (b = bufs; b; b = b->next) {
+        w = atomic_load_explicit(&b->written, memory_order_acquire);
+        for (i = w > TRACE_SPANS ? w - TRACE_SPANS : 0; i < w; i++) {
+            s = b->spans[i % TRACE_SPANS];
+            s.detail[TRACE_DETAIL - 1] = '\0';
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"proxy\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%lld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"thread\":%d,\"detail\":",
+                n++ ? "," : "", s.name, (int)getpid(), s.id, s.start_ns / 1000.0,
+                (s.end_ns - s.start_ns) / 1000.0, s.tid);
+            json_string(fp, s.detail);
+            fprintf(fp, "}}");
+            if (!strcmp(s.name, "request")) {
+                fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"tid\":%lld,\"args\":{\"name\":", (int)getpid(), s.id);
+                json_string(fp, s.detail);
+                fprintf(fp, "}}");
+            }
+        }
+    }
+    pthread_mutex_unlock(&bufs_lock);
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+    printf("PROXY: Wrote %d spans to %s.\n", n, path);
+}
+/* $end dump */
+
+/* json_string - write s as a JSON string; bytes past ASCII as \u00XX */
+static void json_string(FILE *fp, char *s)
+{
+    unsigned char *p;
+
+    putc('"', fp);
+    for (p = (unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20 || *p >= 0x7f)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            putc(*p, fp);
+    }
+    putc('"', fp);
+}
+/* $end trace.c */
@@ -0,0 +1,25 @@
+/*
+ * trace.h - sampled per-request span tracing, dumped as trace-event JSON
+ */
+/* $begin trace.h */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "admit.h"
+
+#define TRACE_SPANS  1024  /* spans kept per thread; the oldest are overwritten */
+#define TRACE_DETAIL 96    /* bytes of a span's detail kept, NUL included */
+#define TRACE_FILE   "proxy-trace.%d.json"  /* written on SIGUSR1; %d is the pid */
+
+/* when a span of request id starts: 0, at no cost, if it is not traced */
+#define TRACE_START(id) ((id) ? monotonic_ns() : 0)
+
+extern int trace_every;
+
+void trace_init(int every);
+void trace_start(void);
+long long trace_sample(void);
+void trace_span(long long id, const char *name, long long start_ns, char *detail);
+
+#endif /* __TRACE_H__ */
+/* $end trace.h */
@@ -0,0 +1,314 @@
+/*
+ * tunnel.c - CONNECT tunnels relayed by one epoll thread
+ *
+ * Once doit has connected to the target of a CONNECT and told the
+ * client so, both sockets are handed to this module and the worker
+ * goes back to serving requests: a tunnel can stay open for hours,
+ * and a worker per tunnel would not hold thousands of them.
+ *
+ * A single relay thread waits on all tunnel sockets with edge-triggered
+ * epoll. Each direction has its own pipe, and bytes are spliced
+ * socket->pipe->socket without being copied into user space; a
+ * direction reads no more until its pipe has been written out, so a
+ * slow reader pushes back on its peer through TCP. When one side shuts
+ * down its half (read returns 0), the pipe is drained and the other
+ * side is shut down for writing in turn; the tunnel is closed once both
+ * directions are done, on an error, or after TUNNEL_IDLE_SECS without
+ * traffic. Tunnels are kept in order of last activity, so finding the
+ * idle ones costs nothing per second but the ones that are.
+ */
+/* $begin tunnel.c */
+#define _GNU_SOURCE /* splice, pipe2; csapp.h clashes with it, as in uring.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "tunnel.h"
+#include "admit.h"
+
+/* One direction of a tunnel: from -> pipe -> to */
+typedef struct {
+    int from, to;
+    int pipe[2];
+    size_t queued;            /* bytes in the pipe, not yet written to 'to' */
+    int eof;                  /* 'from' has shut down its half */
+    int shut;                 /* 'to' has been shut down for writing */
+} half_t;
+
+typedef struct tunnel {
+    int fd[2];                /* client, server */
+    half_t half[2];           /* client->server, server->client */
+    long long active_ns;      /* last time the relay saw traffic */
+    int done;                 /* the relay is finished with it; relay thread only */
+    int dead;                 /* 1: to be closed, 2: queued for closing; guarded by lock */
+    struct tunnel *prev, *next; /* by activity, least recent first */
+} tunnel_t;
+
+static int epfd = -1;
+static tunnel_t *head, *tail; /* guarded by lock */
+static int count;             /* guarded by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *relay_thread(void *vargp);
+static int pump(half_t *h);
+static void link_tail(tunnel_t *t);
+static void unlink_tunnel(tunnel_t *t);
+static void close_tunnel(tunnel_t *t);
+
+/*
+ * tunnel_init - start the relay thread
+ */
+void tunnel_init(void)
+{
+    pthread_t tid;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("tunnel_init: epoll_create1 error");
+        return; /* tunnel_add refuses every tunnel */
+    }
+    if (pthread_create(&tid, NULL, relay_thread, NULL) != 0) {
+        perror("tunnel_init: pthread_create error");
+        close(epfd);
+        epfd = -1;
+    }
+}
+
+/*
+ * tunnel_add - relay between client_fd and server_fd until they are done
+ * The descriptors belong to the relay from now on. Returns -1, leaving
+ * them to the caller, if the tunnel cannot be set up.
+ */
+/* $begin tunnel_add */
+int tunnel_add(int client_fd, int server_fd)
+{
+    tunnel_t *t;
+    struct epoll_event ev;
+    int i;
+
+    if (epfd < 0)
+        return -1;
+    pthread_mutex_lock(&lock); /* reserve this tunnel's place */
+    if (count >= TUNNEL_MAX) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    count++;
+    pthread_mutex_unlock(&lock);
+
+    if (!(t = calloc(1, sizeof(tunnel_t))))
+        goto uncount;
+    t->fd[0] = client_fd;
+    t->fd[1] = server_fd;
+    for (i = 0; i < 2; i++) {
+        t->half[i].from = t->fd[i];
+        t->half[i].to = t->fd[1 - i];
+        if (pipe2(t->half[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            if (i == 1) {
+                close(t->half[0].pipe[0]);
+                close(t->half[0].pipe[1]);
+            }
+            free(t);
+            goto uncount;
+        }
+        fcntl(t->fd[i], F_SETFL, fcntl(t->fd[i], F_GETFL) | O_NONBLOCK);
+    }
+    t->active_ns = monotonic_ns();
+
+    /* both sockets are registered, with no tunnel the relay would look
+     * at, before either is pointed at t: if the second cannot be, t is
+     * still the caller's to free. MOD re-arms them, so nothing is missed. */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+        goto fail;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client_fd, &ev);
+        goto fail;
+    }
+    ev.data.ptr = t;
+    pthread_mutex_lock(&lock);
+    link_tail(t);
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, client_fd, &ev) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_MOD, server_fd, &ev) < 0) {
+        /* the relay may already hold t: mark it for closing, and put it
+         * first, where the relay's next sweep takes it */
+        t->dead = 1;
+        unlink_tunnel(t);
+        t->next = head;
+        if (head)
+            head->prev = t;
+        else
+            tail = t;
+        head = t;
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+
+ fail:
+    for (i = 0; i < 2; i++) {
+        close(t->half[i].pipe[0]);
+        close(t->half[i].pipe[1]);
+    }
+    free(t);
+ uncount:
+    pthread_mutex_lock(&lock);
+    count--;
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+/* $end tunnel_add */
+
+/*
+ * relay_thread - move bytes for every tunnel that is ready
+ */
+/* $begin relay_thread */
+static void *relay_thread(void *vargp)
+{
+    struct epoll_event events[TUNNEL_EVENTS];
+    tunnel_t *t, *dead;
+    long long now;
+    int i, n;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        n = epoll_wait(epfd, events, TUNNEL_EVENTS, 1000);
+        now = monotonic_ns();
+        for (i = 0; i < n; i++) {
+            t = events[i].data.ptr;
+            if (!t || t->done) /* not yet set up, or closing */
+                continue;
+            if (pump(&t->half[0]) < 0 || pump(&t->half[1]) < 0 ||
+                (t->half[0].shut && t->half[1].shut))
+                t->done = 1;
+            t->active_ns = now;
+        }
+
+        /* close what is done or idle; a tunnel may appear twice in events */
+        dead = NULL;
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < n; i++) {
+            if (!(t = events[i].data.ptr))
+                continue;
+            if (t->done && !t->dead)
+                t->dead = 1;
+            if (t->dead == 1) {
+                t->dead = 2;
+                unlink_tunnel(t);
+                t->next = dead;
+                dead = t;
+            } else if (!t->dead) {
+                unlink_tunnel(t); /* most recently active now */
+                link_tail(t);
+            }
+        }
+        while (head && (head->dead == 1 ||
+            now - head->active_ns > TUNNEL_IDLE_SECS * 1000000000LL)) {
+            t = head;
+            t->dead = 2;
+            unlink_tunnel(t);
+            t->next = dead;
+            dead = t;
+        }
+        pthread_mutex_unlock(&lock);
+
+        while ((t = dead) != NULL) {
+            dead = t->next;
+            close_tunnel(t);
+        }
+    }
+    return NULL;
+}
+/* $end relay_thread */
+
+/*
+ * pump - move what can be moved in one direction without blocking
+ * Returns -1 if the tunnel has failed.
+ */
+/* $begin pump */
+static int pump(half_t *h)
+{
+    ssize_t n;
+
+    while (1) {
+        if (h->queued > 0) { /* write the pipe out first */
+            n = splice(h->pipe[0], NULL, h->to, NULL, h->queued,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+                return errno == EAGAIN ? 0 : -1;
+            h->queued -= n;
+            continue;
+        }
+        if (h->eof)
+            break;
+        n = splice(h->from, NULL, h->pipe[1], NULL, TUNNEL_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            h->eof = 1;
+        else if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        else
+            h->queued = n;
+    }
+
+    /* the sender is done and all it sent is delivered: pass the half-close on */
+    if (!h->shut) {
+        shutdown(h->to, SHUT_WR);
+        h->shut = 1;
+    }
+    return 0;
+}
+/* $end pump */
+
+/* list helpers; callers hold lock */
+
+static void link_tail(tunnel_t *t)
+{
+    t->next = NULL;
+    t->prev = tail;
+    if (tail)
+        tail->next = t;
+    else
+        head = t;
+    tail = t;
+}
+
+static void unlink_tunnel(tunnel_t *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        head = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        tail = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/*
+ * close_tunnel - release a tunnel already taken off the list
+ * Its sockets are taken out of epfd first: closing one does not, while
+ * another descriptor for it (the worker's, say) is open, and epoll_wait
+ * would go on returning the freed t.
+ */
+static void close_tunnel(tunnel_t *t)
+{
+    struct epoll_event ev = { 0 };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd[i], &ev);
+        close(t->half[i].pipe[0]);
+        close(t->half[i].pipe[1]);
+        close(t->fd[i]);
+    }
+    pthread_mutex_lock(&lock);
+    count--;
+    pthread_mutex_unlock(&lock);
+    free(t);
+}
+/* $end tunnel.c */
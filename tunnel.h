@@ -0,0 +1,17 @@
+/*
+ * tunnel.h - CONNECT tunnels relayed by one epoll thread
+ */
+/* $begin tunnel.h */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#define TUNNEL_MAX        8192   /* tunnels open at once */
+#define TUNNEL_IDLE_SECS  300    /* a tunnel with no traffic this long is closed */
+#define TUNNEL_CHUNK      65536  /* most bytes spliced into a pipe at a time */
+#define TUNNEL_EVENTS     256    /* epoll events taken per wait */
+
+void tunnel_init(void);
+int tunnel_add(int client_fd, int server_fd);
+
+#endif /* __TUNNEL_H__ */
+/* $end tunnel.h */
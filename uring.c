@@ -0,0 +1,506 @@
+/*
+ * uring.c - optional io_uring engine for the proxy's accept and relay paths
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter
+ * system calls, so no liburing is needed. Two operations are offered:
+ *
+ * uring_accept keeps one multishot accept armed on the listening
+ * socket, so a burst of connections is picked up from the completion
+ * queue without an accept() call per connection.
+ *
+ * uring_relay moves a response body from the origin to the client
+ * through a per-thread pipe with linked operations: a poll for the
+ * origin, socket->pipe, then pipe->socket, submitted together with a
+ * single io_uring_enter. A full chunk costs one system call and the
+ * body never enters user memory; a short read breaks the link and the
+ * pipe is drained by a poll for the client and a splice instead.
+ *
+ * The sockets are non-blocking while they relay, and each poll is
+ * linked to an IORING_OP_LINK_TIMEOUT from its socket's SO_RCVTIMEO or
+ * SO_SNDTIMEO (URING_STALL_SECS if it has none): a splice blocked in
+ * the kernel would not be cancelled by the timeout, a poll is. So a
+ * stalled origin or a client that stops reading fails the relay, as a
+ * blocking read or write would have, instead of holding the worker in
+ * io_uring_enter. A thread's ring and pipe are set up the first time it
+ * relays and torn down when it exits, so short-lived threads (HTTP/2
+ * stream fetches) do not leak them.
+ *
+ * uring_init probes for the needed opcodes; if the kernel lacks
+ * io_uring (or a seccomp filter forbids it) uring_enabled stays 0 and
+ * the caller keeps using Accept and the rio copy loop.
+ *
+ * TODO: registered buffers (IORING_REGISTER_BUFFERS) and provided-buffer
+ * rings (IORING_REGISTER_PBUF_RING) for recv are not used yet. Bodies
+ * are spliced and never reach user memory, so they would only pay off
+ * once the header reads that still go through rio are moved onto the
+ * ring as well.
+ */
+/* $begin uring.c */
+#define _GNU_SOURCE /* pipe2, F_SETPIPE_SZ, splice flags */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq, *cq;                   /* the mappings, for ring_teardown */
+    size_t sqlen, cqlen, sqeslen;
+} ring_t;
+
+typedef struct {
+    ring_t ring;
+    int pipe[2];
+} relay_t;
+
+int uring_enabled = 0;
+
+static ring_t accept_ring;          /* owned by the accepting thread */
+static int accept_armed = 0;
+static int accept_stopped = 0;      /* uring_accept_stop was called */
+static __thread relay_t *relay;     /* one per relaying thread */
+static pthread_key_t relay_key;     /* frees it when the thread exits */
+
+static int ring_setup(ring_t *r, unsigned entries);
+static void ring_teardown(ring_t *r);
+static void relay_free(void *vargp);
+static struct io_uring_sqe *ring_get_sqe(ring_t *r);
+static int ring_submit_wait(ring_t *r, unsigned submit, unsigned wait);
+static int ring_reap(ring_t *r, struct io_uring_cqe *cqe);
+static void prep_splice(struct io_uring_sqe *sqe, int in, int out, unsigned len, unsigned flags);
+static void prep_link_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts);
+static void sock_timeout(int fd, int optname, struct __kernel_timespec *ts);
+static ssize_t relay_loop(int srcfd, int dstfd, struct __kernel_timespec *in_ts,
+                          struct __kernel_timespec *out_ts);
+static int ring_send(ring_t *r, int pipefd, int dstfd, unsigned len, struct __kernel_timespec *ts);
+static void prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events);
+static ssize_t relay_plain(int srcfd, int dstfd);
+
+/*
+ * uring_init - set up the accept ring and check the kernel supports
+ * the opcodes used here; returns 0 and sets uring_enabled on success
+ */
+/* $begin uring_init */
+int uring_init(void)
+{
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int ok;
+
+    if (ring_setup(&accept_ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "io_uring unavailable (%s), using the plain syscalls\n", strerror(errno));
+        return -1;
+    }
+
+    probe = calloc(1, len);
+    ok = syscall(__NR_io_uring_register, accept_ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_SPLICE &&
+        (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        fprintf(stderr, "io_uring lacks accept/splice/timeout support, using the plain syscalls\n");
+        ring_teardown(&accept_ring);
+        return -1;
+    }
+
+    pthread_key_create(&relay_key, relay_free);
+    uring_enabled = 1;
+    return 0;
+}
+/* $end uring_init */
+
+/*
+ * uring_accept - return the next connection accepted on listenfd
+ * Kernels that predate multishot accept reject it with EINVAL; the
+ * engine then disables itself and returns -1 so the caller can use
+ * Accept from then on. Other failures, including a signal arriving
+ * while waiting, also return -1 with errno set.
+ */
+/* $begin uring_accept */
+int uring_accept(int listenfd)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+
+    if (!accept_armed) {
+        if (accept_stopped) {
+            errno = ECANCELED;
+            return -1;
+        }
+        sqe = ring_get_sqe(&accept_ring);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenfd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        if (ring_submit_wait(&accept_ring, 1, 0) < 0)
+            return -1;
+        accept_armed = 1;
+    }
+
+    do { /* skip the completion of a cancel request */
+        while (!ring_reap(&accept_ring, &cqe))
+            if (ring_submit_wait(&accept_ring, 0, 1) < 0)
+                return -1;
+    } while (cqe.user_data != 0);
+
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        accept_armed = 0; /* the kernel dropped the multishot; rearm next time */
+    if (cqe.res == -EINVAL) {
+        fprintf(stderr, "io_uring: no multishot accept, using Accept\n");
+        uring_enabled = 0;
+    }
+    if (cqe.res < 0) {
+        errno = -cqe.res;
+        return -1;
+    }
+    return cqe.res;
+}
+/* $end uring_accept */
+
+/*
+ * uring_accept_stop - cancel the armed multishot accept
+ * Connections it accepted before the cancel took effect are still
+ * returned by uring_accept, which then fails with ECANCELED.
+ */
+void uring_accept_stop(void)
+{
+    struct io_uring_sqe *sqe;
+
+    accept_stopped = 1;
+    if (!accept_armed)
+        return;
+    sqe = ring_get_sqe(&accept_ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = 0;      /* user_data of the accept */
+    sqe->user_data = 1;
+    ring_submit_wait(&accept_ring, 1, 0);
+}
+
+/*
+ * uring_relay - splice everything readable on srcfd to dstfd until EOF
+ * Returns the number of bytes moved, or -1 if either side failed or
+ * stalled past its timeout.
+ * A thread that cannot get a ring of its own copies through user space.
+ */
+/* $begin uring_relay */
+ssize_t uring_relay(int srcfd, int dstfd)
+{
+    struct __kernel_timespec in_ts, out_ts;
+    ssize_t total;
+    int srcflags, dstflags;
+
+    if (!relay) {
+        if (!(relay = calloc(1, sizeof(relay_t))))
+            return relay_plain(srcfd, dstfd);
+        if (ring_setup(&relay->ring, 4) < 0) { /* poll, timeout, two splices */
+            free(relay);
+            relay = NULL;
+            return relay_plain(srcfd, dstfd);
+        }
+        if (pipe2(relay->pipe, O_CLOEXEC) < 0) {
+            ring_teardown(&relay->ring);
+            free(relay);
+            relay = NULL;
+            return relay_plain(srcfd, dstfd);
+        }
+        fcntl(relay->pipe[1], F_SETPIPE_SZ, URING_CHUNK);
+        pthread_setspecific(relay_key, relay);
+    }
+    sock_timeout(srcfd, SO_RCVTIMEO, &in_ts);
+    sock_timeout(dstfd, SO_SNDTIMEO, &out_ts);
+
+    /* the sockets wait in ring polls, which the timeouts can cancel */
+    srcflags = fcntl(srcfd, F_GETFL);
+    dstflags = fcntl(dstfd, F_GETFL);
+    fcntl(srcfd, F_SETFL, srcflags | O_NONBLOCK);
+    fcntl(dstfd, F_SETFL, dstflags | O_NONBLOCK);
+    total = relay_loop(srcfd, dstfd, &in_ts, &out_ts);
+    fcntl(srcfd, F_SETFL, srcflags);
+    fcntl(dstfd, F_SETFL, dstflags);
+    return total;
+}
+
+/*
+ * relay_loop - the body of uring_relay, on non-blocking sockets
+ * Each round is one chain: wait for srcfd under in_ts, socket -> pipe,
+ * then pipe -> socket. A splice blocked inside the kernel is not
+ * cancelled by a linked timeout, a poll is: so neither splice waits.
+ */
+static ssize_t relay_loop(int srcfd, int dstfd, struct __kernel_timespec *in_ts,
+                          struct __kernel_timespec *out_ts)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    ssize_t total = 0;
+    int ready, in, out, n;
+
+    while (1) {
+        sqe = ring_get_sqe(&relay->ring);
+        prep_poll(sqe, srcfd, POLLIN);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = 1;
+        sqe = ring_get_sqe(&relay->ring);
+        prep_link_timeout(sqe, in_ts);
+        sqe->flags |= IOSQE_IO_LINK; /* the chain goes on past the timeout */
+        sqe = ring_get_sqe(&relay->ring);
+        prep_splice(sqe, srcfd, relay->pipe[1], URING_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = 2;
+        sqe = ring_get_sqe(&relay->ring);
+        prep_splice(sqe, relay->pipe[0], dstfd, URING_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        sqe->user_data = 3;
+        if (ring_submit_wait(&relay->ring, 4, 4) < 0)
+            return -1;
+
+        /* every entry completes, if only as cancelled */
+        ready = in = out = 0;
+        for (n = 0; n < 4 && ring_reap(&relay->ring, &cqe); n++) {
+            if (cqe.user_data == 1) /* -ECANCELED: the origin stalled */
+                ready = cqe.res;
+            else if (cqe.user_data == 2)
+                in = cqe.res == -EAGAIN ? -EAGAIN : cqe.res;
+            else if (cqe.user_data == 3) /* nothing sent: link cut by a short read, or full */
+                out = (cqe.res == -EAGAIN || cqe.res == -ECANCELED) ? 0 : cqe.res;
+        }
+        if (ready < 0 || (in < 0 && in != -EAGAIN) || out < 0)
+            return -1;
+        if (in == -EAGAIN) /* woken for nothing */
+            continue;
+        if (in == 0)
+            return total; /* EOF from the origin */
+
+        /* a short read cancels the linked send, and a send may itself
+         * fall short: send what is left in the pipe, waiting for the
+         * client no longer than out_ts each time */
+        while (out < in) {
+            if ((n = ring_send(&relay->ring, relay->pipe[0], dstfd, in - out, out_ts)) < 0)
+                return -1;
+            out += n;
+        }
+        total += in;
+    }
+}
+/* $end uring_relay */
+
+/*
+ * ring_send - wait up to ts for dstfd to take more, then splice up to
+ * len bytes from pipefd into it
+ * Returns the bytes sent (0 if none fit after all), or -1 if the wait
+ * timed out or the splice failed.
+ */
+static int ring_send(ring_t *r, int pipefd, int dstfd, unsigned len, struct __kernel_timespec *ts)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    int n, ready = 0, res = -1;
+
+    sqe = ring_get_sqe(r);
+    prep_poll(sqe, dstfd, POLLOUT);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = 1;
+    sqe = ring_get_sqe(r);
+    prep_link_timeout(sqe, ts);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = ring_get_sqe(r);
+    prep_splice(sqe, pipefd, dstfd, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    sqe->user_data = 2;
+    if (ring_submit_wait(r, 3, 3) < 0)
+        return -1;
+    for (n = 0; n < 3 && ring_reap(r, &cqe); n++) {
+        if (cqe.user_data == 1)
+            ready = cqe.res;
+        else if (cqe.user_data == 2)
+            res = cqe.res;
+    }
+    if (ready < 0) /* -ECANCELED: the client stopped reading */
+        return -1;
+    return res == -EAGAIN ? 0 : res < 0 ? -1 : res;
+}
+
+/*
+ * sock_timeout - the timeout a blocking call on fd would have, for a
+ * linked timeout; URING_STALL_SECS if fd has none
+ */
+static void sock_timeout(int fd, int optname, struct __kernel_timespec *ts)
+{
+    struct timeval tv = { 0, 0 };
+    socklen_t len = sizeof(tv);
+
+    getsockopt(fd, SOL_SOCKET, optname, &tv, &len);
+    if (!tv.tv_sec && !tv.tv_usec)
+        tv.tv_sec = URING_STALL_SECS;
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000LL;
+}
+
+/* relay_free - tear down the relay ring and pipe of a thread that exits */
+static void relay_free(void *vargp)
+{
+    relay_t *rl = vargp;
+
+    ring_teardown(&rl->ring);
+    close(rl->pipe[0]);
+    close(rl->pipe[1]);
+    free(rl);
+}
+
+
+/* ring plumbing */
+
+static int ring_setup(ring_t *r, unsigned entries)
+{
+    struct io_uring_params p;
+    void *sq, *cq;
+    size_t sqlen, cqlen;
+
+    memset(&p, 0, sizeof(p));
+    r->sq = r->cq = r->sqes = NULL;
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqlen > sqlen)
+        sqlen = cqlen;
+    sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+              r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    r->sq = sq;
+    r->sqlen = sqlen;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else if ((cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                        r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+    else {
+        r->cq = cq;
+        r->cqlen = cqlen;
+    }
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE, 
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_head = sq + p.sq_off.head;
+    r->sq_tail = sq + p.sq_off.tail;
+    r->sq_mask = sq + p.sq_off.ring_mask;
+    r->sq_array = sq + p.sq_off.array;
+    r->cq_head = cq + p.cq_off.head;
+    r->cq_tail = cq + p.cq_off.tail;
+    r->cq_mask = cq + p.cq_off.ring_mask;
+    r->cqes = cq + p.cq_off.cqes;
+    return 0;
+
+ fail:
+    ring_teardown(r);
+    return -1;
+}
+
+/* ring_teardown - unmap what ring_setup mapped and close the ring */
+static void ring_teardown(ring_t *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqeslen);
+    if (r->cq)
+        munmap(r->cq, r->cqlen);
+    if (r->sq)
+        munmap(r->sq, r->sqlen);
+    close(r->fd);
+}
+
+/* ring_get_sqe - next free submission entry, zeroed (the ring is never full here) */
+static struct io_uring_sqe *ring_get_sqe(ring_t *r)
+{
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static int ring_submit_wait(ring_t *r, unsigned submit, unsigned wait)
+{
+    return syscall(__NR_io_uring_enter, r->fd, submit, wait, 
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* ring_reap - pop one completion into *cqe; returns 0 if none is ready */
+static int ring_reap(ring_t *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void prep_splice(struct io_uring_sqe *sqe, int in, int out, unsigned len, unsigned flags)
+{
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = (__u64)-1;
+    sqe->fd = out;
+    sqe->off = (__u64)-1;
+    sqe->len = len;
+    sqe->splice_flags = flags;
+}
+static void prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events; /* little-endian hosts */
+}
+
+static void prep_link_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+}
+
+/* relay_plain - read/write copy loop, for threads without a ring */
+static ssize_t relay_plain(int srcfd, int dstfd)
+{
+    char buf[URING_CHUNK / 4];
+    ssize_t total = 0, n, m, off;
+
+    while ((n = read(srcfd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (off = 0; off < n; off += m)
+            if ((m = write(dstfd, buf + off, n - off)) < 0 && errno != EINTR)
+                return -1;
+            else if (m < 0)
+                m = 0;
+        total += n;
+    }
+    return total;
+}
+/* $end uring.c */
@@ -0,0 +1,22 @@
+/*
+ * uring.h - optional io_uring engine for the proxy's accept and relay paths
+ */
+/* $begin uring.h */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+
+#define URING_ENTRIES  64     /* submission queue depth per ring */
+#define URING_CHUNK    65536  /* bytes moved per linked splice pair */
+#define URING_STALL_SECS 15   /* splice timeout for a socket that sets none */
+
+extern int uring_enabled;     /* set once uring_init() succeeded */
+
+int uring_init(void);
+int uring_accept(int listenfd);
+void uring_accept_stop(void);
+ssize_t uring_relay(int srcfd, int dstfd);
+
+#endif /* __URING_H__ */
+/* $end uring.h */